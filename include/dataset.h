@@ -0,0 +1,147 @@
+#pragma once
+
+#include <string>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include "mapped_file.h"
+
+namespace pyramid {
+
+/**
+ * On-disk vector formats of the TEXMEX corpora (SIFT, GIST, SIFT1B)
+ *
+ * Every row is a 32-bit dimension header followed by dim components.
+ */
+enum class VecsFormat {
+    FVECS,  // float32 components
+    IVECS,  // int32 components (ground truth neighbor ids)
+    BVECS   // uint8 components
+};
+
+/**
+ * VecsView - Zero-copy strided view over the rows of a .*vecs file
+ *
+ * Rows are not contiguous on disk because each one is preceded by its
+ * dimension header, so consecutive rows are stride bytes apart.
+ */
+template <typename T>
+struct VecsView {
+    const uint8_t* base = nullptr;  // First component of row 0
+    size_t n = 0;                   // Number of rows in the view
+    int dim = 0;                    // Components per row
+    size_t stride = 0;              // Bytes between consecutive rows
+    
+    /**
+     * Get a pointer to the components of row i
+     */
+    const T* row(size_t i) const {
+        return reinterpret_cast<const T*>(base + i * stride);
+    }
+    
+    /**
+     * Get a view over rows [begin, end) of this view
+     */
+    VecsView<T> rows(size_t begin, size_t end) const {
+        return VecsView<T>{base + begin * stride, end - begin, dim, stride};
+    }
+};
+
+/**
+ * VecsFile - Memory-mapped reader for .fvecs, .ivecs and .bvecs files
+ *
+ * The file is mapped once and rows are exposed as views, so ranges of a
+ * base set larger than RAM can be streamed without loading the whole file.
+ */
+class VecsFile {
+public:
+    /**
+     * Map a file, deducing its format from the extension
+     *
+     * @param path Path of the .fvecs, .ivecs or .bvecs file
+     * @return True if the file was mapped and its size is consistent, false otherwise
+     */
+    bool open(const std::string& path);
+    
+    /**
+     * Map a file with an explicit format
+     *
+     * @param path Path of the file
+     * @param format Component type of the file
+     * @return True if the file was mapped and its size is consistent, false otherwise
+     */
+    bool open(const std::string& path, VecsFormat format);
+    
+    /**
+     * Check in parallel that every row header matches the dimension of row 0
+     *
+     * @return True if all headers match, false otherwise
+     */
+    bool validate() const;
+    
+    /**
+     * Convert rows [begin, end) to a contiguous float array
+     *
+     * @param begin First row to read
+     * @param end One past the last row to read
+     * @param out Output array (size: (end - begin) * dim)
+     * @param normalize Scale every row to unit length while converting (default: false)
+     */
+    void read_rows(size_t begin, size_t end, float* out, bool normalize = false) const;
+    
+    /**
+     * Get a view over the rows of an .fvecs file
+     */
+    VecsView<float> fvecs() const {
+        return view<float>();
+    }
+    
+    /**
+     * Get a view over the rows of an .ivecs file
+     */
+    VecsView<int32_t> ivecs() const {
+        return view<int32_t>();
+    }
+    
+    /**
+     * Get a view over the rows of a .bvecs file
+     */
+    VecsView<uint8_t> bvecs() const {
+        return view<uint8_t>();
+    }
+    
+    /**
+     * Get the number of rows in the file
+     */
+    size_t num_vectors() const {
+        return num_vectors_;
+    }
+    
+    /**
+     * Get the number of components per row
+     */
+    int dim() const {
+        return dim_;
+    }
+    
+    /**
+     * Get the component type of the file
+     */
+    VecsFormat format() const {
+        return format_;
+    }
+
+private:
+    MappedFile file_;                        // Mapping of the whole file
+    VecsFormat format_ = VecsFormat::FVECS;  // Component type
+    int dim_ = 0;                            // Components per row
+    size_t num_vectors_ = 0;                 // Number of rows
+    size_t stride_ = 0;                      // Bytes per row including the header
+    
+    template <typename T>
+    VecsView<T> view() const {
+        return VecsView<T>{file_.data() + sizeof(int32_t), num_vectors_, dim_, stride_};
+    }
+};
+
+} // namespace pyramid
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <string>
+#include <cstddef>
+#include <cstdint>
+
+namespace pyramid {
+
+/**
+ * MappedFile - Read-only memory mapping of a whole file
+ *
+ * The mapping stays valid until close() is called or the object is
+ * destroyed, so anything holding pointers into data() must not outlive it.
+ * Instead of mapping the file, load() copies it into an anonymous mapping
+ * (an arena) that does not depend on the page cache.
+ */
+class MappedFile {
+public:
+    MappedFile() = default;
+    
+    /**
+     * Destructor, unmaps the file
+     */
+    ~MappedFile();
+    
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    
+    /**
+     * Map a file into memory
+     *
+     * @param path Path of the file to map
+     * @param random_access Hint the kernel that pages are touched in random order,
+     *                      which disables read-ahead (default: false)
+     * @return True if the file was mapped, false otherwise
+     */
+    bool open(const std::string& path, bool random_access = false);
+    
+    /**
+     * Read a whole file into a private anonymous mapping
+     *
+     * @param path Path of the file to read
+     * @param huge_pages Advise the kernel to back the mapping with transparent
+     *                   huge pages (default: false)
+     * @return True if the file was read, false otherwise
+     */
+    bool load(const std::string& path, bool huge_pages = false);
+    
+    /**
+     * Unmap the file if it is mapped
+     */
+    void close();
+    
+    /**
+     * Drop the resident pages of a byte range so they are read again on next access
+     *
+     * Only whole pages inside the range are released. The mapping stays valid.
+     * Does nothing for a file copied by load(), whose pages cannot be read again.
+     *
+     * @param offset Offset of the range in bytes
+     * @param size Length of the range in bytes
+     */
+    void release(size_t offset, size_t size) const;
+    
+    /**
+     * Get a pointer to the first byte of the mapping
+     */
+    const uint8_t* data() const {
+        return data_;
+    }
+    
+    /**
+     * Get the size of the mapped file in bytes
+     */
+    size_t size() const {
+        return size_;
+    }
+    
+    /**
+     * Check whether a file is currently mapped
+     */
+    bool is_open() const {
+        return data_ != nullptr;
+    }
+
+private:
+    const uint8_t* data_ = nullptr;  // Start of the mapping
+    size_t size_ = 0;                // Length of the file in bytes
+    size_t mapping_size_ = 0;        // Length of the mapping in bytes (size_ rounded up for load())
+    bool anonymous_ = false;         // Copied by load() rather than mapped
+};
+
+} // namespace pyramid
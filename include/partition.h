@@ -9,6 +9,11 @@ namespace pyramid {
 /**
  * Perform k-means clustering on a dataset using FAISS
  *
+ * Centroids are trained on a random sample of the dataset, so only the
+ * sample is copied; every point is then assigned to its nearest centroid.
+ * With METRIC_INNER_PRODUCT the clustering is spherical: centroids are
+ * normalized and points go to the centroid with the largest inner product.
+ *
  * @param dataset Pointer to the dataset vectors
  * @param n Number of vectors in the dataset
  * @param dim Dimension of feature vectors
@@ -17,11 +22,27 @@ namespace pyramid {
  * @param assignments Output array for cluster assignments (size: n)
  * @param niter Number of iterations for k-means (default: 25)
  * @param verbose Whether to print progress information (default: false)
+ * @param sample_size Number of points to train on (default: 0, meaning 256 per cluster)
+ * @param seed Seed of the sampling and k-means initialization (default: 1234)
+ * @param metric METRIC_L2 or METRIC_INNER_PRODUCT (default: METRIC_L2)
+ * @param normalize Normalize the training sample, for cosine similarity (default: false)
  * @return True if clustering succeeded, false otherwise
  */
 bool kmeans_cluster(const float* dataset, size_t n, int dim, int k,
                     float* cluster_centers, int* assignments, 
-                    int niter = 25, bool verbose = false);
+                    int niter = 25, bool verbose = false,
+                    size_t sample_size = 0, int seed = 1234,
+                    faiss::MetricType metric = faiss::METRIC_L2, bool normalize = false);
+
+/**
+ * Draw a uniform random sample of row indices without replacement
+ *
+ * @param n Number of rows to sample from
+ * @param sample_size Number of rows to draw (clamped to n)
+ * @param seed Random seed
+ * @return Sorted row indices
+ */
+std::vector<size_t> sample_rows(size_t n, size_t sample_size, int seed);
 
 /**
  * Helper function to copy faiss::idx_t values to int array
@@ -35,15 +56,81 @@ void copy_idx_to_int(const faiss::idx_t* src, int* dst, size_t n);
 /**
  * Assign data points to their nearest cluster
  *
+ * Points are processed in parallel chunks so temporary buffers stay
+ * bounded regardless of n.
+ *
  * @param dataset Pointer to the dataset vectors
  * @param n Number of vectors in the dataset
  * @param dim Dimension of feature vectors
  * @param cluster_centers Array of cluster centers
  * @param k Number of clusters
  * @param assignments Output array for cluster assignments (size: n)
+ * @param metric METRIC_L2 (nearest center) or METRIC_INNER_PRODUCT (largest
+ *               inner product) (default: METRIC_L2)
  */
 void assign_to_clusters(const float* dataset, size_t n, int dim, 
-                      const float* cluster_centers, int k, int* assignments);
+                      const float* cluster_centers, int k, int* assignments,
+                      faiss::MetricType metric = faiss::METRIC_L2);
+
+/**
+ * Assign data points to clusters without exceeding a per-cluster capacity
+ *
+ * Points are placed greedily, those with the largest gap between their
+ * nearest and second-nearest center first, into the nearest of their
+ * num_candidates closest centers that still has room. Points whose
+ * candidates are all full go to the nearest center with room left.
+ * Candidates are searched in bounded chunks, so beyond the output only
+ * O(n) temporary memory is used, not O(n * num_candidates).
+ *
+ * @param dataset Pointer to the dataset vectors
+ * @param n Number of vectors in the dataset
+ * @param dim Dimension of feature vectors
+ * @param cluster_centers Array of cluster centers
+ * @param k Number of clusters
+ * @param capacity Maximum number of points per cluster (capacity * k must be at least n)
+ * @param assignments Output array for cluster assignments (size: n)
+ * @param num_candidates Nearest centers considered per point (default: 8)
+ * @param metric METRIC_L2 or METRIC_INNER_PRODUCT (default: METRIC_L2)
+ * @return True if every point was assigned, false if the capacity is too small
+ */
+bool balanced_assign_to_clusters(const float* dataset, size_t n, int dim,
+                                 const float* cluster_centers, int k, size_t capacity,
+                                 int* assignments, int num_candidates = 8,
+                                 faiss::MetricType metric = faiss::METRIC_L2);
+
+/**
+ * Size distribution of a partitioning
+ */
+struct PartitionSizeStats {
+    size_t min_size = 0;       // Smallest partition
+    size_t max_size = 0;       // Largest partition
+    double mean_size = 0.0;    // Average partition size
+    double stddev = 0.0;       // Standard deviation of partition sizes
+    double imbalance = 0.0;    // max_size / mean_size (1.0 is perfectly balanced)
+};
+
+/**
+ * Compute the size distribution of a set of partitions
+ *
+ * @param sizes Number of points in each partition
+ * @return Min, max, mean, standard deviation and imbalance of the sizes
+ */
+PartitionSizeStats compute_partition_size_stats(const std::vector<size_t>& sizes);
+
+/**
+ * Compute the mean of the points assigned to each cluster, in parallel
+ *
+ * @param dataset Pointer to the dataset vectors
+ * @param n Number of vectors in the dataset
+ * @param dim Dimension of feature vectors
+ * @param assignments Cluster assignments for each data point
+ * @param k Number of clusters
+ * @param cluster_centers Output array for the means (size: k * dim); empty clusters get zeros
+ * @param spherical Average unit-length points and normalize the means (default: false)
+ */
+void compute_cluster_means(const float* dataset, size_t n, int dim,
+                           const int* assignments, int k, float* cluster_centers,
+                           bool spherical = false);
 
 /**
  * Extract vectors belonging to each cluster
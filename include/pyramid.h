@@ -2,13 +2,176 @@
 
 #include <vector>
 #include <memory>
+#include <functional>
 #include <unordered_map>
+#include <string>
 #include <faiss/IndexHNSW.h>
 #include <faiss/IndexFlat.h>
+#include <faiss/VectorTransform.h>
 #include <faiss/utils/distances.h>
+#include "dataset.h"
+#include "partition.h"
+#include "search_stats.h"
+#include "query_cache.h"
+#include "residency.h"
+#include "routing_tree.h"
 
 namespace pyramid {
 
+class MappedFile;
+struct SearchContext;
+class TopKHeap;
+
+/**
+ * Similarity measure used throughout the index
+ *
+ * For INNER_PRODUCT and COSINE, search() returns similarities, largest first.
+ */
+enum class Metric {
+    L2,             // Squared Euclidean distance, smallest first
+    INNER_PRODUCT,  // Inner product, largest first
+    COSINE          // Cosine similarity: inner product of vectors normalized on ingestion
+};
+
+/**
+ * Vector storage used by the sub-HNSW graphs
+ */
+enum class StorageCodec {
+    FLAT,   // Full float32 vectors (IndexHNSWFlat)
+    SQ8,    // 8-bit scalar quantization (IndexHNSWSQ), 4x smaller
+    FP16,   // Half-precision floats (IndexHNSWSQ), 2x smaller
+    PQ      // Product quantization with pq_m bytes per vector (IndexHNSWPQ)
+};
+
+/**
+ * Learned linear map applied to every vector before routing and graph search
+ */
+enum class VectorTransform {
+    NONE,   // Graphs hold the vectors as given
+    PCA,    // Projection onto the leading principal components
+    OPQ     // Rotation optimized for pq_m sub-quantizers, truncated to transform_dim
+};
+
+/**
+ * Parameters controlling how PyramidGraph::build() constructs the index
+ */
+struct BuildParams {
+    int partition_threads = 0;      // Sub-HNSW graphs built concurrently (0: one per OpenMP thread)
+    int threads_per_partition = 0;  // OpenMP threads FAISS may use inside each sub-HNSW (0: remaining share)
+    bool verbose = false;           // Print per-phase timings when the build finishes
+    StorageCodec codec = StorageCodec::FLAT;  // Vector storage of the sub-HNSW graphs
+    int pq_m = 16;                  // PQ sub-quantizers (must divide the dimension)
+    size_t codec_train_size = 65536;  // Vectors sampled to train the SQ/PQ codec and the transform
+    bool balanced = false;          // Cap partition sizes with capacity-constrained assignment
+    float max_partition_ratio = 1.2f;  // Balanced mode: capacity is this ratio times n / num_clusters
+    int max_replicas = 1;           // Partitions a vector may be stored in (1: no replication)
+    float replication_ratio = 1.1f; // Replicate into a partition whose centroid is within this
+                                    //  distance ratio of the nearest centroid
+    size_t kmeans_sample_size = 0;  // Vectors sampled to train k-means (0: 256 per partition)
+    int kmeans_seed = 1234;         // Seed of the k-means sample and initialization
+    std::vector<int> routing_levels;  // Nodes per routing level above the partitions, coarsest first
+                                      //  (empty: the meta-HNSW alone routes to the partitions)
+    VectorTransform transform = VectorTransform::NONE;  // Reduce vectors before clustering and graph builds
+    int transform_dim = 0;          // Output dimension of the transform (0: dim / 4)
+    size_t stream_chunk_size = 65536;  // build_from_file(): rows read, assigned and spilled per step
+    std::string spill_directory;    // build_from_file(): where partition spill files are written
+                                    //  (empty: the system temporary directory)
+    bool locality_order = false;    // Renumber each sub-HNSW's nodes in breadth-first order from its
+                                    //  entry point, so that graph neighbors sit close in memory
+};
+
+/**
+ * Wall-clock time spent in each phase of the last build, in milliseconds
+ *
+ * Gather and graph build run interleaved on the partition threads, so their
+ * times are summed over partitions; sub_graphs_ms is the wall-clock time of
+ * the whole parallel section.
+ */
+struct BuildStats {
+    double kmeans_ms = 0.0;         // Step 3-4: k-means partitioning
+    double centroid_ms = 0.0;       // Step 5: centroid extraction and meta-HNSW build
+    double gather_ms = 0.0;         // Copying each partition's vectors into a contiguous block
+    double graph_build_ms = 0.0;    // Adding vectors to the sub-HNSW graphs
+    double sub_graphs_ms = 0.0;     // Step 11-12 wall-clock time
+    double stream_ms = 0.0;         // build_from_file(): reading, assigning and spilling the vectors
+    double total_ms = 0.0;          // Whole build
+    PartitionSizeStats partition_sizes;  // Size distribution of the partitions
+    size_t replicated_entries = 0;  // Extra partition entries created by boundary replication
+    int partition_threads = 0;      // Sub-HNSW graphs built concurrently
+    int threads_per_partition = 0;  // OpenMP threads inside each sub-HNSW build
+};
+
+/**
+ * Per-call options for PyramidGraph::search() and search_batch()
+ *
+ * In adaptive mode partitions are visited nearest-first and the next one is
+ * only searched while its centroid distance from the meta-HNSW is within
+ * probe_ratio times the current k-th result distance; nprobe is then the
+ * probe budget.
+ */
+struct SearchParams {
+    int nprobe = 2;             // Number of partitions to search (maximum in adaptive mode)
+    bool adaptive = false;      // Stop probing early based on centroid distances (ignored for
+                                //  INNER_PRODUCT, whose result similarities have no fixed scale)
+    float probe_ratio = 1.0f;   // Adaptive cut-off relative to the k-th result distance
+    int ef_search = 0;          // efSearch for the sub-HNSW graphs (0: value from the constructor)
+    int rerank_factor = 4;      // Quantized or transformed storage: candidates per partition are
+                                //  rerank_factor * k, re-ranked against the full vectors when attached
+    int routing_beam = 0;       // Routing tree: nodes kept per level (0: max(8, 2 * nprobe))
+    SearchStats* stats = nullptr;  // Filled with per-call statistics when set (reset by the call)
+};
+
+/**
+ * Restriction of PyramidGraph::search_filtered() to a subset of the vectors
+ *
+ * A vector qualifies when it passes every condition that is set. Attribute
+ * conditions also prune whole partitions from their per-partition counts
+ * before routing; id bitmaps and predicates are checked against the ids of
+ * each probed partition.
+ */
+struct SearchFilter {
+    std::vector<int32_t> attributes;     // Accepted attribute values (see set_attributes(); -1: none), empty: any
+    const uint8_t* id_bitmap = nullptr;  // Accepted global ids, bit id % 8 of byte id / 8 (nullptr: any)
+    size_t id_bitmap_size = 0;           // Number of ids covered by id_bitmap; larger ids are rejected
+    std::function<bool(faiss::idx_t)> predicate;  // Accepted global ids (empty: any)
+    size_t brute_force_limit = 256;      // Scan exhaustively when at most this many vectors of a partition
+                                         //  qualify, or of the whole index according to the attribute counts
+    float brute_force_ratio = 0.02f;     // Also scan a partition when at most this share of it qualifies
+};
+
+/**
+ * Variable-length results of PyramidGraph::range_search()
+ *
+ * The hits of query q are entries lims[q] to lims[q + 1] - 1 of ids and
+ * distances, best first.
+ */
+struct RangeSearchResults {
+    std::vector<size_t> lims;       // Start of each query's hits (size: nq + 1)
+    std::vector<faiss::idx_t> ids;  // Global ids of the hits
+    std::vector<float> distances;   // Distances (or similarities) of the hits
+};
+
+/**
+ * Thresholds deciding which partitions PyramidGraph::compact() rebuilds
+ */
+struct CompactParams {
+    size_t max_partition_size = 0;      // Split partitions with more live vectors than this (0: never split)
+    float max_deleted_fraction = 0.2f;  // Rebuild partitions whose share of removed entries exceeds this
+};
+
+/**
+ * Options of PyramidGraph::load()
+ */
+struct LoadOptions {
+    bool use_mmap = true;           // Memory-map the graph arrays instead of copying them
+    const std::vector<int>* partitions = nullptr;  // Partitions to load (nullptr: all of them)
+    bool lazy = false;              // Read each sub-HNSW graph on its first probe instead of up front
+    size_t residency_budget = 0;    // Lazy mode: bytes of sub-HNSW graphs kept resident (0: unlimited)
+    bool arena = false;             // Read the whole file into one anonymous allocation and use the
+                                    //  graph arrays in place (ignored in lazy mode)
+    bool huge_pages = false;        // Arena: ask for transparent huge pages to cut TLB misses
+};
+
 /**
  * PyramidGraph - Main class for the Pyramid HNSW implementation
  * 
@@ -26,9 +189,11 @@ public:
      * @param m Number of connections per node in HNSW graph (default: 32)
      * @param ef_construction Size of the dynamic candidate list during construction (default: 40)
      * @param ef_search Size of the candidate list during search (default: 16)
+     * @param metric Similarity measure for clustering, routing and search (default: L2)
      */
     PyramidGraph(int dim, int num_clusters, 
-                int m = 32, int ef_construction = 40, int ef_search = 16);
+                int m = 32, int ef_construction = 40, int ef_search = 16,
+                Metric metric = Metric::L2);
     
     /**
      * Destructor
@@ -38,11 +203,48 @@ public:
     /**
      * Build the pyramid structure from a dataset
      * 
+     * Any previous content is discarded, including vectors added or removed
+     * since the last build and partitions split by compact(), whose count
+     * returns to the configured one.
+     * 
      * @param dataset Pointer to the dataset vectors
      * @param n Number of vectors in the dataset
      */
     void build(const float* dataset, size_t n);
     
+    /**
+     * Build the pyramid structure from a .fvecs or .bvecs file larger than memory
+     *
+     * The transform, k-means and codec are trained on a sample of the file.
+     * The file is then streamed in chunks of stream_chunk_size rows: a reader
+     * thread converts the next chunk while the current one is assigned to its
+     * partitions and a writer thread appends the previous one to per-partition
+     * spill files. Each sub-HNSW graph is finally built from its spill file,
+     * so peak memory is bounded by partition_threads partitions rather than by
+     * the dataset. Ids are the row numbers of the file. Previous content is
+     * discarded as by build().
+     *
+     * @param path Path of the base vectors
+     * @return True if the index was built, false otherwise
+     */
+    bool build_from_file(const std::string& path);
+
+    /**
+     * Set the parameters used by subsequent calls to build()
+     *
+     * @param params Thread split and reporting options
+     */
+    void set_build_params(const BuildParams& params) {
+        build_params_ = params;
+    }
+
+    /**
+     * Get the per-phase timings of the last build()
+     */
+    const BuildStats& build_stats() const {
+        return build_stats_;
+    }
+    
     /**
      * Search for k nearest neighbors to the query vector
      * 
@@ -50,9 +252,408 @@ public:
      * @param k Number of neighbors to return
      * @param indices Output array for the indices of neighbors
      * @param distances Output array for the distances to neighbors
+     * @param params Probing options, or nullptr for the defaults
      */
-    void search(const float* query, int k, int* indices, float* distances) const;
+    void search(const float* query, int k, int* indices, float* distances,
+                const SearchParams* params = nullptr) const;
+    
+    /**
+     * Search for k nearest neighbors using caller-owned scratch buffers
+     *
+     * The overload without a context uses a thread-local one; pass a context
+     * explicitly to control its lifetime. A context must not be used by two
+     * queries at the same time.
+     *
+     * @param query Pointer to the query vector
+     * @param k Number of neighbors to return
+     * @param indices Output array for the indices of neighbors
+     * @param distances Output array for the distances to neighbors
+     * @param context Scratch buffers reused across queries
+     * @param params Probing options, or nullptr for the defaults
+     */
+    void search(const float* query, int k, int* indices, float* distances,
+                SearchContext& context, const SearchParams* params = nullptr) const;
+
+    /**
+     * Search for the k nearest neighbors of a batch of query vectors
+     *
+     * All queries are routed through the meta-HNSW graph in a single call,
+     * then grouped by selected partition so that each sub-HNSW graph is
+     * searched once per batch with all of the queries that probe it.
+     * Partitions are processed in parallel with OpenMP.
+     *
+     * @param nq Number of query vectors
+     * @param queries Pointer to the query vectors (size: nq * dim)
+     * @param k Number of neighbors to return per query
+     * @param indices Output array for the indices of neighbors (size: nq * k)
+     * @param distances Output array for the distances to neighbors (size: nq * k)
+     * @param params Probing options, or nullptr for the defaults
+     */
+    void search_batch(size_t nq, const float* queries, int k,
+                      int* indices, float* distances,
+                      const SearchParams* params = nullptr) const;
+
+    /**
+     * Search for the k nearest neighbors among the vectors that pass a filter
+     *
+     * Partitions whose attribute counts rule out every vector are excluded
+     * from routing, so the nprobe nearest partitions that can contain
+     * qualifying vectors are probed. Within a partition the filter becomes a
+     * local id selector for the sub-HNSW search; when only a few vectors
+     * qualify (see SearchFilter) they are compared exhaustively instead,
+     * since a graph search degrades when most nodes are filtered out. When
+     * the attribute counts bound the qualifying vectors of the whole index by
+     * brute_force_limit, all of them are scanned and the result is exact.
+     * The query cache and adaptive probing do not apply.
+     *
+     * @param query Pointer to the query vector
+     * @param k Number of neighbors to return
+     * @param filter Condition on the returned vectors
+     * @param indices Output array for the indices of neighbors
+     * @param distances Output array for the distances to neighbors
+     * @param params Probing options, or nullptr for the defaults
+     */
+    void search_filtered(const float* query, int k, const SearchFilter& filter,
+                         int* indices, float* distances, const SearchParams* params = nullptr) const;
+
+    /**
+     * Find every vector within a radius of each query
+     *
+     * A hit has a squared L2 distance below radius, or a similarity above
+     * radius for INNER_PRODUCT and COSINE. Each partition records the radius
+     * of a ball around its centroid that covers all of its vectors, so the
+     * triangle inequality on the exact query-centroid distances rules out
+     * partitions that cannot hold a hit; nprobe does not apply. The queries
+     * left for each partition are range-searched in its sub-HNSW graph in one
+     * batch, with partitions processed in parallel. Like a top-k search the
+     * sub-HNSW range search is approximate; a larger efSearch finds more hits.
+     *
+     * @param nq Number of query vectors
+     * @param queries Pointer to the query vectors (size: nq * dim)
+     * @param radius Distance (or similarity) threshold
+     * @param results Output hits with global ids, replaced by the call
+     * @param params efSearch override and statistics, or nullptr for the defaults
+     */
+    void range_search(size_t nq, const float* queries, float radius, RangeSearchResults& results,
+                      const SearchParams* params = nullptr) const;
+    
+    /**
+     * Find every vector within a radius of one query
+     *
+     * @param query Pointer to the query vector
+     * @param radius Distance (or similarity) threshold
+     * @param results Output hits with global ids, replaced by the call
+     * @param params efSearch override and statistics, or nullptr for the defaults
+     */
+    void range_search(const float* query, float radius, RangeSearchResults& results,
+                      const SearchParams* params = nullptr) const {
+        range_search(1, query, radius, results, params);
+    }
 
+    /**
+     * Select the partitions to probe for a batch of queries with the routing
+     * tree, or with the meta-HNSW graph when there is none
+     *
+     * This is the routing half of search(), for callers that search the
+     * partitions elsewhere (e.g. ShardRouter). Slots past the number of
+     * partitions are filled with id -1.
+     *
+     * @param nq Number of query vectors
+     * @param queries Pointer to the query vectors (size: nq * dim)
+     * @param nprobe Number of partitions to select per query
+     * @param partition_ids Output partition ids, nearest first (size: nq * nprobe)
+     * @param partition_distances Output centroid distances (size: nq * nprobe)
+     * @param beam Routing tree nodes kept per level, like SearchParams::routing_beam (0: default)
+     */
+    void route(size_t nq, const float* queries, int nprobe,
+               faiss::idx_t* partition_ids, float* partition_distances, int beam = 0) const;
+    
+    /**
+     * Search only the given partitions and merge their top k
+     *
+     * This is the sub-graph half of search(). Partitions that are empty or not
+     * loaded in this process are skipped; adaptive probing does not apply.
+     *
+     * @param query Pointer to the query vector
+     * @param k Number of neighbors to return
+     * @param partitions Partition ids to search
+     * @param num_partitions Number of partition ids
+     * @param indices Output array for the indices of neighbors
+     * @param distances Output array for the distances to neighbors
+     * @param params efSearch and re-rank options, or nullptr for the defaults
+     */
+    void search_partitions(const float* query, int k, const int* partitions, int num_partitions,
+                           int* indices, float* distances, const SearchParams* params = nullptr) const;
+
+    /**
+     * Use an in-memory array of full-precision vectors to re-rank quantized or transformed results
+     *
+     * Row i must hold the vector with global id i; the array must outlive the graph.
+     * Candidates with an id of n or more keep their approximate distance and
+     * are ranked against exact ones, so vectors added later need a new call
+     * covering their ids.
+     *
+     * @param vectors Pointer to the vectors (size: n * dim)
+     * @param n Number of vectors
+     */
+    void set_rerank_vectors(const float* vectors, size_t n);
+    
+    /**
+     * Memory-map an .fvecs file of full-precision vectors to re-rank quantized or transformed results
+     *
+     * Row i must hold the vector with global id i, which is the case for the
+     * base file the index was built from.
+     *
+     * @param path Path of the .fvecs file
+     * @return True if the file was mapped and matches the index dimension, false otherwise
+     */
+    bool attach_rerank_vectors(const std::string& path);
+
+    /**
+     * Insert vectors into a built graph without rebuilding it
+     *
+     * Each vector is routed like a query (routing tree or meta-HNSW) to its nearest
+     * partition (and replicated like in build()) and appended to that
+     * partition's sub-HNSW graph and id map. With quantized or transformed
+     * storage, re-rank vectors must be attached again to cover the new ids
+     * (a warning is printed otherwise). On a graph loaded with use_mmap
+     * or arena, a partition's sub-HNSW is first copied out of the mapping
+     * into memory the first time it receives entries.
+     * Must not run concurrently with searches or other updates.
+     *
+     * @param n Number of vectors to add
+     * @param vectors Pointer to the vectors (size: n * dim)
+     * @param ids Global ids of the vectors, or nullptr to number them after the largest id so far
+     * @param attributes Attribute value of each vector for filtered search, or nullptr for none (-1)
+     */
+    void add(size_t n, const float* vectors, const faiss::idx_t* ids = nullptr,
+             const int32_t* attributes = nullptr);
+    
+    /**
+     * Remove vectors by global id
+     *
+     * Entries are tombstoned and filtered out of every subsequent search;
+     * their graph nodes are reclaimed by compact(). Must not run concurrently
+     * with searches or other updates.
+     *
+     * @param n Number of ids
+     * @param ids Global ids to remove
+     * @return Number of entries that were removed
+     */
+    size_t remove(size_t n, const faiss::idx_t* ids);
+    
+    /**
+     * Rebuild only the partitions that are too large or have too many removed entries
+     *
+     * Partitions over max_deleted_fraction are rebuilt from their live
+     * vectors. Partitions over max_partition_size are split with k-means into
+     * new partitions, and the meta-HNSW graph is rebuilt over the updated
+     * centroids. Quantized partitions are rebuilt from the re-rank vectors
+     * when attached, otherwise from their decoded (lossy) entries, which adds
+     * a second round of quantization error. Must not run concurrently with
+     * searches or other updates.
+     *
+     * @param params Rebuild thresholds
+     * @return Number of partitions that were rebuilt
+     */
+    int compact(const CompactParams& params = CompactParams());
+    
+    /**
+     * Renumber the nodes of every sub-HNSW graph in breadth-first order from
+     * its entry point, as BuildParams::locality_order does during a build
+     *
+     * Global ids are unchanged. Graphs used in place from a load() mapping or
+     * arena cannot be reordered; load them with use_mmap = false first. Must
+     * not run concurrently with searches or other updates.
+     *
+     * @return Number of partitions that were reordered
+     */
+    int reorder_partitions();
+
+    /**
+     * Save the index to a single versioned file
+     *
+     * The file holds the build parameters, the meta-HNSW graph, every
+     * sub-HNSW graph, the partition id maps and the removal tombstones.
+     * It is written to path + ".tmp" and renamed over path, so an index
+     * loaded from path with use_mmap can be saved back to it.
+     *
+     * @param path Path of the file to write
+     * @return True if the index was written, false otherwise
+     */
+    bool save(const std::string& path) const;
+    
+    /**
+     * Load an index written by save()
+     *
+     * With use_mmap the file stays mapped for the lifetime of the returned
+     * graph and the vector and neighbor arrays of every HNSW graph point into
+     * the mapping instead of being copied, so pages are only read from disk
+     * once a partition is searched.
+     *
+     * A shard process loads only the partitions it serves; the others keep
+     * neither their sub-HNSW graph nor their id map. Such a partial graph can
+     * route and search, but cannot be updated or saved.
+     *
+     * @param path Path of the file to read
+     * @param use_mmap Whether to memory-map the graph arrays (default: true)
+     * @param partitions Partitions to load, or nullptr for all of them (default: nullptr)
+     * @return The loaded graph, or nullptr if the file could not be read
+     */
+    static std::unique_ptr<PyramidGraph> load(const std::string& path, bool use_mmap = true,
+                                              const std::vector<int>* partitions = nullptr);
+    
+    /**
+     * Load an index written by save(), optionally with lazy partition residency
+     *
+     * In lazy mode only the meta-HNSW graph, the id maps and the tombstones
+     * are read up front; a sub-HNSW graph is read from the file the first
+     * time a query probes its partition. Once the resident graphs exceed
+     * residency_budget bytes the least recently probed ones are dropped and
+     * read again on their next probe. The file stays mapped for the lifetime
+     * of the graph. A lazily loaded graph is read-only, like a partial one.
+     *
+     * With arena the whole file is read up front into one anonymous
+     * allocation, optionally backed by huge pages, and the graph arrays are
+     * used in place from it: all partitions share one contiguous block that
+     * no longer depends on the page cache.
+     *
+     * @param path Path of the file to read
+     * @param options Mapping, partition subset, residency and arena options
+     * @return The loaded graph, or nullptr if the file could not be read
+     */
+    static std::unique_ptr<PyramidGraph> load(const std::string& path, const LoadOptions& options);
+
+    /**
+     * Enable or disable the aggregate search metrics
+     *
+     * When disabled (the default) searches skip all timing and counting.
+     * Must not be called concurrently with searches.
+     *
+     * @param enable True to collect metrics
+     */
+    void enable_metrics(bool enable);
+    
+    /**
+     * Get a copy of the aggregate search metrics (all zero when disabled)
+     */
+    SearchMetricsSnapshot metrics() const;
+    
+    /**
+     * Reset the aggregate search metrics to zero
+     */
+    void reset_metrics();
+    
+    /**
+     * Put a query cache in front of search()
+     *
+     * The cache is emptied by every build, add, remove, compact and change of
+     * the re-rank vectors. search_batch() does not use it. Must not be called
+     * concurrently with searches.
+     *
+     * @param params Budget and tiers; a zero budget or no enabled tier removes the cache
+     */
+    void enable_query_cache(const QueryCacheParams& params);
+    
+    /**
+     * Get the hit and size counters of the query cache (all zero when disabled)
+     */
+    QueryCacheStats query_cache_stats() const;
+
+    /**
+     * Set the attribute value (e.g. tenant or category) of every vector for filtered search
+     *
+     * Vectors with an id of n or more get no attribute (-1). Each partition
+     * keeps a count per attribute value so that search_filtered() can skip
+     * partitions without a qualifying vector. Values are saved with the index.
+     * Must not run concurrently with searches or updates.
+     *
+     * @param values Attribute value by global id
+     * @param n Number of values
+     */
+    void set_attributes(const int32_t* values, size_t n);
+    
+    /**
+     * Get the number of entries of a partition with an attribute value
+     *
+     * Removed entries are counted until the partition is compacted.
+     *
+     * @param c Partition index
+     * @param value Attribute value (-1: no attribute)
+     */
+    size_t attribute_count(int c, int32_t value) const;
+    
+    /**
+     * Get the Euclidean radius of a ball around a partition's centroid that covers its vectors
+     *
+     * @param c Partition index
+     */
+    float covering_radius(int c) const {
+        return covering_radii_[c];
+    }
+
+    /**
+     * Get the similarity measure of the index
+     */
+    Metric metric() const {
+        return metric_;
+    }
+    
+    /**
+     * Get the dimension of the feature vectors
+     */
+    int dim() const {
+        return dim_;
+    }
+    
+    /**
+     * Get the dimension the graphs route and search in (dim() without a transform)
+     */
+    int graph_dim() const {
+        return graph_dim_;
+    }
+    
+    /**
+     * Get the number of partitions
+     */
+    int num_partitions() const {
+        return num_clusters_;
+    }
+    
+    /**
+     * Check whether only a subset of the partitions was loaded
+     */
+    bool is_partial() const {
+        return partial_;
+    }
+    
+    /**
+     * Get the number of routing tree levels above the partitions (0: routed by the meta-HNSW)
+     */
+    int routing_depth() const {
+        return routing_tree_ ? routing_tree_->num_levels() : 0;
+    }
+    
+    /**
+     * Check whether the sub-HNSW graphs are loaded on demand
+     */
+    bool is_lazy() const {
+        return residency_ != nullptr;
+    }
+    
+    /**
+     * Get the residency counters of a lazily loaded graph (all zero otherwise)
+     */
+    ResidencyStats residency_stats() const;
+    
+    /**
+     * Get the bytes held by the index structures: vector codes and neighbor
+     * lists of the meta-HNSW and of every resident sub-HNSW graph, the id
+     * maps, tombstones, attributes and the transform. Graphs used in place
+     * from a load() mapping are counted, attached re-rank vectors are not.
+     */
+    size_t memory_bytes() const;
+    
     /**
      * Get the number of vectors indexed
      */
@@ -62,24 +663,435 @@ public:
 
 private:
     int dim_;                    // Dimension of feature vectors
+    int graph_dim_;              // Dimension of the vectors stored in the graphs
     int num_clusters_;           // Number of partitions
+    int configured_clusters_;    // Partitions a build creates; compact() can split beyond it
     int m_;                      // Number of connections per node in HNSW graph
     int ef_construction_;        // Dynamic candidate list size during construction
     int ef_search_;              // Dynamic candidate list size during search
-    size_t total_vectors_;       // Total number of vectors indexed
+    size_t total_vectors_;       // Total number of live vectors indexed
+    faiss::idx_t next_id_;       // Id given to the next vector added without an explicit id
+    StorageCodec codec_;         // Vector storage of the sub-HNSW graphs
+    int pq_m_;                   // PQ sub-quantizers when codec_ is PQ
+    int max_replicas_;           // Partitions a vector may be stored in
+    float replication_ratio_;    // Centroid distance ratio for boundary replication
+    Metric metric_;              // Similarity measure
+    bool partial_;               // Loaded with a subset of the partitions (read-only)
+    BuildParams build_params_;   // Scheduling options for build()
+    BuildStats build_stats_;     // Timings of the last build()
+    std::unique_ptr<SearchMetrics> metrics_;  // Aggregate search metrics, null while disabled
+    std::unique_ptr<QueryCache> query_cache_; // Repeated-query cache, null while disabled
+    std::unique_ptr<faiss::LinearTransform> transform_;  // Map into the graph space, null without a transform
     
+    std::unique_ptr<MappedFile> mapped_file_;  // Backing file of a memory-mapped or lazy load(); must outlive the graphs
     std::unique_ptr<faiss::IndexHNSWFlat> meta_graph_;  // Top-level HNSW graph
-    std::vector<std::unique_ptr<faiss::IndexHNSWFlat>> sub_graphs_;  // Sub-HNSW graphs for each partition
+    std::unique_ptr<RoutingTree> routing_tree_;         // Centroid hierarchy for query routing, null for two levels
+    std::vector<std::unique_ptr<faiss::IndexHNSW>> sub_graphs_;  // Sub-HNSW graphs for each partition
+    std::unique_ptr<PartitionResidency> residency_;  // On-demand sub-HNSW graphs of a lazy load(); null otherwise
+    std::unique_ptr<faiss::IndexHNSW> codec_template_;  // Empty sub-graph with the trained SQ/PQ codec (null for FLAT)
+    std::unique_ptr<VecsFile> rerank_file_;  // Mapped full-precision vectors, when attached from a file
+    VecsView<float> rerank_vectors_;         // Full-precision vectors by global id for re-ranking
     std::vector<std::vector<faiss::idx_t>> partition_indices_;  // Mapping of which vectors belong to which partition
+    std::vector<std::vector<uint8_t>> deleted_;  // Tombstone flag for each local id of each partition
+    std::vector<size_t> deleted_counts_;         // Number of tombstoned entries in each partition
+    std::vector<float> covering_radii_;          // Distance from each centroid to its farthest entry
+    std::vector<int32_t> attributes_;            // Attribute value by global id, empty when none were set
+    std::vector<std::unordered_map<int32_t, size_t>> attribute_counts_;  // Entries per attribute value in each partition
+    
+    /**
+     * Invalidate cached query results after the indexed data changed
+     */
+    void index_changed();
+    
+    /**
+     * Replace the meta-HNSW graph by an empty one in the graph space
+     */
+    void reset_meta_graph();
+    
+    /**
+     * Drop every partition, with its ids, tombstones and covering radius, and
+     * restore the configured partition count ahead of a build
+     */
+    void reset_partitions();
+    
+    /**
+     * Create an empty sub-HNSW graph with the configured parameters and codec
+     */
+    std::unique_ptr<faiss::IndexHNSW> new_sub_graph() const;
+    
+    /**
+     * Replace a sub-HNSW graph whose arrays are views into the load() mapping
+     * by a copy that owns them, so that it can be modified
+     *
+     * @param c Partition index
+     * @return True if the graph owns its arrays (or is empty), false if the copy failed
+     */
+    bool own_sub_graph(int c);
+    
+    /**
+     * Renumber the nodes of a partition's sub-HNSW graph in breadth-first
+     * order from its entry point, permuting its id map and tombstones alike
+     *
+     * @param c Partition index
+     */
+    void reorder_sub_graph(int c);
+    
+    /**
+     * Build the sub-HNSW graph and covering radius of every non-empty partition
+     * in parallel, largest partitions first, reordered when locality_order is set
+     *
+     * @param centers Partition centroids
+     * @param gather Fills the graph-space vectors of a partition in the order of
+     *               partition_indices_ (size: partition size * graph_dim); false on failure
+     * @return True if every partition was gathered, false otherwise
+     */
+    bool build_sub_graphs(const std::vector<float>& centers, const std::function<bool(int, float*)>& gather);
+    
+    /**
+     * Print the timings and partition sizes of the last build when verbose
+     */
+    void report_build() const;
+    
+    /**
+     * Add every vector to the further partitions whose centroid is within the
+     * replication ratio of its nearest one, up to max_replicas partitions
+     *
+     * @param dataset Pointer to the dataset vectors
+     * @param n Number of vectors in the dataset
+     * @param centers Partition centroids
+     * @param primary Partition each vector was assigned to
+     * @return Number of replica entries added
+     */
+    size_t replicate_boundary_vectors(const float* dataset, size_t n, const std::vector<float>& centers,
+                                      const std::vector<int>& primary);
+    
+    /**
+     * Check whether a partition at the given centroid distance receives a replica
+     *
+     * For INNER_PRODUCT both values must have gone through normalize_similarities().
+     *
+     * @param distance Distance (or similarity) to the candidate partition's centroid
+     * @param nearest_distance Distance (or similarity) to the nearest centroid
+     */
+    bool within_replication_ratio(float distance, float nearest_distance) const;
+    
+    /**
+     * Turn the inner products of vectors with the (unit-length, spherical)
+     * centroids into cosine similarities by dividing by each vector's norm,
+     * so that routing_distance() stays within [0, 4]. No-op for other metrics.
+     *
+     * @param n Number of vectors
+     * @param r Similarities per vector
+     * @param vectors Graph-space vectors (size: n * graph_dim)
+     * @param similarities Similarities to scale in place (size: n * r)
+     */
+    void normalize_similarities(size_t n, int r, const float* vectors, float* similarities) const;
     
     /**
-     * Partition the dataset using k-means clustering
+     * Check whether a search probes adaptively: the k-th result similarity of
+     * INNER_PRODUCT scales with vector norms, so it cannot be compared with
+     * centroid similarities and the whole nprobe budget is searched instead
+     *
+     * @param options Search options
+     */
+    bool adaptive_probing(const SearchParams& options) const {
+        return options.adaptive && metric_ != Metric::INNER_PRODUCT;
+    }
+    
+    /**
+     * Get the FAISS metric used by the graphs (inner product for COSINE)
+     */
+    faiss::MetricType faiss_metric() const {
+        return metric_ == Metric::L2 ? faiss::METRIC_L2 : faiss::METRIC_INNER_PRODUCT;
+    }
+    
+    /**
+     * Convert a value returned by the graphs into a squared-L2-like distance,
+     * so that distance ratios can be applied to every metric. Exact for
+     * unit-length vectors (2 - 2 * similarity); similarities of longer vectors
+     * can make it negative, so INNER_PRODUCT values must be normalized first.
+     *
+     * @param value Distance or similarity in the index metric
+     */
+    float routing_distance(float value) const {
+        return metric_ == Metric::L2 ? value : 2.0f - 2.0f * value;
+    }
+    
+    /**
+     * Copy graph-space vectors, normalizing them when the metric is COSINE
+     *
+     * @param src Source vectors (size: n * graph_dim)
+     * @param n Number of vectors
+     * @param dst Destination (size: n * graph_dim), may be src
+     */
+    void ingest_vectors(const float* src, size_t n, float* dst) const;
+    
+    /**
+     * Bring input vectors into the graph space: normalized when the metric is
+     * COSINE, then mapped by the transform and normalized again
+     *
+     * @param src Source vectors (size: n * dim)
+     * @param n Number of vectors
+     * @param dst Destination (size: n * graph_dim)
+     */
+    void project_vectors(const float* src, size_t n, float* dst) const;
+    
+    /**
+     * Check whether input vectors (queries or added vectors) differ from their
+     * graph-space copies
+     */
+    bool projects_inputs() const {
+        return metric_ == Metric::COSINE || transform_;
+    }
+    
+    /**
+     * Normalize queries for COSINE and map them into the graph space
+     *
+     * @param nq Number of queries
+     * @param queries Pointer to the input queries (size: nq * dim)
+     * @param normalized Buffer for the normalized queries
+     * @param projected Buffer for the graph-space queries
+     * @param graph_queries Output pointer to the queries in the graph space
+     * @return Pointer to the queries in the input space, normalized for COSINE
+     */
+    const float* prepare_queries(size_t nq, const float* queries, std::vector<float>& normalized,
+                                 std::vector<float>& projected, const float*& graph_queries) const;
+    
+    /**
+     * Check whether the graphs hold lossy copies of the vectors (quantized or transformed)
+     */
+    bool approximate_storage() const {
+        return codec_ != StorageCodec::FLAT || transform_;
+    }
+    
+    /**
+     * Train the transform selected in the build parameters on a sample of the
+     * dataset and set graph_dim_
+     *
+     * @param dataset Pointer to the dataset vectors
+     * @param n Number of vectors in the dataset
+     */
+    void train_transform(const float* dataset, size_t n);
+    
+    /**
+     * Train the SQ/PQ codec selected in the build parameters on a sample of the dataset
+     *
+     * @param dataset Pointer to the dataset vectors
+     * @param n Number of vectors in the dataset
+     */
+    void train_codec(const float* dataset, size_t n);
+    
+    /**
+     * Get the number of candidates to take from each probed partition
+     *
+     * @param k Number of neighbors requested
+     * @param options Search options (re-rank factor)
+     */
+    int partition_candidates(int k, const SearchParams& options) const;
+    
+    /**
+     * Replace candidate distances by exact distances to the full-precision vectors
+     *
+     * Distances are computed with the dispatched kernels of similarity.h;
+     * for L2 the candidates are gathered by id in one pass.
+     *
+     * @param query Pointer to the query vector (input space)
+     * @param n Number of candidates
+     * @param ids Global ids of the candidates (-1 entries are not candidates; their distance is unspecified)
+     * @param distances Candidate distances, overwritten in place
+     */
+    void rerank(const float* query, size_t n, const faiss::idx_t* ids, float* distances) const;
+    
+    /**
+     * Compute the exact distance (or similarity) between a query and a vector
+     *
+     * @param query Pointer to the query vector (already normalized for COSINE)
+     * @param vec Pointer to the vector, normalized or not
+     * @param dim Dimension of both vectors
+     */
+    float exact_distance(const float* query, const float* vec, int dim) const;
+    
+    /**
+     * Get the full-precision re-rank vector of a global id
+     *
+     * @return Pointer to the input-space vector, or nullptr when none is attached for the id
+     */
+    const float* rerank_row(faiss::idx_t id) const {
+        return rerank_vectors_.base && id >= 0 && static_cast<size_t>(id) < rerank_vectors_.n ?
+               rerank_vectors_.row(id) : nullptr;
+    }
+    
+    /**
+     * Get the best available graph-space copy of a stored vector: the
+     * projected re-rank vector when the codec is quantized and one is
+     * attached, otherwise the decoded sub-graph entry
+     *
+     * @param graph Sub-HNSW graph of the partition
+     * @param c Partition index
+     * @param local Local id within the partition
+     * @param out Output vector (size: graph_dim)
+     */
+    void reconstruct_vector(const faiss::IndexHNSW& graph, int c, size_t local, float* out) const;
+    
+    /**
+     * Check whether a partition id refers to a loaded, non-empty partition
+     *
+     * @param c Partition index (any value)
+     */
+    bool is_searchable(faiss::idx_t c) const {
+        return c >= 0 && c < num_clusters_ && live_count(c) > 0 &&
+               (sub_graphs_[c] || (residency_ && residency_->has_graph(c)));
+    }
+    
+    /**
+     * Get a partition's sub-HNSW graph, reading it first when loaded lazily
+     *
+     * The returned pointer keeps the graph alive while it is searched, even
+     * if it is evicted meanwhile.
+     *
+     * @param c Searchable partition index
+     * @return The graph, or nullptr if the partition has none
+     * @throws std::exception if a lazily loaded graph could not be read
+     */
+    std::shared_ptr<const faiss::IndexHNSW> partition_graph(int c) const;
+    
+    /**
+     * Search one partition for a query and translate the results to global ids
+     *
+     * The candidates are left in context.local_distances and context.local_ids,
+     * re-ranked when the storage is approximate. The context must have room for
+     * partition_candidates(k, options) results.
+     *
+     * @param c Searchable partition index
+     * @param query Pointer to the query vector (already normalized for COSINE), for re-ranking
+     * @param graph_query Pointer to the query in the graph space
+     * @param k Number of neighbors requested
+     * @param options Search options (efSearch override, re-rank factor)
+     * @param context Scratch buffers receiving the candidates
+     * @param allowed Local ids to consider (one flag per entry, tombstones cleared), or nullptr for all live ones
+     * @param num_allowed Number of flags set in allowed
+     * @return Number of candidates written
+     */
+    int search_partition(int c, const float* query, const float* graph_query, int k, const SearchParams& options,
+                         SearchContext& context, const uint8_t* allowed = nullptr,
+                         size_t num_allowed = 0) const;
+    
+    /**
+     * Compare a query with every allowed vector of a partition and offer them to a heap
+     *
+     * Vectors are compared in the input space when the storage is approximate
+     * and full-precision vectors are attached, in the graph space otherwise.
+     *
+     * @param c Searchable partition index
+     * @param query Pointer to the query vector (already normalized for COSINE)
+     * @param graph_query Pointer to the query in the graph space
+     * @param allowed Local ids to compare (one flag per entry)
+     * @param context Scratch buffers
+     * @param results Heap receiving the candidates with their global ids
+     * @return Number of vectors compared
+     */
+    size_t scan_partition(int c, const float* query, const float* graph_query, const uint8_t* allowed,
+                          SearchContext& context, TopKHeap& results) const;
+    
+    /**
+     * Flag the live entries of a partition that pass a filter
+     *
+     * @param c Partition index
+     * @param filter Filter to apply
+     * @param allowed Output flags, one per entry of the partition
+     * @return Number of flags set
+     */
+    size_t filter_partition(int c, const SearchFilter& filter, std::vector<uint8_t>& allowed) const;
+    
+    /**
+     * Get an upper bound of the live entries of a partition that pass a filter,
+     * from the attribute counts alone
+     *
+     * @param c Partition index
+     * @param filter Filter to apply
+     */
+    size_t attribute_bound(int c, const SearchFilter& filter) const;
+    
+    /**
+     * Recount the attribute values of every partition
+     */
+    void count_attributes();
+    
+    /**
+     * Get the attribute value of a global id (-1: none)
+     */
+    int32_t attribute_of(faiss::idx_t id) const {
+        return id >= 0 && static_cast<size_t>(id) < attributes_.size() ? attributes_[id] : -1;
+    }
+    
+    /**
+     * Get the number of live (not removed) vectors in a partition
+     *
+     * @param c Partition index
+     */
+    size_t live_count(int c) const {
+        return partition_indices_[c].size() - deleted_counts_[c];
+    }
+    
+    /**
+     * Partition the dataset using k-means clustering trained on a sample
      * 
      * @param dataset Pointer to the dataset vectors
      * @param n Number of vectors in the dataset
+     * @param centroids Output trained centroids; left empty when they do not match
+     *                  the assignments (balanced mode or k-means failure)
+     * @return Vector of cluster assignments for each data point
+     */
+    std::vector<int> partition_data(const float* dataset, size_t n, std::vector<float>& centroids);
+    
+    /**
+     * Partition the dataset top-down along build_params_.routing_levels
+     *
+     * The top level runs k-means on a sample of the dataset; every node of a
+     * level then clusters only its own points into its share of the next
+     * level's nodes, proportional to its size, down to the partitions. No
+     * k-means runs over all points with the full number of partitions. The
+     * levels above the partitions become routing_tree_.
+     *
+     * @param dataset Pointer to the dataset vectors
+     * @param n Number of vectors in the dataset
+     * @param centroids Output partition centroids; left empty when they do not match the assignments
      * @return Vector of cluster assignments for each data point
      */
-    std::vector<int> partition_data(const float* dataset, size_t n);
+    std::vector<int> partition_hierarchical(const float* dataset, size_t n, std::vector<float>& centroids);
+    
+    /**
+     * Get the routing tree beam used for a requested beam
+     *
+     * @param beam Requested beam (0: max(8, 2 * nprobe))
+     * @param nprobe Number of partitions per query
+     * @return Beam used, or 0 without a routing tree (the beam then has no effect)
+     */
+    int effective_routing_beam(int beam, int nprobe) const {
+        if (!routing_tree_) {
+            return 0;
+        }
+        return beam > 0 ? beam : std::max(8, 2 * nprobe);
+    }
+    
+    /**
+     * Select the nprobe nearest partitions of each query, with the routing
+     * tree when there is one and with the meta-HNSW graph otherwise
+     *
+     * With a partition mask, a query whose tree beam reaches fewer than
+     * nprobe allowed partitions is routed again by the meta-HNSW graph
+     * restricted to the mask.
+     *
+     * @param nq Number of query vectors
+     * @param queries Pointer to the query vectors in the graph space
+     * @param nprobe Number of partitions per query (at most num_clusters_)
+     * @param beam Routing tree nodes kept per level (0: default)
+     * @param distances Output centroid distances (size: nq * nprobe)
+     * @param ids Output partition ids, nearest first (size: nq * nprobe)
+     * @param allowed Flag of every partition that may be selected (nullptr: all)
+     */
+    void route_partitions(size_t nq, const float* queries, int nprobe, int beam,
+                          float* distances, faiss::idx_t* ids, const uint8_t* allowed = nullptr) const;
     
     /**
      * Extract cluster centers from k-means result
@@ -91,6 +1103,28 @@ private:
      */
     std::vector<float> extract_cluster_centers(const float* dataset, size_t n, 
                                              const std::vector<int>& cluster_assign);
+    
+    /**
+     * Search a set of probes grouped by partition, in parallel
+     *
+     * A probe q * nprobe + slot asks for the k nearest neighbors of query q
+     * in partition partition_ids[probe]; its results are written to the k
+     * candidate slots starting at probe * k.
+     *
+     * @param queries Pointer to the query vectors in the graph space
+     * @param nprobe Number of probe slots per query
+     * @param probes Probes to search
+     * @param partition_ids Partition selected for every probe slot
+     * @param k Number of neighbors per probe
+     * @param options Probing options (efSearch override)
+     * @param candidate_distances Output candidate distances (size: nq * nprobe * k)
+     * @param candidate_ids Output candidate global ids (size: nq * nprobe * k)
+     * @return Number of probes that searched a non-empty partition
+     */
+    size_t search_probes(const float* queries, int nprobe, const std::vector<size_t>& probes,
+                       const faiss::idx_t* partition_ids, int k,
+                       const SearchParams& options,
+                       float* candidate_distances, faiss::idx_t* candidate_ids) const;
 };
 
 } // namespace pyramid 
\ No newline at end of file
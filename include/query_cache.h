@@ -0,0 +1,224 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+#include <faiss/Index.h>
+
+namespace pyramid {
+
+/**
+ * Configuration of the query cache in front of PyramidGraph::search()
+ */
+struct QueryCacheParams {
+    size_t max_bytes = 64 << 20;    // Memory budget shared by both tiers (0: cache disabled)
+    bool cache_results = true;      // Exact tier: full results for byte-identical queries
+    float routing_quantum = 0.0f;   // Routing tier: queries whose components agree after division by
+                                    //  this step share their partition choice (0: tier disabled)
+    int num_shards = 16;            // Independently locked LRU shards
+};
+
+/**
+ * Hit and size counters of a query cache
+ */
+struct QueryCacheStats {
+    uint64_t result_hits = 0;       // Searches answered by the exact tier
+    uint64_t result_misses = 0;     // Exact tier lookups that missed
+    uint64_t routing_hits = 0;      // Searches that reused cached partition choices
+    uint64_t routing_misses = 0;    // Routing tier lookups that missed
+    uint64_t evictions = 0;         // Entries dropped to stay within the budget
+    size_t entries = 0;             // Entries currently held
+    size_t bytes = 0;               // Estimated memory held
+    
+    /**
+     * Get the fraction of exact tier lookups that hit
+     */
+    double result_hit_rate() const {
+        const uint64_t total = result_hits + result_misses;
+        return total > 0 ? static_cast<double>(result_hits) / total : 0.0;
+    }
+    
+    /**
+     * Get the fraction of routing tier lookups that hit
+     */
+    double routing_hit_rate() const {
+        const uint64_t total = routing_hits + routing_misses;
+        return total > 0 ? static_cast<double>(routing_hits) / total : 0.0;
+    }
+};
+
+/**
+ * Search options that change the result of a query; part of the exact tier key
+ */
+struct QueryCacheTag {
+    int32_t k = 0;
+    int32_t nprobe = 0;
+    int32_t ef_search = 0;
+    int32_t rerank_factor = 0;
+    int32_t adaptive = 0;
+    float probe_ratio = 0.0f;
+    int32_t routing_beam = 0;
+    
+    bool operator==(const QueryCacheTag& other) const {
+        return k == other.k && nprobe == other.nprobe && ef_search == other.ef_search &&
+               rerank_factor == other.rerank_factor && adaptive == other.adaptive &&
+               probe_ratio == other.probe_ratio && routing_beam == other.routing_beam;
+    }
+};
+
+/**
+ * QueryCache - Concurrent two-tier cache for repeated and near-duplicate queries
+ *
+ * The exact tier maps the bytes of a query and its search options to the
+ * final top k; the stored query is compared on lookup, so a hash collision
+ * is a miss. The routing tier maps a quantized signature of the query to the
+ * partitions chosen by the meta-HNSW, so near-duplicates skip routing but
+ * still search the sub-graphs.
+ *
+ * Entries live in hash-selected shards, each an LRU list under its own
+ * mutex, and the memory budget is split evenly between the shards.
+ * invalidate() bumps an epoch: older entries become misses and are dropped
+ * when they are next touched or evicted.
+ */
+class QueryCache {
+public:
+    /**
+     * Create an empty cache
+     *
+     * @param dim Dimension of the query vectors
+     * @param params Budget and tier configuration
+     */
+    QueryCache(int dim, const QueryCacheParams& params);
+    
+    /**
+     * Destructor
+     */
+    ~QueryCache();
+    
+    QueryCache(const QueryCache&) = delete;
+    QueryCache& operator=(const QueryCache&) = delete;
+    
+    /**
+     * Look up the final results of a query
+     *
+     * @param query Pointer to the query vector
+     * @param tag Search options of the call
+     * @param indices Output array for the indices of neighbors (size: tag.k)
+     * @param distances Output array for the distances to neighbors (size: tag.k)
+     * @return True on a hit, false otherwise (outputs untouched)
+     */
+    bool lookup_results(const float* query, const QueryCacheTag& tag, int* indices, float* distances);
+    
+    /**
+     * Store the final results of a query
+     *
+     * @param query Pointer to the query vector
+     * @param tag Search options of the call
+     * @param indices Indices of neighbors (size: tag.k)
+     * @param distances Distances to neighbors (size: tag.k)
+     */
+    void store_results(const float* query, const QueryCacheTag& tag, const int* indices, const float* distances);
+    
+    /**
+     * Look up the partitions chosen for a query signature
+     *
+     * @param query Pointer to the query vector (as passed to the meta-HNSW)
+     * @param nprobe Number of partitions
+     * @param beam Routing tree beam the partitions were chosen with (0: no routing tree)
+     * @param partition_ids Output partition ids (size: nprobe)
+     * @param partition_distances Output centroid distances (size: nprobe)
+     * @return True on a hit, false otherwise (outputs untouched)
+     */
+    bool lookup_routing(const float* query, int nprobe, int beam,
+                        faiss::idx_t* partition_ids, float* partition_distances);
+    
+    /**
+     * Store the partitions chosen for a query signature
+     *
+     * @param query Pointer to the query vector (as passed to the meta-HNSW)
+     * @param nprobe Number of partitions
+     * @param beam Routing tree beam the partitions were chosen with (0: no routing tree)
+     * @param partition_ids Partition ids (size: nprobe)
+     * @param partition_distances Centroid distances (size: nprobe)
+     */
+    void store_routing(const float* query, int nprobe, int beam, const faiss::idx_t* partition_ids,
+                       const float* partition_distances);
+    
+    /**
+     * Invalidate every entry; called whenever the index changes
+     */
+    void invalidate();
+    
+    /**
+     * Get the hit and size counters
+     */
+    QueryCacheStats stats() const;
+    
+    /**
+     * Check whether the routing tier is enabled
+     */
+    bool caches_routing() const {
+        return params_.routing_quantum > 0.0f;
+    }
+    
+    /**
+     * Check whether the exact tier is enabled
+     */
+    bool caches_results() const {
+        return params_.cache_results;
+    }
+
+private:
+    struct Shard;
+    
+    int dim_;                                    // Query dimension
+    QueryCacheParams params_;                    // Configuration
+    std::unique_ptr<Shard[]> shards_;            // LRU shards
+    std::atomic<uint64_t> epoch_{0};             // Entries from older epochs are stale
+    std::atomic<uint64_t> result_hits_{0};
+    std::atomic<uint64_t> result_misses_{0};
+    std::atomic<uint64_t> routing_hits_{0};
+    std::atomic<uint64_t> routing_misses_{0};
+    std::atomic<uint64_t> evictions_{0};
+    
+    /**
+     * Copy out a live entry and move it to the front of its shard's LRU list
+     *
+     * @param hash Key hash
+     * @param query Query to compare with the stored one (nullptr: routing tier)
+     * @param tag Options to compare with the stored ones
+     * @param distances Output distances (size: stored count)
+     * @param ids Output ids as faiss::idx_t, or nullptr
+     * @param int_ids Output ids as int, or nullptr
+     * @return True if a live matching entry was found
+     */
+    bool find(uint64_t hash, const float* query, const QueryCacheTag& tag,
+              float* distances, faiss::idx_t* ids, int* int_ids);
+    
+    /**
+     * Insert or replace an entry, evicting from the back of its shard as needed
+     *
+     * @param hash Key hash
+     * @param query Query to store for comparison (nullptr: routing tier)
+     * @param tag Options to store for comparison
+     * @param distances Distances to store
+     * @param ids Ids to store
+     * @param count Number of distances and ids
+     */
+    void insert(uint64_t hash, const float* query, const QueryCacheTag& tag,
+                const float* distances, const faiss::idx_t* ids, size_t count);
+    
+    /**
+     * Hash of the quantized components of a query, nprobe and the routing tree beam
+     */
+    uint64_t routing_hash(const float* query, int nprobe, int beam) const;
+    
+    /**
+     * Get the shard holding a hash
+     */
+    Shard& shard_for(uint64_t hash) const;
+};
+
+} // namespace pyramid
@@ -0,0 +1,160 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "pyramid.h"
+
+namespace pyramid {
+
+/**
+ * Result of a query submitted to a QueryEngine
+ */
+struct QueryResult {
+    std::vector<int> indices;      // Indices of neighbors, best first (-1 past the results found)
+    std::vector<float> distances;  // Distances (or similarities) to neighbors
+    std::exception_ptr error;      // Exception thrown while searching, null on success (results empty)
+};
+
+/**
+ * Configuration of a QueryEngine
+ */
+struct QueryEngineParams {
+    int num_threads = 0;           // Worker threads (0: hardware concurrency)
+};
+
+/**
+ * Counters of a QueryEngine
+ */
+struct QueryEngineStats {
+    uint64_t queries = 0;          // Queries completed
+    uint64_t work_items = 0;       // Partition searches executed
+    uint64_t steals = 0;           // Partition searches taken from another worker's queue
+};
+
+/**
+ * QueryEngine - Asynchronous search with partition-affine workers
+ *
+ * A submitted query is routed through the meta-HNSW on the caller's thread
+ * and split into one work item per probed partition. Partition c is always
+ * queued on worker c % num_threads, so each worker keeps revisiting the same
+ * sub-HNSW graphs and their cache lines. An idle worker steals from the
+ * others so a hot partition cannot stall the engine. The worker finishing a
+ * query's last partition merges the partial results and completes the query.
+ *
+ * Adaptive probing and the query cache do not apply. The index must outlive
+ * the engine and must not be updated while queries are in flight.
+ */
+class QueryEngine {
+public:
+    using Callback = std::function<void(QueryResult&&)>;
+    
+    /**
+     * Start the worker threads
+     *
+     * @param index Graph to search
+     * @param params Thread count
+     */
+    explicit QueryEngine(const PyramidGraph& index, const QueryEngineParams& params = QueryEngineParams());
+    
+    /**
+     * Destructor, completes every submitted query and joins the workers
+     */
+    ~QueryEngine();
+    
+    QueryEngine(const QueryEngine&) = delete;
+    QueryEngine& operator=(const QueryEngine&) = delete;
+    
+    /**
+     * Submit a query and get a future for its results
+     *
+     * @param query Pointer to the query vector (copied before returning)
+     * @param k Number of neighbors to return
+     * @param params Probing options, or nullptr for the defaults
+     * @return Future completed by a worker thread; get() rethrows a search error
+     */
+    std::future<QueryResult> submit(const float* query, int k, const SearchParams* params = nullptr);
+    
+    /**
+     * Submit a query and have its results passed to a callback
+     *
+     * The callback runs on a worker thread, should return quickly and must
+     * not throw. A search error is passed in QueryResult::error.
+     *
+     * @param query Pointer to the query vector (copied before returning)
+     * @param k Number of neighbors to return
+     * @param callback Function receiving the results
+     * @param params Probing options, or nullptr for the defaults
+     */
+    void submit(const float* query, int k, Callback callback, const SearchParams* params = nullptr);
+    
+    /**
+     * Get the counters
+     */
+    QueryEngineStats stats() const;
+    
+    /**
+     * Get the number of worker threads
+     */
+    int num_threads() const {
+        return static_cast<int>(workers_.size());
+    }
+
+private:
+    struct Query;
+    
+    // One partition search of one query
+    struct WorkItem {
+        std::shared_ptr<Query> query;
+        int slot;                  // Probe slot, also the partition's index in the query
+    };
+    
+    // A worker's queue; other workers steal from it
+    struct Worker {
+        std::mutex mutex;
+        std::deque<WorkItem> queue;
+    };
+    
+    const PyramidGraph& index_;                   // Graph searched
+    std::vector<std::unique_ptr<Worker>> queues_; // One queue per worker
+    std::vector<std::thread> workers_;            // Worker threads
+    std::mutex sleep_mutex_;                      // Guards sleeping on wake_
+    std::condition_variable wake_;                // Signalled when work is queued or on shutdown
+    std::atomic<size_t> queued_{0};               // Items in all queues
+    bool stopping_ = false;                       // Set under sleep_mutex_ by the destructor
+    std::atomic<uint64_t> queries_{0};
+    std::atomic<uint64_t> work_items_{0};
+    std::atomic<uint64_t> steals_{0};
+    
+    /**
+     * Take an item from the worker's own queue, or steal one from another
+     *
+     * @param w Worker index
+     * @param item Output item
+     * @return True if an item was taken
+     */
+    bool take(int w, WorkItem& item);
+    
+    /**
+     * Search one partition for a query, completing the query when it is the last one
+     *
+     * An exception is recorded on the query and does not stop the worker.
+     *
+     * @param item Work item to run
+     */
+    void run(WorkItem& item);
+    
+    /**
+     * Main loop of worker w
+     */
+    void worker_loop(int w);
+};
+
+} // namespace pyramid
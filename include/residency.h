@@ -0,0 +1,99 @@
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+#include <faiss/IndexHNSW.h>
+
+namespace pyramid {
+
+/**
+ * Residency counters of a lazily loaded index
+ */
+struct ResidencyStats {
+    size_t resident_partitions = 0;  // Sub-HNSW graphs currently in memory
+    size_t resident_bytes = 0;       // Serialized size of the resident graphs
+    size_t budget_bytes = 0;         // Configured budget (0: unlimited)
+    uint64_t hits = 0;               // Probes that found their graph resident
+    uint64_t loads = 0;              // Graphs loaded from the file
+    uint64_t load_failures = 0;      // Loads that threw or produced no graph
+    uint64_t evictions = 0;          // Graphs dropped to stay within the budget
+    double load_ms = 0.0;            // Total time spent loading graphs
+};
+
+/**
+ * PartitionResidency - Loads sub-HNSW graphs on first use and evicts cold ones
+ *
+ * Graphs are handed out as shared pointers, so evicting a graph never
+ * invalidates a search that is still using it; the memory is released when
+ * the last search drops its reference. Recency is tracked in an LRU list and
+ * the least recently used graphs are evicted whenever the resident bytes
+ * exceed the budget, but never the graph that was just loaded.
+ */
+class PartitionResidency {
+public:
+    using Loader = std::function<std::shared_ptr<faiss::IndexHNSW>(int partition)>;
+    using Releaser = std::function<void(int partition)>;
+    
+    /**
+     * Create an empty residency set
+     *
+     * @param sizes Bytes charged for each partition's graph (0: the partition has no graph)
+     * @param budget_bytes Resident bytes allowed (0: unlimited)
+     * @param loader Reads a partition's graph; called without the residency lock held
+     * @param releaser Called after a graph is evicted, e.g. to drop its file pages (may be empty)
+     */
+    PartitionResidency(std::vector<size_t> sizes, size_t budget_bytes, Loader loader, Releaser releaser);
+    
+    /**
+     * Get a partition's graph, loading it if necessary
+     *
+     * Concurrent calls for the same partition load it once. A failed load
+     * is counted in load_failures and retried by the next call.
+     *
+     * @param c Partition index
+     * @return The graph, or nullptr if the partition has none
+     * @throws std::exception if the graph could not be loaded
+     */
+    std::shared_ptr<const faiss::IndexHNSW> acquire(int c);
+    
+    /**
+     * Check whether a partition has a graph on disk
+     *
+     * @param c Partition index
+     */
+    bool has_graph(int c) const {
+        return sizes_[c] > 0;
+    }
+    
+    /**
+     * Get the residency counters
+     */
+    ResidencyStats stats() const;
+
+private:
+    std::vector<size_t> sizes_;      // Bytes charged per partition
+    size_t budget_bytes_;            // Resident bytes allowed (0: unlimited)
+    Loader loader_;                  // Reads a graph
+    Releaser releaser_;              // Cleans up after an eviction
+    
+    mutable std::mutex mutex_;       // Guards graphs_, lru_, positions_ and resident_bytes_
+    std::vector<std::shared_ptr<faiss::IndexHNSW>> graphs_;  // Resident graphs
+    std::list<int> lru_;             // Resident partitions, most recently used first
+    std::vector<std::list<int>::iterator> positions_;  // Position of each resident partition in lru_
+    size_t resident_bytes_ = 0;      // Bytes charged for the resident graphs
+    std::unique_ptr<std::mutex[]> load_mutexes_;  // Serializes loading of each partition
+    
+    std::atomic<uint64_t> hits_{0};
+    std::atomic<uint64_t> loads_{0};
+    std::atomic<uint64_t> load_failures_{0};
+    std::atomic<uint64_t> evictions_{0};
+    std::atomic<uint64_t> load_ns_{0};
+};
+
+} // namespace pyramid
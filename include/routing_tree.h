@@ -0,0 +1,119 @@
+#pragma once
+
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+#include <faiss/Index.h>
+
+namespace pyramid {
+
+/**
+ * RoutingTree - Centroid hierarchy above the partitions for beam-search routing
+ *
+ * Level 0 holds the coarsest centroids; every node of a level owns a list of
+ * children in the next level, and the nodes of the last level own
+ * partitions. Routing compares a query with all level-0 centroids, keeps the
+ * beam best nodes, compares it with their children and so on down to the
+ * partition centroids, so the cost grows with beam * fan-out rather than with
+ * the number of partitions.
+ */
+class RoutingTree {
+public:
+    /**
+     * Create an empty tree
+     *
+     * @param dim Dimension of the centroids
+     * @param metric METRIC_L2 (smallest distance first) or METRIC_INNER_PRODUCT (largest first)
+     */
+    RoutingTree(int dim, faiss::MetricType metric);
+    
+    /**
+     * Append a level below the existing ones
+     *
+     * @param centroids Centroids of the level's nodes (size: num_nodes * dim)
+     * @param child_offsets Children of node i are child_ids[child_offsets[i]] to child_ids[child_offsets[i + 1] - 1]
+     * @param child_ids Nodes of the next level, or partitions for the last level
+     */
+    void add_level(std::vector<float> centroids, std::vector<size_t> child_offsets, std::vector<int> child_ids);
+    
+    /**
+     * Replace the partition centroids
+     *
+     * @param centroids Centroid of every partition (size: num_partitions * dim)
+     * @param num_partitions Number of partitions
+     */
+    void set_partition_centroids(const float* centroids, int num_partitions);
+    
+    /**
+     * Make a new partition a child of the node that owns an existing one
+     *
+     * @param sibling Partition already in the tree
+     * @param partition New partition (its centroid is set by set_partition_centroids())
+     */
+    void attach_partition(int sibling, int partition);
+    
+    /**
+     * Select the nearest partitions of a query
+     *
+     * Slots beyond the partitions reached are filled with id -1.
+     *
+     * @param query Pointer to the query vector
+     * @param nprobe Number of partitions to select
+     * @param beam Nodes kept per level
+     * @param distances Output distances (or similarities) to the partition centroids (size: nprobe)
+     * @param ids Output partition ids, nearest first (size: nprobe)
+     * @param allowed Flag of every partition that may be selected (nullptr: all)
+     */
+    void route(const float* query, int nprobe, int beam, float* distances, faiss::idx_t* ids,
+               const uint8_t* allowed = nullptr) const;
+    
+    /**
+     * Get the number of routing levels above the partitions
+     */
+    int num_levels() const {
+        return static_cast<int>(levels_.size());
+    }
+    
+    /**
+     * Get the number of nodes of a level
+     */
+    size_t level_size(int level) const {
+        return levels_[level].child_offsets.size() - 1;
+    }
+    
+    /**
+     * Append the levels (not the partition centroids) to a byte buffer
+     *
+     * @param out Buffer to append to
+     */
+    void serialize(std::vector<uint8_t>& out) const;
+    
+    /**
+     * Read levels written by serialize(), replacing the current ones
+     *
+     * @param data Pointer to the serialized levels
+     * @param size Size of the serialized levels in bytes
+     * @param num_partitions Number of partitions the last level may refer to
+     * @return True if the data was well formed, false otherwise
+     */
+    bool deserialize(const uint8_t* data, size_t size, int num_partitions);
+
+private:
+    struct Level {
+        std::vector<float> centroids;       // Node centroids (size: num_nodes * dim)
+        std::vector<size_t> child_offsets;  // CSR offsets into child_ids (size: num_nodes + 1)
+        std::vector<int> child_ids;         // Children of every node, node by node
+    };
+    
+    int dim_;                               // Dimension of the centroids
+    faiss::MetricType metric_;              // Comparison of queries and centroids
+    std::vector<Level> levels_;             // Routing levels, coarsest first
+    std::vector<float> partition_centroids_;  // Centroid of every partition
+    
+    /**
+     * Distance (or similarity) between a query and a centroid
+     */
+    float distance(const float* query, const float* centroid) const;
+};
+
+} // namespace pyramid
@@ -42,8 +42,9 @@ SearchResult find_partitions(const faiss::Index* meta_index, const float* query,
  *
  * @param results Vector of search results to merge
  * @param k Number of neighbors to keep in the final result
+ * @param descending Keep the largest values first, for similarity metrics (default: false)
  * @return Merged SearchResult containing the top-k neighbors
  */
-SearchResult merge_results(const std::vector<SearchResult>& results, int k);
+SearchResult merge_results(const std::vector<SearchResult>& results, int k, bool descending = false);
 
 } // namespace pyramid 
\ No newline at end of file
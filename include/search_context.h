@@ -0,0 +1,166 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <limits>
+#include <utility>
+#include <faiss/Index.h>
+
+namespace pyramid {
+
+/**
+ * TopKHeap - Bounded heap that keeps the k best (distance, id) pairs
+ *
+ * Best means smallest for distances and largest for similarities (inner
+ * product). Candidates are pushed in any order; once the heap is full a
+ * candidate is only kept if it beats the current k-th value. The storage is reused
+ * across reset() calls, so a heap that has seen its largest k never allocates.
+ */
+class TopKHeap {
+public:
+    /**
+     * Empty the heap and set its capacity
+     *
+     * @param k Number of results to keep
+     * @param largest Keep the largest values instead of the smallest (default: false)
+     */
+    void reset(int k, bool largest = false) {
+        k_ = std::max(0, k);
+        sign_ = largest ? -1.0f : 1.0f;
+        entries_.clear();
+        entries_.reserve(k_);
+    }
+    
+    /**
+     * Offer a candidate to the heap
+     *
+     * @param distance Distance of the candidate
+     * @param id Id of the candidate (negative ids are ignored)
+     * @param unique Merge candidates with an id already in the heap, keeping
+     *               the smaller distance (needed when vectors are replicated)
+     * @return True if the candidate was kept
+     */
+    bool push(float distance, faiss::idx_t id, bool unique = false) {
+        // Keys are stored so that the heap always keeps the smallest
+        distance *= sign_;
+        if (id < 0 || k_ == 0 || (full() && distance >= entries_.front().first)) {
+            return false;
+        }
+        
+        if (unique) {
+            for (auto& entry : entries_) {
+                if (entry.second != id) {
+                    continue;
+                }
+                if (distance >= entry.first) {
+                    return false;
+                }
+                entry.first = distance;
+                std::make_heap(entries_.begin(), entries_.end());
+                return true;
+            }
+        }
+        
+        if (full()) {
+            std::pop_heap(entries_.begin(), entries_.end());
+            entries_.back() = {distance, id};
+        } else {
+            entries_.emplace_back(distance, id);
+        }
+        std::push_heap(entries_.begin(), entries_.end());
+        return true;
+    }
+    
+    /**
+     * Check whether the heap holds k candidates
+     */
+    bool full() const {
+        return static_cast<int>(entries_.size()) >= k_;
+    }
+    
+    /**
+     * Get the number of candidates currently held
+     */
+    size_t size() const {
+        return entries_.size();
+    }
+    
+    /**
+     * Get the k-th best value, or the worst possible value (FLT_MAX, or
+     * -FLT_MAX for similarities) while the heap is not full
+     */
+    float worst() const {
+        return sign_ * (full() && k_ > 0 ? entries_.front().first : std::numeric_limits<float>::max());
+    }
+    
+    /**
+     * Write the candidates best first and empty the heap. Slots beyond the
+     * number of candidates are filled with -1 and the worst possible value.
+     *
+     * @param indices Output ids (k entries)
+     * @param distances Output distances (k entries)
+     * @return Number of valid results written
+     */
+    template <typename IdT>
+    size_t finish(IdT* indices, float* distances) {
+        const size_t count = entries_.size();
+        std::sort_heap(entries_.begin(), entries_.end());
+        for (int i = 0; i < k_; i++) {
+            if (i < static_cast<int>(entries_.size())) {
+                distances[i] = sign_ * entries_[i].first;
+                indices[i] = static_cast<IdT>(entries_[i].second);
+            } else {
+                distances[i] = sign_ * std::numeric_limits<float>::max();
+                indices[i] = -1;
+            }
+        }
+        entries_.clear();
+        return count;
+    }
+
+private:
+    int k_ = 0;                                                // Capacity
+    float sign_ = 1.0f;                                        // -1 when keeping the largest values
+    std::vector<std::pair<float, faiss::idx_t>> entries_;      // Max-heap on distance
+};
+
+/**
+ * SearchContext - Per-thread scratch space for PyramidGraph queries
+ *
+ * Holds every buffer a query needs so that, once the buffers have grown to
+ * the largest nprobe and k seen, queries run without heap allocations in the
+ * pyramid layer. A context must not be shared by concurrent queries;
+ * PyramidGraph::search() uses one thread-local context per thread when the
+ * caller does not pass its own.
+ */
+struct SearchContext {
+    std::vector<float> partition_distances;      // Meta-HNSW distances for the probed partitions
+    std::vector<faiss::idx_t> partition_ids;     // Probed partition ids
+    std::vector<float> local_distances;          // Sub-HNSW result distances
+    std::vector<faiss::idx_t> local_ids;         // Sub-HNSW result ids (local, then global)
+    std::vector<float> batch_queries;            // Gathered queries for batched sub-HNSW searches
+    std::vector<float> query;                    // Normalized copy of the query (cosine metric)
+    std::vector<float> graph_query;              // Query mapped into the graph space (transformed index)
+    std::vector<float> vector;                   // Reconstructed vector of an exhaustive scan
+    std::vector<uint8_t> filter_flags;           // Entries of a partition that pass a search filter
+    TopKHeap heap;                               // Merged top-k results
+    
+    /**
+     * Grow the buffers for a query, never shrinking them
+     *
+     * @param nprobe Number of partitions probed
+     * @param local_results Number of results requested per sub-HNSW search
+     */
+    void reserve(int nprobe, size_t local_results) {
+        if (partition_ids.size() < static_cast<size_t>(nprobe)) {
+            partition_distances.resize(nprobe);
+            partition_ids.resize(nprobe);
+        }
+        if (local_ids.size() < local_results) {
+            local_distances.resize(local_results);
+            local_ids.resize(local_results);
+        }
+    }
+};
+
+} // namespace pyramid
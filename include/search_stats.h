@@ -0,0 +1,169 @@
+#pragma once
+
+#include <atomic>
+#include <array>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+namespace pyramid {
+
+/**
+ * Work done in one sub-HNSW graph for a query
+ */
+struct PartitionSearchStats {
+    int partition = -1;         // Partition id
+    double search_us = 0.0;     // Time spent in the sub-HNSW search
+    size_t results = 0;         // Candidates returned by the sub-HNSW
+};
+
+/**
+ * Per-call search statistics, filled in when SearchParams::stats is set
+ *
+ * For search_batch() the counters cover the whole batch and the per-partition
+ * list is left empty.
+ */
+struct SearchStats {
+    double total_us = 0.0;          // Wall time of the call
+    double routing_us = 0.0;        // Time in the meta-HNSW graph
+    double sub_graph_us = 0.0;      // Time in the sub-HNSW graphs
+    double merge_us = 0.0;          // Time re-ranking and merging candidates
+    size_t partitions_probed = 0;   // Sub-HNSW searches performed
+    size_t candidates_merged = 0;   // Candidates offered to the top-k merge
+    size_t partitions_scanned = 0;  // Partitions compared exhaustively (search_filtered() only)
+    size_t partitions_filtered = 0; // Probed partitions without a vector passing the filter (search_filtered() only)
+    size_t partitions_pruned = 0;   // Partitions ruled out by their covering radius (range_search() only)
+    bool cache_hit = false;         // Answered by the query cache's exact tier (search() only)
+    std::vector<PartitionSearchStats> partitions;  // One entry per probed partition (search() only)
+    
+    /**
+     * Clear all counters, keeping the capacity of the partition list
+     */
+    void reset();
+};
+
+/**
+ * LatencyHistogram - Lock-free histogram of latencies in microseconds
+ *
+ * Bucket i counts latencies in [2^(i-1), 2^i) microseconds (bucket 0 holds
+ * everything below 1us), which keeps record() to a couple of relaxed atomic
+ * increments.
+ */
+class LatencyHistogram {
+public:
+    static constexpr int kNumBuckets = 32;
+    
+    /**
+     * Record one latency
+     *
+     * @param us Latency in microseconds
+     */
+    void record(double us);
+    
+    /**
+     * Copy the bucket counts
+     *
+     * @return Count per bucket (size: kNumBuckets)
+     */
+    std::vector<uint64_t> buckets() const;
+    
+    /**
+     * Get the sum of all recorded latencies in microseconds
+     */
+    double sum() const {
+        return static_cast<double>(total_us_.load(std::memory_order_relaxed));
+    }
+    
+    /**
+     * Reset every bucket to zero
+     */
+    void reset();
+    
+    /**
+     * Upper bound of a bucket in microseconds
+     */
+    static double bucket_limit(int bucket) {
+        return static_cast<double>(uint64_t(1) << bucket);
+    }
+    
+    /**
+     * Estimate a percentile from bucket counts as the upper bound of the
+     * bucket that contains it
+     *
+     * @param buckets Bucket counts as returned by buckets()
+     * @param p Percentile in [0, 1]
+     * @return Latency in microseconds (0 when the histogram is empty)
+     */
+    static double percentile(const std::vector<uint64_t>& buckets, double p);
+
+private:
+    std::array<std::atomic<uint64_t>, kNumBuckets> counts_{};  // Latencies per bucket
+    std::atomic<uint64_t> total_us_{0};                         // Sum of latencies, for the mean
+};
+
+/**
+ * Point-in-time copy of SearchMetrics
+ */
+struct SearchMetricsSnapshot {
+    uint64_t queries = 0;                   // Queries answered by search(), search_filtered(),
+                                            //  search_batch() and range_search()
+    uint64_t batches = 0;                   // search_batch() and range_search() calls
+    uint64_t partition_searches = 0;        // search_partitions() calls (QueryEngine work items
+                                            //  and shard requests), whose work is counted below
+    uint64_t partitions_probed = 0;         // Sub-HNSW searches
+    uint64_t candidates_merged = 0;         // Candidates offered to the top-k merge
+    double routing_us = 0.0;                // Total time in the meta-HNSW graph
+    double sub_graph_us = 0.0;              // Total time in the sub-HNSW graphs
+    std::vector<uint64_t> query_latency;    // search() and search_filtered() latency histogram buckets
+    std::vector<uint64_t> batch_latency;    // search_batch() and range_search() latency histogram buckets
+    double query_latency_sum_us = 0.0;      // Sum of search() and search_filtered() latencies
+};
+
+/**
+ * SearchMetrics - Aggregate counters updated by every search of a PyramidGraph
+ *
+ * All counters are relaxed atomics, so concurrent searches can update them
+ * without locking and a scraper can call snapshot() at any time.
+ */
+class SearchMetrics {
+public:
+    /**
+     * Account for one search() or search_filtered() call
+     */
+    void record_query(double latency_us, double routing_us, double sub_graph_us,
+                      size_t partitions_probed, size_t candidates_merged);
+    
+    /**
+     * Account for one search_batch() or range_search() call
+     */
+    void record_batch(size_t nq, double latency_us, double routing_us, double sub_graph_us,
+                      size_t partitions_probed, size_t candidates_merged);
+    
+    /**
+     * Account for one search_partitions() call, part of a query routed elsewhere
+     */
+    void record_partitions(double sub_graph_us, size_t partitions_probed, size_t candidates_merged);
+    
+    /**
+     * Copy the current counters
+     */
+    SearchMetricsSnapshot snapshot() const;
+    
+    /**
+     * Reset every counter to zero
+     */
+    void reset();
+
+private:
+    std::atomic<uint64_t> queries_{0};              // Queries answered
+    std::atomic<uint64_t> batches_{0};              // search_batch() and range_search() calls
+    std::atomic<uint64_t> partition_searches_{0};   // search_partitions() calls
+    std::atomic<uint64_t> partitions_probed_{0};    // Sub-HNSW searches
+    std::atomic<uint64_t> candidates_merged_{0};    // Candidates offered to the top-k merge
+    std::atomic<uint64_t> routing_ns_{0};           // Time in the meta-HNSW graph
+    std::atomic<uint64_t> sub_graph_ns_{0};         // Time in the sub-HNSW graphs
+    LatencyHistogram query_latency_;                // search() and search_filtered() latencies
+    LatencyHistogram batch_latency_;                // search_batch() and range_search() latencies
+};
+
+} // namespace pyramid
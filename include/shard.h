@@ -0,0 +1,193 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <string>
+#include <thread>
+#include "pyramid.h"
+
+namespace pyramid {
+
+/**
+ * A shard worker process and the partitions it serves
+ */
+struct ShardEndpoint {
+    std::string socket_path;     // Unix-domain socket the worker listens on
+    std::vector<int> partitions; // Partitions loaded by the worker
+};
+
+/**
+ * What ShardRouter::search() returns when some shards do not answer in time
+ */
+enum class PartialResults {
+    ALLOW,  // Merge the shards that answered and report the others as failed
+    FAIL    // Return no results unless every queried shard answered
+};
+
+/**
+ * Options of a ShardRouter
+ */
+struct RouterOptions {
+    int timeout_ms = 1000;       // Per-search deadline for every queried shard
+    PartialResults partial_results = PartialResults::ALLOW;  // Policy for missing shards
+    int idle_connections = 8;    // Connections kept open per shard between searches
+};
+
+/**
+ * Outcome of one ShardRouter::search() call
+ */
+struct ShardSearchStatus {
+    int shards_queried = 0;      // Shards that own at least one probed partition
+    int shards_failed = 0;       // Shards that failed, timed out or could not be reached
+    int partitions_missed = 0;   // Probed partitions whose results are missing
+};
+
+/**
+ * ShardServer - Serves searches over a subset of partitions on a Unix-domain socket
+ *
+ * The worker loads the index with PyramidGraph::load(path, use_mmap, &partitions)
+ * and answers ShardRouter requests with search_partitions(). Every connection
+ * is handled by its own thread, one request at a time. A request whose search
+ * throws is answered with an error and the connection stays open.
+ */
+class ShardServer {
+public:
+    /**
+     * Create a server for an index; the index must outlive the server
+     *
+     * @param index Graph holding (at least) the partitions served
+     */
+    explicit ShardServer(const PyramidGraph& index);
+    
+    /**
+     * Destructor, stops serving and removes the socket file
+     */
+    ~ShardServer();
+    
+    ShardServer(const ShardServer&) = delete;
+    ShardServer& operator=(const ShardServer&) = delete;
+    
+    /**
+     * Bind and listen on a socket path, replacing a stale socket file
+     *
+     * @param socket_path Path of the Unix-domain socket
+     * @return True if the socket is listening, false otherwise
+     */
+    bool listen(const std::string& socket_path);
+    
+    /**
+     * Accept connections and serve requests until stop() is called
+     */
+    void serve();
+    
+    /**
+     * Make serve() return and close every connection; safe from any thread
+     */
+    void stop();
+
+private:
+    const PyramidGraph& index_;          // Graph searched by the requests
+    std::string socket_path_;            // Bound socket path, removed on destruction
+    int listen_fd_ = -1;                 // Listening socket
+    int wake_fds_[2] = {-1, -1};         // Self-pipe waking serve() on stop()
+    std::atomic<bool> stopping_{false};  // Set by stop()
+    std::mutex connections_mutex_;       // Guards connection_fds_, workers_ and finished_
+    std::vector<int> connection_fds_;    // Open client connections
+    std::vector<std::thread> workers_;   // One thread per connection, joined once finished
+    std::vector<std::thread::id> finished_;  // Threads whose connection closed, joined on the next accept
+    
+    /**
+     * Answer the requests of one connection until it is closed
+     *
+     * @param fd Connected socket
+     */
+    void handle_connection(int fd);
+};
+
+/**
+ * ShardRouter - Scatter-gather search over shard worker processes
+ *
+ * The router holds a graph loaded without partitions, so only the meta-HNSW
+ * graph is in memory. Each search is routed locally, sent to the shards that
+ * own the probed partitions, and their answers are merged into the top k.
+ * Searches may run concurrently from several threads: each one takes its
+ * own connection to every queried shard from a per-shard pool, so a worker
+ * serves them in parallel on its connection threads. A connection that
+ * misses the deadline is closed and replaced by a new one when needed.
+ */
+class ShardRouter {
+public:
+    /**
+     * Create a router; connections are opened lazily by the first search
+     *
+     * @param routing_index Graph providing the meta-HNSW (see PyramidGraph::load)
+     * @param shards Workers and the partitions they own; a partition owned by
+     *               several workers is sent to the first one listed
+     * @param options Deadline and partial-results policy
+     */
+    ShardRouter(std::unique_ptr<PyramidGraph> routing_index, std::vector<ShardEndpoint> shards,
+                const RouterOptions& options = RouterOptions());
+    
+    /**
+     * Destructor, closes the idle shard connections
+     */
+    ~ShardRouter();
+    
+    ShardRouter(const ShardRouter&) = delete;
+    ShardRouter& operator=(const ShardRouter&) = delete;
+    
+    /**
+     * Search for the k nearest neighbors across the shards
+     *
+     * Adaptive probing is not applied: every one of the nprobe routed
+     * partitions that has an owner is searched.
+     *
+     * @param query Pointer to the query vector
+     * @param k Number of neighbors to return
+     * @param indices Output array for the indices of neighbors
+     * @param distances Output array for the distances to neighbors
+     * @param params Probing options, or nullptr for the defaults
+     * @param status Filled with the shard outcome when not null
+     * @return False if a shard failed under PartialResults::FAIL (outputs are
+     *         then empty, with ids of -1), true otherwise
+     */
+    bool search(const float* query, int k, int* indices, float* distances,
+                const SearchParams* params = nullptr, ShardSearchStatus* status = nullptr) const;
+
+private:
+    // Connections to one shard that no search is using
+    struct ConnectionPool {
+        std::mutex mutex;        // Guards idle
+        std::vector<int> idle;   // Connected sockets, most recently used last
+        std::atomic<uint64_t> next_request{0};  // Id of the next request to the shard
+    };
+    
+    std::unique_ptr<PyramidGraph> index_;   // Routing graph
+    std::vector<ShardEndpoint> shards_;     // Worker addresses
+    RouterOptions options_;                 // Deadline, policy and pool size
+    std::vector<int> owner_;                // Shard serving each partition (-1: none)
+    std::unique_ptr<ConnectionPool[]> pools_;  // One pool per shard
+    
+    /**
+     * Take an idle connection to a shard, or open a new one
+     *
+     * @param s Shard index
+     * @param reused Set to true if the connection came from the pool
+     * @return Connected socket, or -1 if the shard cannot be reached
+     */
+    int acquire(size_t s, bool& reused) const;
+    
+    /**
+     * Return a connection whose last exchange completed to the pool
+     *
+     * The connection is closed instead when the pool is full.
+     *
+     * @param s Shard index
+     * @param fd Connected socket
+     */
+    void release(size_t s, int fd) const;
+};
+
+} // namespace pyramid
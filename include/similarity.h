@@ -2,9 +2,48 @@
 
 #include <vector>
 #include <cmath>
+#include <cstddef>
+#include <cstdint>
 
 namespace pyramid {
 
+/**
+ * Instruction sets the distance kernels can be dispatched to, in increasing order
+ */
+enum class SimdLevel {
+    SCALAR,     // Portable loops
+    SSE,        // 128-bit SSE3
+    AVX2,       // 256-bit AVX2 with FMA
+    AVX512      // 512-bit AVX-512F
+};
+
+/**
+ * Detect the best instruction set supported by this CPU
+ *
+ * @return Highest SimdLevel available (SCALAR on non-x86 builds)
+ */
+SimdLevel detect_simd_level();
+
+/**
+ * Get the instruction set the distance functions currently use
+ */
+SimdLevel simd_level();
+
+/**
+ * Force the distance functions onto an instruction set, e.g. to compare
+ * kernels in a benchmark. Levels above what the CPU supports are lowered.
+ * Must not be called concurrently with distance computations.
+ *
+ * @param level Requested SimdLevel
+ * @return SimdLevel actually in use
+ */
+SimdLevel set_simd_level(SimdLevel level);
+
+/**
+ * Get a printable name for a SimdLevel
+ */
+const char* simd_level_name(SimdLevel level);
+
 /**
  * Compute Euclidean distance between two vectors
  *
@@ -15,6 +54,16 @@ namespace pyramid {
  */
 float euclidean_distance(const float* a, const float* b, int dim);
 
+/**
+ * Compute the inner product of two vectors
+ *
+ * @param a First vector
+ * @param b Second vector
+ * @param dim Dimension of vectors
+ * @return Inner product
+ */
+float inner_product(const float* a, const float* b, int dim);
+
 /**
  * Compute Angular distance (cosine similarity) between two vectors
  *
@@ -25,6 +74,70 @@ float euclidean_distance(const float* a, const float* b, int dim);
  */
 float angular_distance(const float* a, const float* b, int dim);
 
+/**
+ * Compute Angular distance between two unit-length vectors, skipping the norms
+ *
+ * @param a First vector (normalized)
+ * @param b Second vector (normalized)
+ * @param dim Dimension of vectors
+ * @return Angular distance (1 - inner product)
+ */
+float angular_distance_normalized(const float* a, const float* b, int dim);
+
+/**
+ * Compute squared Euclidean distances from one query to n contiguous vectors
+ *
+ * @param query Query vector
+ * @param data Vectors to compare against (size: n * dim)
+ * @param n Number of vectors
+ * @param dim Dimension of vectors
+ * @param distances Output distances (size: n)
+ */
+void euclidean_distance_batch(const float* query, const float* data, size_t n, int dim, float* distances);
+
+/**
+ * Compute Angular distances from one query to n contiguous vectors
+ *
+ * @param query Query vector
+ * @param data Vectors to compare against (size: n * dim)
+ * @param n Number of vectors
+ * @param dim Dimension of vectors
+ * @param normalized True if the query and data are unit length, which skips the norms
+ * @param distances Output distances (size: n)
+ */
+void angular_distance_batch(const float* query, const float* data, size_t n, int dim,
+                            bool normalized, float* distances);
+
+/**
+ * Compute squared Euclidean distances between every query and every vector,
+ * in cache-sized blocks and in parallel for large inputs
+ *
+ * @param queries Query vectors (size: nq * dim)
+ * @param nq Number of queries
+ * @param data Vectors to compare against (size: n * dim)
+ * @param n Number of vectors
+ * @param dim Dimension of vectors
+ * @param distances Output distances, row-major per query (size: nq * n)
+ */
+void euclidean_distance_matrix(const float* queries, size_t nq, const float* data, size_t n, int dim,
+                               float* distances);
+
+/**
+ * Compute squared Euclidean distances from one query to a list of rows,
+ * gathering the rows by id (e.g. for re-ranking candidates)
+ *
+ * @param query Query vector
+ * @param data First row of the vectors
+ * @param stride Distance between consecutive rows in floats (dim for a
+ *               dense array, dim + 1 for a mapped .fvecs file)
+ * @param dim Dimension of vectors
+ * @param ids Row ids; negative ids yield FLT_MAX
+ * @param n Number of ids
+ * @param distances Output distances (size: n)
+ */
+void euclidean_distance_by_ids(const float* query, const float* data, size_t stride, int dim,
+                               const int64_t* ids, size_t n, float* distances);
+
 /**
  * Normalize a vector to unit length
  *
@@ -34,7 +147,7 @@ float angular_distance(const float* a, const float* b, int dim);
 void normalize_vector(float* vec, int dim);
 
 /**
- * Normalize a dataset of vectors to unit length
+ * Normalize a dataset of vectors to unit length, in parallel
  *
  * @param data Dataset to normalize (modified in-place)
  * @param n Number of vectors
@@ -42,4 +155,4 @@ void normalize_vector(float* vec, int dim);
  */
 void normalize_dataset(float* data, size_t n, int dim);
 
-} // namespace pyramid 
\ No newline at end of file
+} // namespace pyramid
\ No newline at end of file
@@ -0,0 +1,132 @@
+#include "../include/dataset.h"
+#include "../include/similarity.h"
+#include <iostream>
+#include <algorithm>
+
+namespace pyramid {
+
+namespace {
+
+// Size in bytes of one component of the given format
+size_t component_size(VecsFormat format) {
+    return format == VecsFormat::BVECS ? sizeof(uint8_t) : sizeof(int32_t);
+}
+
+// Check whether a path ends with the given suffix
+bool has_suffix(const std::string& path, const std::string& suffix) {
+    return path.size() >= suffix.size() &&
+           path.compare(path.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+} // namespace
+
+bool VecsFile::open(const std::string& path) {
+    if (has_suffix(path, ".fvecs")) {
+        return open(path, VecsFormat::FVECS);
+    }
+    if (has_suffix(path, ".ivecs")) {
+        return open(path, VecsFormat::IVECS);
+    }
+    if (has_suffix(path, ".bvecs")) {
+        return open(path, VecsFormat::BVECS);
+    }
+    
+    std::cerr << "Error: cannot deduce vector format of " << path 
+              << " (expected .fvecs, .ivecs or .bvecs)" << std::endl;
+    return false;
+}
+
+bool VecsFile::open(const std::string& path, VecsFormat format) {
+    num_vectors_ = 0;
+    dim_ = 0;
+    
+    if (!file_.open(path)) {
+        return false;
+    }
+    
+    if (file_.size() < sizeof(int32_t)) {
+        std::cerr << "Error: file too small to hold a vector: " << path << std::endl;
+        file_.close();
+        return false;
+    }
+    
+    int32_t dim;
+    std::memcpy(&dim, file_.data(), sizeof(dim));
+    if (dim <= 0) {
+        std::cerr << "Error: invalid dimension " << dim << " in " << path << std::endl;
+        file_.close();
+        return false;
+    }
+    
+    const size_t stride = sizeof(int32_t) + static_cast<size_t>(dim) * component_size(format);
+    if (file_.size() % stride != 0) {
+        std::cerr << "Error: size of " << path << " is not a multiple of the row size " 
+                  << stride << std::endl;
+        file_.close();
+        return false;
+    }
+    
+    format_ = format;
+    dim_ = dim;
+    stride_ = stride;
+    num_vectors_ = file_.size() / stride;
+    return true;
+}
+
+bool VecsFile::validate() const {
+    const uint8_t* data = file_.data();
+    const int64_t n = static_cast<int64_t>(num_vectors_);
+    int64_t mismatches = 0;
+    
+#pragma omp parallel for reduction(+:mismatches) schedule(static)
+    for (int64_t i = 0; i < n; i++) {
+        int32_t d;
+        std::memcpy(&d, data + i * stride_, sizeof(d));
+        if (d != dim_) {
+            mismatches++;
+        }
+    }
+    
+    if (mismatches > 0) {
+        std::cerr << "Dimension mismatch in " << mismatches << " rows" << std::endl;
+        return false;
+    }
+    
+    return true;
+}
+
+void VecsFile::read_rows(size_t begin, size_t end, float* out, bool normalize) const {
+    const size_t last = std::min(end, num_vectors_);
+    const int64_t count = last > begin ? static_cast<int64_t>(last - begin) : 0;
+    
+#pragma omp parallel for schedule(static)
+    for (int64_t i = 0; i < count; i++) {
+        const uint8_t* src = file_.data() + (begin + i) * stride_ + sizeof(int32_t);
+        float* dst = out + i * dim_;
+        
+        switch (format_) {
+            case VecsFormat::FVECS:
+                std::memcpy(dst, src, dim_ * sizeof(float));
+                break;
+            case VecsFormat::IVECS:
+                for (int d = 0; d < dim_; d++) {
+                    int32_t value;
+                    std::memcpy(&value, src + d * sizeof(int32_t), sizeof(value));
+                    dst[d] = static_cast<float>(value);
+                }
+                break;
+            case VecsFormat::BVECS:
+                for (int d = 0; d < dim_; d++) {
+                    dst[d] = static_cast<float>(src[d]);
+                }
+                break;
+        }
+        
+        // Normalize while the row is still in cache
+        if (normalize) {
+            normalize_vector(dst, dim_);
+        }
+    }
+}
+
+} // namespace pyramid
@@ -1,5 +1,4 @@
 #include <iostream>
-#include <fstream>
 #include <vector>
 #include <unordered_set>
 #include <chrono>
@@ -7,77 +6,31 @@
 
 #include "../include/pyramid.h"
 #include "../include/similarity.h"
+#include "../include/dataset.h"
 
-// Function to read .fvecs file (base/query vectors)
-std::vector<float> read_fvecs(const std::string& filename, int& num_vectors, int& dim) {
-    std::ifstream file(filename, std::ios::binary);
-    if (!file) {
-        std::cerr << "Error opening file: " << filename << std::endl;
-        exit(1);
+// Function to load a .fvecs/.bvecs file (base/query vectors) into a contiguous float array
+bool load_vectors(const std::string& filename, std::vector<float>& data, size_t& num_vectors, int& dim) {
+    pyramid::VecsFile file;
+    if (!file.open(filename) || !file.validate()) {
+        return false;
     }
 
-    file.read(reinterpret_cast<char*>(&dim), sizeof(int)); // Read dimension
-
-    file.seekg(0, std::ios::end);
-    size_t file_size = file.tellg();
-    num_vectors = file_size / ((1 + dim) * sizeof(float)); // Calculate number of vectors
-
-    std::vector<float> data(num_vectors * dim);
-    file.seekg(0, std::ios::beg);
-    
-    for (int i = 0; i < num_vectors; i++) {
-        int d;
-        file.read(reinterpret_cast<char*>(&d), sizeof(int)); // Read dimension (should match)
-        if (d != dim) {
-            std::cerr << "Dimension mismatch in " << filename << std::endl;
-            exit(1);
-        }
-        file.read(reinterpret_cast<char*>(&data[i * dim]), dim * sizeof(float)); // Read vector data
-    }
-
-    file.close();
-    return data;
-}
-
-// Function to read .ivecs file (ground truth neighbors)
-std::vector<std::vector<int>> read_ivecs(const std::string& filename, int num_queries, int k) {
-    std::ifstream file(filename, std::ios::binary);
-    if (!file) {
-        std::cerr << "Error opening ground truth file: " << filename << std::endl;
-        exit(1);
-    }
-
-    std::vector<std::vector<int>> ground_truth(num_queries);
-
-    for (int i = 0; i < num_queries; i++) {
-        int d;
-        file.read(reinterpret_cast<char*>(&d), sizeof(int)); // Read the number of neighbors stored
-
-        if (i == 0) {
-            std::cout << "Ground truth file contains k = " << d << " neighbors per query" << std::endl;
-        }
-
-        if (d < k) {
-            std::cerr << "Error: Ground truth file contains only " << d << " neighbors, but we need " << k << std::endl;
-            exit(1);
-        }
-
-        ground_truth[i].resize(d);
-        file.read(reinterpret_cast<char*>(ground_truth[i].data()), d * sizeof(int));
-    }
-
-    file.close();
-    return ground_truth;
+    num_vectors = file.num_vectors();
+    dim = file.dim();
+    data.resize(num_vectors * dim);
+    file.read_rows(0, num_vectors, data.data());
+    return true;
 }
 
 // Function to compute recall@k (accuracy comparison between results & ground truth)
 float compute_recall(const std::vector<int>& result_indices,
-                     const std::vector<std::vector<int>>& ground_truth,
-                     int num_queries, int k) {
-    int correct = 0;
+                     const pyramid::VecsView<int32_t>& ground_truth,
+                     size_t num_queries, int k) {
+    size_t correct = 0;
     
-    for (int i = 0; i < num_queries; i++) {
-        std::unordered_set<int> true_neighbors(ground_truth[i].begin(), ground_truth[i].end());
+    for (size_t i = 0; i < num_queries; i++) {
+        const int32_t* row = ground_truth.row(i);
+        std::unordered_set<int> true_neighbors(row, row + ground_truth.dim);
 
         for (int j = 0; j < k; j++) {
             if (true_neighbors.find(result_indices[i * k + j]) != true_neighbors.end()) {
@@ -90,29 +43,52 @@ float compute_recall(const std::vector<int>& result_indices,
 }
 
 int main() {
-    int num_base, num_queries, dim;
+    size_t num_base, num_queries;
+    int dim, query_dim;
     int k = 100; // Number of nearest neighbors to find
     int num_clusters = 10; // Number of partitions to create
 
     // Load dataset
-    std::vector<float> base_vectors = read_fvecs("data/siftsmall/siftsmall_base.fvecs", num_base, dim);
+    std::vector<float> base_vectors;
+    if (!load_vectors("data/siftsmall/siftsmall_base.fvecs", base_vectors, num_base, dim)) {
+        return 1;
+    }
     std::cout << "Loaded " << num_base << " base vectors with dimension " << dim << std::endl;
 
-    std::vector<float> query_vectors = read_fvecs("data/siftsmall/siftsmall_query.fvecs", num_queries, dim);
+    std::vector<float> query_vectors;
+    if (!load_vectors("data/siftsmall/siftsmall_query.fvecs", query_vectors, num_queries, query_dim)) {
+        return 1;
+    }
+    if (query_dim != dim) {
+        std::cerr << "Error: query dimension " << query_dim << " does not match base dimension " << dim << std::endl;
+        return 1;
+    }
     std::cout << "Loaded " << num_queries << " query vectors" << std::endl;
 
-    std::vector<std::vector<int>> ground_truth = read_ivecs("data/siftsmall/siftsmall_groundtruth.ivecs", num_queries, k);
+    pyramid::VecsFile ground_truth_file;
+    if (!ground_truth_file.open("data/siftsmall/siftsmall_groundtruth.ivecs") || !ground_truth_file.validate()) {
+        return 1;
+    }
+    std::cout << "Ground truth file contains k = " << ground_truth_file.dim() << " neighbors per query" << std::endl;
+    if (ground_truth_file.dim() < k || ground_truth_file.num_vectors() < num_queries) {
+        std::cerr << "Error: Ground truth file contains only " << ground_truth_file.dim() << " neighbors for "
+                  << ground_truth_file.num_vectors() << " queries, but we need " << k << std::endl;
+        return 1;
+    }
+    pyramid::VecsView<int32_t> ground_truth = ground_truth_file.ivecs();
     std::cout << "Loaded ground truth for " << num_queries << " queries" << std::endl;
 
-    // Optional: Normalize vectors for angular similarity
-    // pyramid::normalize_dataset(base_vectors.data(), num_base, dim);
-    // pyramid::normalize_dataset(query_vectors.data(), num_queries, dim);
+    // Optional: angular similarity. Pass pyramid::Metric::COSINE to the PyramidGraph
+    // constructor below; vectors and queries are then normalized on ingestion.
 
     // Create and build Pyramid index
     std::cout << "\nBuilding Pyramid index with " << num_clusters << " partitions..." << std::endl;
     auto start_time = std::chrono::high_resolution_clock::now();
     
     pyramid::PyramidGraph pyramid(dim, num_clusters);
+    pyramid::BuildParams build_params;
+    build_params.verbose = true;
+    pyramid.set_build_params(build_params);
     // Call to Algorithm 3: Pyramid Index Construction
     pyramid.build(base_vectors.data(), num_base);
     
@@ -127,12 +103,9 @@ int main() {
     std::cout << "\nPerforming " << num_queries << " queries..." << std::endl;
     start_time = std::chrono::high_resolution_clock::now();
     
-    for (int i = 0; i < num_queries; i++) {
-        // Call to Algorithm 4: Pyramid Query Processing
-        pyramid.search(query_vectors.data() + i * dim, k, 
-                      result_indices.data() + i * k, 
-                      result_distances.data() + i * k);
-    }
+    // Call to Algorithm 4: Pyramid Query Processing, batched over all queries
+    pyramid.search_batch(num_queries, query_vectors.data(), k,
+                         result_indices.data(), result_distances.data());
     
     end_time = std::chrono::high_resolution_clock::now();
     auto search_time = std::chrono::duration_cast<std::chrono::milliseconds>(end_time - start_time).count();
@@ -143,7 +116,7 @@ int main() {
 
     // Display Pyramid query results
     std::cout << "\nQuery Results (Top-" << k << " neighbors for first 5 queries):\n";
-    for (int i = 0; i < std::min(5, num_queries); i++) {
+    for (size_t i = 0; i < std::min<size_t>(5, num_queries); i++) {
         std::cout << "Query " << i << ": ";
         for (int j = 0; j < std::min(5, k); j++) { // Show only first 5 neighbors
             std::cout << "(" << result_indices[i * k + j] << ", " 
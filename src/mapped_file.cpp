@@ -0,0 +1,162 @@
+#include "../include/mapped_file.h"
+#include <iostream>
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace pyramid {
+
+namespace {
+
+// Size of a transparent huge page on x86-64 and most AArch64 kernels
+const size_t kHugePageSize = 2 * 1024 * 1024;
+
+} // namespace
+
+MappedFile::~MappedFile() {
+    close();
+}
+
+bool MappedFile::open(const std::string& path, bool random_access) {
+    close();
+    
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        std::cerr << "Error opening file: " << path << " (" << std::strerror(errno) << ")" << std::endl;
+        return false;
+    }
+    
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        std::cerr << "Error reading size of file: " << path << " (" << std::strerror(errno) << ")" << std::endl;
+        ::close(fd);
+        return false;
+    }
+    
+    if (st.st_size == 0) {
+        std::cerr << "Error: file is empty: " << path << std::endl;
+        ::close(fd);
+        return false;
+    }
+    
+    void* addr = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    // The mapping keeps its own reference to the file
+    ::close(fd);
+    
+    if (addr == MAP_FAILED) {
+        std::cerr << "Error mapping file: " << path << " (" << std::strerror(errno) << ")" << std::endl;
+        return false;
+    }
+    
+    if (random_access) {
+        madvise(addr, st.st_size, MADV_RANDOM);
+    }
+    
+    data_ = static_cast<const uint8_t*>(addr);
+    size_ = static_cast<size_t>(st.st_size);
+    mapping_size_ = size_;
+    return true;
+}
+
+bool MappedFile::load(const std::string& path, bool huge_pages) {
+    close();
+    
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        std::cerr << "Error opening file: " << path << " (" << std::strerror(errno) << ")" << std::endl;
+        return false;
+    }
+    
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        std::cerr << "Error: cannot read size of file or file is empty: " << path << std::endl;
+        ::close(fd);
+        return false;
+    }
+    
+    // Whole huge pages, so that the tail of the file is covered as well
+    const size_t size = static_cast<size_t>(st.st_size);
+    const size_t granularity = huge_pages ? kHugePageSize : static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    const size_t mapping_size = (size + granularity - 1) / granularity * granularity;
+    // mmap only aligns to the base page, and huge pages can only back 2 MiB-aligned
+    // ranges, so map one extra huge page and unmap the unaligned head and tail
+    const size_t reserved_size = huge_pages ? mapping_size + kHugePageSize : mapping_size;
+    void* addr = mmap(nullptr, reserved_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED) {
+        std::cerr << "Error allocating " << reserved_size << " bytes for file: " << path 
+                  << " (" << std::strerror(errno) << ")" << std::endl;
+        ::close(fd);
+        return false;
+    }
+    if (huge_pages) {
+        uint8_t* reserved = static_cast<uint8_t*>(addr);
+        const uintptr_t start = reinterpret_cast<uintptr_t>(reserved);
+        const size_t head = (kHugePageSize - start % kHugePageSize) % kHugePageSize;
+        const size_t tail = kHugePageSize - head;
+        if (head > 0) {
+            munmap(reserved, head);
+        }
+        if (tail > 0) {
+            munmap(reserved + head + mapping_size, tail);
+        }
+        addr = reserved + head;
+    }
+#ifdef MADV_HUGEPAGE
+    if (huge_pages) {
+        madvise(addr, mapping_size, MADV_HUGEPAGE);
+    }
+#endif
+    
+    uint8_t* bytes = static_cast<uint8_t*>(addr);
+    size_t done = 0;
+    while (done < size) {
+        const ssize_t count = pread(fd, bytes + done, size - done, static_cast<off_t>(done));
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count <= 0) {
+            std::cerr << "Error reading file: " << path << " (" 
+                      << (count < 0 ? std::strerror(errno) : "unexpected end of file") << ")" << std::endl;
+            munmap(addr, mapping_size);
+            ::close(fd);
+            return false;
+        }
+        done += static_cast<size_t>(count);
+    }
+    ::close(fd);
+    mprotect(addr, mapping_size, PROT_READ);
+    
+    data_ = bytes;
+    size_ = size;
+    mapping_size_ = mapping_size;
+    anonymous_ = true;
+    return true;
+}
+
+void MappedFile::release(size_t offset, size_t size) const {
+    if (!data_ || anonymous_ || offset >= size_) {
+        return;
+    }
+    const size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    const size_t begin = (offset + page - 1) / page * page;
+    const size_t end = std::min(offset + size, size_) / page * page;
+    if (begin < end) {
+        madvise(const_cast<uint8_t*>(data_) + begin, end - begin, MADV_DONTNEED);
+    }
+}
+
+void MappedFile::close() {
+    if (data_) {
+        munmap(const_cast<uint8_t*>(data_), mapping_size_);
+        data_ = nullptr;
+        size_ = 0;
+        mapping_size_ = 0;
+        anonymous_ = false;
+    }
+}
+
+} // namespace pyramid
@@ -1,16 +1,28 @@
 #include "../include/partition.h"
 #include <faiss/Clustering.h>
 #include <faiss/IndexFlat.h>
+#include <faiss/utils/distances.h>
 #include <vector>
+#include <algorithm>
+#include <limits>
+#include <cmath>
 #include <iostream>
 #include <random>
 #include <unordered_set>
 
 namespace pyramid {
 
+namespace {
+
+// Points assigned per chunk; bounds the temporary search buffers
+const size_t kAssignChunkSize = 16384;
+
+} // namespace
+
 // Perform k-means clustering on a dataset using FAISS
 bool kmeans_cluster(const float* dataset, size_t n, int dim, int k,
-                   float* cluster_centers, int* assignments, int niter, bool verbose) {
+                   float* cluster_centers, int* assignments, int niter, bool verbose,
+                   size_t sample_size, int seed, faiss::MetricType metric, bool normalize) {
     // Handle edge cases
     if (n < k) {
         std::cerr << "Error: Number of points (" << n << ") is less than k (" << k << ")" << std::endl;
@@ -22,22 +34,41 @@ bool kmeans_cluster(const float* dataset, size_t n, int dim, int k,
         faiss::ClusteringParameters params;
         params.niter = niter;
         params.verbose = verbose;
+        params.seed = seed;
+        params.spherical = metric == faiss::METRIC_INNER_PRODUCT;
         
-        // Use L2 distance for clustering
-        faiss::IndexFlatL2 index(dim);
-        faiss::Clustering clustering(dim, k, params);
+        // Train on a sample; only the sampled rows are copied
+        if (sample_size == 0) {
+            sample_size = static_cast<size_t>(k) * params.max_points_per_centroid;
+        }
+        sample_size = std::max(std::min(sample_size, n), static_cast<size_t>(k));
+        // The sample is final, so FAISS must not subsample it again
+        params.max_points_per_centroid = static_cast<int>((sample_size + k - 1) / k);
         
-        // Prepare input data
-        std::vector<float> data_copy(dataset, dataset + n * dim);
+        // Clustering index in the requested metric
+        faiss::IndexFlat index(dim, metric);
+        faiss::Clustering clustering(dim, k, params);
         
-        // Run k-means clustering
-        clustering.train(n, data_copy.data(), index);
+        // Run k-means clustering; normalization is applied to the sampled copy
+        if (sample_size >= n && !normalize) {
+            clustering.train(n, dataset, index);
+        } else {
+            const std::vector<size_t> rows = sample_rows(n, sample_size, seed);
+            std::vector<float> sample(rows.size() * dim);
+            for (size_t i = 0; i < rows.size(); i++) {
+                std::copy(dataset + rows[i] * dim, dataset + (rows[i] + 1) * dim, sample.data() + i * dim);
+            }
+            if (normalize) {
+                faiss::fvec_renorm_L2(dim, rows.size(), sample.data());
+            }
+            clustering.train(rows.size(), sample.data(), index);
+        }
         
         // Copy cluster centers
         std::copy(clustering.centroids.data(), clustering.centroids.data() + k * dim, cluster_centers);
         
         // Assign points to clusters
-        assign_to_clusters(dataset, n, dim, cluster_centers, k, assignments);
+        assign_to_clusters(dataset, n, dim, cluster_centers, k, assignments, metric);
         
         return true;
     } catch (const std::exception& e) {
@@ -46,6 +77,24 @@ bool kmeans_cluster(const float* dataset, size_t n, int dim, int k,
     }
 }
 
+std::vector<size_t> sample_rows(size_t n, size_t sample_size, int seed) {
+    sample_size = std::min(sample_size, n);
+    std::vector<size_t> rows;
+    rows.reserve(sample_size);
+    
+    // Selection sampling: one pass, O(sample_size) memory, rows come out sorted
+    std::mt19937_64 rng(seed);
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+    for (size_t i = 0; i < n && rows.size() < sample_size; i++) {
+        const double remaining_needed = static_cast<double>(sample_size - rows.size());
+        if (uniform(rng) * (n - i) < remaining_needed) {
+            rows.push_back(i);
+        }
+    }
+    
+    return rows;
+}
+
 void copy_idx_to_int(const faiss::idx_t* src, int* dst, size_t n) {
     for (size_t i = 0; i < n; i++) {
         dst[i] = static_cast<int>(src[i]);
@@ -53,20 +102,220 @@ void copy_idx_to_int(const faiss::idx_t* src, int* dst, size_t n) {
 }
 
 void assign_to_clusters(const float* dataset, size_t n, int dim, 
-                      const float* cluster_centers, int k, int* assignments) {
-    // Create a FAISS index for the cluster centers
-    faiss::IndexFlatL2 center_index(dim);
+                      const float* cluster_centers, int k, int* assignments,
+                      faiss::MetricType metric) {
+    // Create a FAISS index for the cluster centers. The best inner product
+    // does not depend on the point's norm, so cosine needs no normalization.
+    faiss::IndexFlat center_index(dim, metric);
+    center_index.add(k, cluster_centers);
+    
+    // Find nearest center for each point, one bounded chunk per task
+    const int64_t num_chunks = static_cast<int64_t>((n + kAssignChunkSize - 1) / kAssignChunkSize);
+    
+#pragma omp parallel
+    {
+        // Need to use faiss::idx_t for labels
+        std::vector<float> distances(kAssignChunkSize);
+        std::vector<faiss::idx_t> idx_assignments(kAssignChunkSize);
+        
+#pragma omp for schedule(dynamic, 1)
+        for (int64_t chunk = 0; chunk < num_chunks; chunk++) {
+            const size_t begin = chunk * kAssignChunkSize;
+            const size_t count = std::min(kAssignChunkSize, n - begin);
+            
+            center_index.search(count, dataset + begin * dim, 1, distances.data(), idx_assignments.data());
+            
+            // Convert faiss::idx_t to int using our helper
+            copy_idx_to_int(idx_assignments.data(), assignments + begin, count);
+        }
+    }
+}
+
+bool balanced_assign_to_clusters(const float* dataset, size_t n, int dim,
+                                 const float* cluster_centers, int k, size_t capacity,
+                                 int* assignments, int num_candidates, faiss::MetricType metric) {
+    if (capacity * k < n) {
+        std::cerr << "Error: capacity " << capacity << " x " << k << " clusters cannot hold " 
+                  << n << " points" << std::endl;
+        return false;
+    }
+    
+    // Candidate centers are searched per chunk, both for the regret and for placement
+    const int r = std::max(1, std::min(num_candidates, k));
+    const bool similarity = metric == faiss::METRIC_INNER_PRODUCT;
+    faiss::IndexFlat center_index(dim, metric);
     center_index.add(k, cluster_centers);
     
-    // Find nearest center for each point - need to use faiss::idx_t for labels
-    std::vector<float> distances(n);
-    std::vector<faiss::idx_t> idx_assignments(n);
+    const int64_t num_chunks = static_cast<int64_t>((n + kAssignChunkSize - 1) / kAssignChunkSize);
+    
+    // Points that lose the most by missing their first choice are placed first
+    // (candidates come best first: ascending distance or descending similarity)
+    std::vector<size_t> order(n);
+    for (size_t i = 0; i < n; i++) {
+        order[i] = i;
+    }
+    if (r > 1) {
+        std::vector<float> regret(n);
+        
+#pragma omp parallel
+        {
+            std::vector<float> distances(kAssignChunkSize * 2);
+            std::vector<faiss::idx_t> labels(kAssignChunkSize * 2);
+            
+#pragma omp for schedule(dynamic, 1)
+            for (int64_t chunk = 0; chunk < num_chunks; chunk++) {
+                const size_t begin = chunk * kAssignChunkSize;
+                const size_t count = std::min(kAssignChunkSize, n - begin);
+                
+                center_index.search(count, dataset + begin * dim, 2, distances.data(), labels.data());
+                for (size_t i = 0; i < count; i++) {
+                    regret[begin + i] = std::fabs(distances[i * 2 + 1] - distances[i * 2]);
+                }
+            }
+        }
+        std::stable_sort(order.begin(), order.end(), [&regret](size_t a, size_t b) {
+            return regret[a] > regret[b];
+        });
+    }
+    
+    // Place the points in that order, fetching the candidates of one bounded
+    // chunk at a time rather than keeping n * r of them
+    std::vector<size_t> counts(k, 0);
+    std::vector<size_t> overflow;
+    std::vector<float> chunk_points(kAssignChunkSize * dim);
+    std::vector<float> distances(kAssignChunkSize * r);
+    std::vector<faiss::idx_t> candidates(kAssignChunkSize * r);
+    for (size_t begin = 0; begin < n; begin += kAssignChunkSize) {
+        const size_t count = std::min(kAssignChunkSize, n - begin);
+        
+#pragma omp parallel for schedule(static)
+        for (int64_t b = 0; b < static_cast<int64_t>(count); b++) {
+            const float* point = dataset + order[begin + b] * dim;
+            std::copy(point, point + dim, chunk_points.data() + b * dim);
+        }
+        center_index.search(count, chunk_points.data(), r, distances.data(), candidates.data());
+        
+        for (size_t b = 0; b < count; b++) {
+            const size_t i = order[begin + b];
+            assignments[i] = -1;
+            for (int j = 0; j < r; j++) {
+                const faiss::idx_t c = candidates[b * r + j];
+                if (c >= 0 && counts[c] < capacity) {
+                    assignments[i] = static_cast<int>(c);
+                    counts[c]++;
+                    break;
+                }
+            }
+            if (assignments[i] < 0) {
+                overflow.push_back(i);
+            }
+        }
+    }
+    
+    // All candidates of these points are full: take the nearest center with room
+    for (size_t i : overflow) {
+        const float* point = dataset + i * dim;
+        float best_distance = std::numeric_limits<float>::max();
+        int best = -1;
+        for (int c = 0; c < k; c++) {
+            if (counts[c] >= capacity) {
+                continue;
+            }
+            const float* center = cluster_centers + static_cast<size_t>(c) * dim;
+            const float distance = similarity ? -faiss::fvec_inner_product(point, center, dim)
+                                              : faiss::fvec_L2sqr(point, center, dim);
+            if (distance < best_distance) {
+                best_distance = distance;
+                best = c;
+            }
+        }
+        assignments[i] = best;
+        counts[best]++;
+    }
+    
+    return true;
+}
+
+PartitionSizeStats compute_partition_size_stats(const std::vector<size_t>& sizes) {
+    PartitionSizeStats stats;
+    if (sizes.empty()) {
+        return stats;
+    }
+    
+    stats.min_size = *std::min_element(sizes.begin(), sizes.end());
+    stats.max_size = *std::max_element(sizes.begin(), sizes.end());
+    
+    double sum = 0.0;
+    for (size_t size : sizes) {
+        sum += size;
+    }
+    stats.mean_size = sum / sizes.size();
+    
+    double variance = 0.0;
+    for (size_t size : sizes) {
+        variance += (size - stats.mean_size) * (size - stats.mean_size);
+    }
+    stats.stddev = std::sqrt(variance / sizes.size());
+    stats.imbalance = stats.mean_size > 0.0 ? stats.max_size / stats.mean_size : 0.0;
     
-    // Perform search with idx_t type for labels
-    center_index.search(n, dataset, 1, distances.data(), idx_assignments.data());
+    return stats;
+}
+
+void compute_cluster_means(const float* dataset, size_t n, int dim,
+                           const int* assignments, int k, float* cluster_centers, bool spherical) {
+    const size_t center_size = static_cast<size_t>(k) * dim;
+    std::vector<double> sums(center_size, 0.0);
+    std::vector<size_t> counts(k, 0);
     
-    // Convert faiss::idx_t to int using our helper
-    copy_idx_to_int(idx_assignments.data(), assignments, n);
+#pragma omp parallel
+    {
+        // Per-thread partial sums, merged once at the end
+        std::vector<double> local_sums(center_size, 0.0);
+        std::vector<size_t> local_counts(k, 0);
+        
+#pragma omp for schedule(static)
+        for (int64_t i = 0; i < static_cast<int64_t>(n); i++) {
+            const int cluster = assignments[i];
+            if (cluster < 0 || cluster >= k) {
+                continue;  // Skip invalid assignments
+            }
+            
+            const float* point = dataset + i * dim;
+            double* sum = local_sums.data() + static_cast<size_t>(cluster) * dim;
+            double scale = 1.0;
+            if (spherical) {
+                const float norm = std::sqrt(faiss::fvec_norm_L2sqr(point, dim));
+                scale = norm > 0.0f ? 1.0 / norm : 0.0;
+            }
+            for (int d = 0; d < dim; d++) {
+                sum[d] += point[d] * scale;
+            }
+            local_counts[cluster]++;
+        }
+        
+#pragma omp critical
+        {
+            for (size_t j = 0; j < center_size; j++) {
+                sums[j] += local_sums[j];
+            }
+            for (int c = 0; c < k; c++) {
+                counts[c] += local_counts[c];
+            }
+        }
+    }
+    
+    // Compute average for each cluster
+    for (int c = 0; c < k; c++) {
+        for (int d = 0; d < dim; d++) {
+            const size_t j = static_cast<size_t>(c) * dim + d;
+            cluster_centers[j] = counts[c] > 0 ? static_cast<float>(sums[j] / counts[c]) : 0.0f;
+        }
+    }
+    
+    // Spherical means lie on the unit sphere, like FAISS's spherical k-means centroids
+    if (spherical) {
+        faiss::fvec_renorm_L2(dim, k, cluster_centers);
+    }
 }
 
 std::vector<std::vector<int>> extract_cluster_members(const float* dataset, size_t n, 
@@ -1,41 +1,276 @@
 #include "../include/pyramid.h"
 #include "../include/partition.h"
 #include "../include/search.h"
+#include "../include/search_context.h"
+#include "../include/mapped_file.h"
+#include "../include/dataset.h"
+#include "../include/similarity.h"
 #include <faiss/IndexFlat.h>
 #include <faiss/Clustering.h>
+#include <faiss/clone_index.h>
+#include <faiss/impl/AuxIndexStructures.h>
 #include <iostream>
+#include <exception>
+#include <mutex>
 #include <algorithm>
 #include <memory>
+#include <limits>
+#include <unordered_set>
+#include <chrono>
+#include <cmath>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 namespace pyramid {
 
-PyramidGraph::PyramidGraph(int dim, int num_clusters, int m, int ef_construction, int ef_search)
-    : dim_(dim), num_clusters_(num_clusters), 
+namespace {
+
+// Milliseconds between two time points
+double elapsed_ms(std::chrono::high_resolution_clock::time_point start,
+                  std::chrono::high_resolution_clock::time_point end) {
+    return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+// Microseconds between two time points
+double elapsed_us(std::chrono::high_resolution_clock::time_point start,
+                  std::chrono::high_resolution_clock::time_point end) {
+    return std::chrono::duration<double, std::micro>(end - start).count();
+}
+
+// Adaptive probing: whether a partition whose centroid is at centroid_distance
+// can still contribute when the current k-th result is at kth_distance
+bool should_probe(float centroid_distance, float kth_distance, const SearchParams& params) {
+    return centroid_distance <= params.probe_ratio * kth_distance;
+}
+
+// Excludes tombstoned local ids from a sub-HNSW search
+struct TombstoneSelector : faiss::IDSelector {
+    const uint8_t* deleted = nullptr;
+    
+    bool is_member(faiss::idx_t id) const override {
+        return !deleted[id];
+    }
+};
+
+// Restricts a search to flagged ids: filtered local ids, or partitions when routing
+struct AllowedSelector : faiss::IDSelector {
+    const uint8_t* allowed = nullptr;
+    
+    bool is_member(faiss::idx_t id) const override {
+        return allowed[id] != 0;
+    }
+};
+
+// Search parameters for one sub-HNSW graph: efSearch override and tombstone or search filter
+struct SubGraphParams {
+    faiss::SearchParametersHNSW hnsw;
+    TombstoneSelector tombstones;
+    AllowedSelector filter;
+    
+    // Parameters for searching a partition, or nullptr when the graph defaults apply.
+    // allowed flags already exclude tombstoned entries.
+    const faiss::SearchParameters* prepare(const faiss::IndexHNSW& graph, const SearchParams& params,
+                                           const std::vector<uint8_t>& deleted, size_t num_deleted,
+                                           const uint8_t* allowed = nullptr) {
+        if (params.ef_search <= 0 && num_deleted == 0 && !allowed) {
+            return nullptr;
+        }
+        
+        hnsw.efSearch = params.ef_search > 0 ? params.ef_search : graph.hnsw.efSearch;
+        hnsw.sel = nullptr;
+        if (allowed) {
+            filter.allowed = allowed;
+            hnsw.sel = &filter;
+        } else if (num_deleted > 0) {
+            tombstones.deleted = deleted.data();
+            hnsw.sel = &tombstones;
+        }
+        return &hnsw;
+    }
+};
+
+// Euclidean radius of the smallest ball around center that holds every vector
+float enclosing_radius(const float* center, const float* data, size_t n, int dim) {
+    float max_distance = 0.0f;
+    for (size_t i = 0; i < n; i++) {
+        max_distance = std::max(max_distance, faiss::fvec_L2sqr(center, data + i * dim, dim));
+    }
+    return std::sqrt(max_distance);
+}
+
+// Share k children between nodes in proportion to their sizes; every non-empty
+// node gets at least one child and none gets more children than it has points
+std::vector<int> split_children(const std::vector<size_t>& sizes, int k) {
+    size_t total = 0;
+    for (size_t size : sizes) {
+        total += size;
+    }
+    
+    std::vector<int> shares(sizes.size(), 0);
+    std::vector<double> remainders(sizes.size(), 0.0);
+    int assigned = 0;
+    for (size_t g = 0; g < sizes.size(); g++) {
+        if (sizes[g] == 0) {
+            continue;
+        }
+        const double exact = static_cast<double>(k) * sizes[g] / total;
+        shares[g] = static_cast<int>(std::min<double>(std::max(1.0, std::floor(exact)), sizes[g]));
+        remainders[g] = exact - shares[g];
+        assigned += shares[g];
+    }
+    
+    // Hand out the rest by largest remainder, or take back by smallest
+    std::vector<size_t> order(sizes.size());
+    for (size_t g = 0; g < order.size(); g++) {
+        order[g] = g;
+    }
+    std::stable_sort(order.begin(), order.end(), [&remainders](size_t a, size_t b) {
+        return remainders[a] > remainders[b];
+    });
+    bool progress = true;
+    while (assigned < k && progress) {
+        progress = false;
+        for (size_t i = 0; i < order.size() && assigned < k; i++) {
+            if (static_cast<size_t>(shares[order[i]]) < sizes[order[i]]) {
+                shares[order[i]]++;
+                assigned++;
+                progress = true;
+            }
+        }
+    }
+    progress = true;
+    while (assigned > k && progress) {
+        progress = false;
+        for (size_t i = order.size(); i-- > 0 && assigned > k;) {
+            if (shares[order[i]] > 1) {
+                shares[order[i]]--;
+                assigned--;
+                progress = true;
+            }
+        }
+    }
+    return shares;
+}
+
+// A range search hit of one query in one partition
+struct RangeHit {
+    size_t query;
+    faiss::idx_t id;
+    float distance;
+};
+
+// Bytes of an HNSW graph's vector codes and neighbor lists
+size_t graph_bytes(const faiss::IndexHNSW& graph) {
+    const faiss::HNSW& hnsw = graph.hnsw;
+    size_t bytes = hnsw.neighbors.size() * sizeof(faiss::HNSW::storage_idx_t) +
+                   hnsw.offsets.size() * sizeof(size_t) + hnsw.levels.size() * sizeof(int);
+    if (graph.storage) {
+        bytes += static_cast<size_t>(graph.storage->ntotal) * graph.storage->sa_code_size();
+    }
+    return bytes;
+}
+
+// First exception thrown inside an OpenMP loop; an exception must not leave
+// the region, so it is kept here and rethrown once the loop has ended
+class RegionError {
+public:
+    void capture() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!error_) {
+            error_ = std::current_exception();
+        }
+    }
+    
+    void rethrow() const {
+        if (error_) {
+            std::rethrow_exception(error_);
+        }
+    }
+
+private:
+    std::mutex mutex_;
+    std::exception_ptr error_;
+};
+
+// Scratch buffers reused by every query that runs on this thread
+SearchContext& thread_search_context() {
+    thread_local SearchContext context;
+    return context;
+}
+
+} // namespace
+
+PyramidGraph::PyramidGraph(int dim, int num_clusters, int m, int ef_construction, int ef_search,
+                           Metric metric)
+    : dim_(dim), graph_dim_(dim), num_clusters_(num_clusters), configured_clusters_(num_clusters),
       m_(m), ef_construction_(ef_construction), ef_search_(ef_search),
-      total_vectors_(0) {
+      total_vectors_(0), next_id_(0), codec_(StorageCodec::FLAT), pq_m_(0),
+      max_replicas_(1), replication_ratio_(1.0f), metric_(metric), partial_(false) {
     
     // Initialize the meta-graph
-    meta_graph_ = std::make_unique<faiss::IndexHNSWFlat>(dim_, m_);
-    meta_graph_->hnsw.efConstruction = ef_construction_;
-    meta_graph_->hnsw.efSearch = ef_search_;
+    reset_meta_graph();
     
     // Initialize partition structures
-    sub_graphs_.resize(num_clusters_);
-    partition_indices_.resize(num_clusters_);
+    reset_partitions();
 }
 
 PyramidGraph::~PyramidGraph() = default;
 
+void PyramidGraph::reset_partitions() {
+    num_clusters_ = configured_clusters_;
+    sub_graphs_.clear();
+    sub_graphs_.resize(num_clusters_);
+    partition_indices_.assign(num_clusters_, std::vector<faiss::idx_t>());
+    deleted_.assign(num_clusters_, std::vector<uint8_t>());
+    deleted_counts_.assign(num_clusters_, 0);
+    covering_radii_.assign(num_clusters_, 0.0f);
+    attribute_counts_.clear();
+}
+
 void PyramidGraph::build(const float* dataset, size_t n) {
     // IMPLEMENTATION OF ALGORITHM 3: Pyramid Index Construction
+    using Clock = std::chrono::high_resolution_clock;
+    const auto build_start = Clock::now();
+    build_stats_ = BuildStats();
+    index_changed();
     total_vectors_ = n;
+    next_id_ = n;
+    routing_tree_.reset();
+    
+    // A rebuild starts from empty partitions, even after add(), remove() or compact()
+    reset_partitions();
+    
+    // Clustering and graphs work on reduced vectors when a transform is configured
+    train_transform(dataset, n);
+    std::vector<float> projected;
+    if (transform_) {
+        projected.resize(n * graph_dim_);
+        project_vectors(dataset, n, projected.data());
+        dataset = projected.data();
+    }
+    reset_meta_graph();
     
     // Step 3-4: Partition the dataset using k-means clustering
-    std::vector<int> cluster_assignments = partition_data(dataset, n);
+    auto phase_start = Clock::now();
+    std::vector<float> centers;
+    std::vector<int> cluster_assignments = build_params_.routing_levels.empty() ?
+                                           partition_data(dataset, n, centers) :
+                                           partition_hierarchical(dataset, n, centers);
+    build_stats_.kmeans_ms = elapsed_ms(phase_start, Clock::now());
     
-    // Step 5: Extract cluster centers and build the meta-HNSW graph
-    std::vector<float> centers = extract_cluster_centers(dataset, n, cluster_assignments);
+    // Step 5: Extract cluster centers and build the meta-HNSW graph. Nearest-centroid
+    // assignments reuse the trained k-means centroids; otherwise recompute the means.
+    phase_start = Clock::now();
+    if (centers.empty()) {
+        centers = extract_cluster_centers(dataset, n, cluster_assignments);
+    }
     meta_graph_->add(num_clusters_, centers.data());
+    if (routing_tree_) {
+        routing_tree_->set_partition_centroids(centers.data(), num_clusters_);
+    }
+    build_stats_.centroid_ms = elapsed_ms(phase_start, Clock::now());
     
     // Step 6-10: Partition dataset and assign items to sub-datasets
     for (size_t i = 0; i < n; i++) {
@@ -43,150 +278,1925 @@ void PyramidGraph::build(const float* dataset, size_t n) {
         partition_indices_[cluster].push_back(i);
     }
     
+    // Also store vectors near a partition boundary in the neighboring partitions
+    max_replicas_ = std::max(1, build_params_.max_replicas);
+    replication_ratio_ = build_params_.replication_ratio;
+    if (max_replicas_ > 1) {
+        build_stats_.replicated_entries = replicate_boundary_vectors(dataset, n, centers, cluster_assignments);
+    }
+    
+    for (int c = 0; c < num_clusters_; c++) {
+        deleted_[c].assign(partition_indices_[c].size(), 0);
+        deleted_counts_[c] = 0;
+    }
+    
     // Step 11-12: Build sub-HNSW graphs for each partition
+    phase_start = Clock::now();
+    train_codec(dataset, n);
+    
+    // Gather the vectors of each partition, normalizing them on the way for cosine
+    build_sub_graphs(centers, [&](int c, float* cluster_data) {
+        for (size_t i = 0; i < partition_indices_[c].size(); i++) {
+            const size_t idx = partition_indices_[c][i];
+            ingest_vectors(dataset + idx * graph_dim_, 1, cluster_data + i * graph_dim_);
+        }
+        return true;
+    });
+    build_stats_.sub_graphs_ms = elapsed_ms(phase_start, Clock::now());
+    build_stats_.total_ms = elapsed_ms(build_start, Clock::now());
+    count_attributes();
+    report_build();
+}
+
+bool PyramidGraph::build_sub_graphs(const std::vector<float>& centers,
+                                    const std::function<bool(int, float*)>& gather) {
+    using Clock = std::chrono::high_resolution_clock;
+    
+    // Largest partitions first so that a big cluster never ends up as the tail
+    std::vector<int> build_order;
     for (int c = 0; c < num_clusters_; c++) {
         // Skip empty partitions
-        if (partition_indices_[c].empty()) {
-            continue;
+        if (!partition_indices_[c].empty()) {
+            build_order.push_back(c);
         }
+    }
+    std::stable_sort(build_order.begin(), build_order.end(), [this](int a, int b) {
+        return partition_indices_[a].size() > partition_indices_[b].size();
+    });
+    
+    // Split the available threads between partitions and FAISS's own OpenMP loops
+    int max_threads = 1;
+#ifdef _OPENMP
+    max_threads = omp_get_max_threads();
+#endif
+    int partition_threads = build_params_.partition_threads > 0 ?
+                            build_params_.partition_threads : max_threads;
+    partition_threads = std::max(1, std::min(partition_threads, static_cast<int>(build_order.size())));
+    const int threads_per_partition = build_params_.threads_per_partition > 0 ?
+                                      build_params_.threads_per_partition :
+                                      std::max(1, max_threads / partition_threads);
+    build_stats_.partition_threads = partition_threads;
+    build_stats_.threads_per_partition = threads_per_partition;
+    
+#ifdef _OPENMP
+    const int saved_max_active_levels = omp_get_max_active_levels();
+    if (threads_per_partition > 1) {
+        omp_set_max_active_levels(2);
+    }
+#endif
+    
+    std::vector<size_t> partition_sizes(num_clusters_);
+    for (int c = 0; c < num_clusters_; c++) {
+        partition_sizes[c] = partition_indices_[c].size();
+    }
+    build_stats_.partition_sizes = compute_partition_size_stats(partition_sizes);
+    
+    std::vector<double> gather_ms(num_clusters_, 0.0);
+    std::vector<double> graph_build_ms(num_clusters_, 0.0);
+    std::vector<uint8_t> gathered(num_clusters_, 1);
+    
+#pragma omp parallel for schedule(dynamic, 1) num_threads(partition_threads)
+    for (size_t b = 0; b < build_order.size(); b++) {
+        const int c = build_order[b];
+#ifdef _OPENMP
+        omp_set_num_threads(threads_per_partition);
+#endif
         
         // Create sub-graph for this partition
-        sub_graphs_[c] = std::make_unique<faiss::IndexHNSWFlat>(dim_, m_);
-        sub_graphs_[c]->hnsw.efConstruction = ef_construction_;
-        sub_graphs_[c]->hnsw.efSearch = ef_search_;
+        auto sub_graph = new_sub_graph();
         
         // Extract vectors for this cluster
+        auto gather_start = Clock::now();
         const size_t cluster_size = partition_indices_[c].size();
-        std::vector<float> cluster_data(cluster_size * dim_);
-        
-        for (size_t i = 0; i < cluster_size; i++) {
-            const size_t idx = partition_indices_[c][i];
-            std::copy(dataset + idx * dim_, dataset + (idx + 1) * dim_, cluster_data.data() + i * dim_);
+        std::vector<float> cluster_data(cluster_size * graph_dim_);
+        if (!gather(c, cluster_data.data())) {
+            gathered[c] = 0;
+            continue;
         }
+        covering_radii_[c] = enclosing_radius(centers.data() + static_cast<size_t>(c) * graph_dim_,
+                                              cluster_data.data(), cluster_size, graph_dim_);
+        gather_ms[c] = elapsed_ms(gather_start, Clock::now());
         
         // Add vectors to the sub-graph
-        sub_graphs_[c]->add(cluster_size, cluster_data.data());
+        auto add_start = Clock::now();
+        sub_graph->add(cluster_size, cluster_data.data());
+        graph_build_ms[c] = elapsed_ms(add_start, Clock::now());
+        
+        sub_graphs_[c] = std::move(sub_graph);
+        if (build_params_.locality_order) {
+            reorder_sub_graph(c);
+        }
+    }
+    
+#ifdef _OPENMP
+    omp_set_max_active_levels(saved_max_active_levels);
+#endif
+    
+    for (int c = 0; c < num_clusters_; c++) {
+        build_stats_.gather_ms += gather_ms[c];
+        build_stats_.graph_build_ms += graph_build_ms[c];
+    }
+    return std::find(gathered.begin(), gathered.end(), 0) == gathered.end();
+}
+
+void PyramidGraph::report_build() const {
+    if (!build_params_.verbose) {
+        return;
     }
+    std::cout << "Build phases: k-means " << build_stats_.kmeans_ms << " ms, "
+              << "centroids " << build_stats_.centroid_ms << " ms, ";
+    if (build_stats_.stream_ms > 0.0) {
+        std::cout << "stream " << build_stats_.stream_ms << " ms, ";
+    }
+    std::cout << "gather " << build_stats_.gather_ms << " ms, "
+              << "graph build " << build_stats_.graph_build_ms << " ms "
+              << "(" << build_stats_.sub_graphs_ms << " ms wall on " 
+              << build_stats_.partition_threads << "x" << build_stats_.threads_per_partition 
+              << " threads)" << std::endl;
+    const PartitionSizeStats& sizes = build_stats_.partition_sizes;
+    std::cout << "Partition sizes: min " << sizes.min_size << ", max " << sizes.max_size 
+              << ", mean " << sizes.mean_size << ", stddev " << sizes.stddev 
+              << ", max/mean " << sizes.imbalance << std::endl;
+}
+
+void PyramidGraph::search(const float* query, int k, int* indices, float* distances,
+                          const SearchParams* params) const {
+    search(query, k, indices, distances, thread_search_context(), params);
 }
 
-void PyramidGraph::search(const float* query, int k, int* indices, float* distances) const {
+void PyramidGraph::search(const float* query, int k, int* indices, float* distances,
+                          SearchContext& context, const SearchParams* params) const {
     // IMPLEMENTATION OF ALGORITHM 4: Pyramid Query Processing
+    using Clock = std::chrono::high_resolution_clock;
+    const SearchParams options = params ? *params : SearchParams();
+    
+    // Instrumentation only reads the clock when someone consumes the timings
+    SearchStats* stats = options.stats;
+    SearchMetrics* metrics = metrics_.get();
+    const bool timed = stats || metrics;
+    Clock::time_point call_start;
+    if (timed) {
+        call_start = Clock::now();
+    }
+    if (stats) {
+        stats->reset();
+    }
+    double routing_us = 0.0;
+    double sub_graph_us = 0.0;
+    size_t partitions_probed = 0;
+    size_t candidates_merged = 0;
     
-    // Step 3-4: Find the top partitions using the meta-HNSW graph
-    const int num_partitions_to_search = std::min(2, num_clusters_); // Search in top-2 partitions
+    // A repeated query is answered from the exact cache tier, keyed on the caller's bytes
+    QueryCache* cache = query_cache_.get();
+    const float* raw_query = query;
+    QueryCacheTag cache_tag;
+    if (cache && cache->caches_results()) {
+        cache_tag.k = k;
+        cache_tag.nprobe = options.nprobe;
+        cache_tag.ef_search = options.ef_search;
+        cache_tag.rerank_factor = options.rerank_factor;
+        cache_tag.adaptive = adaptive_probing(options);
+        cache_tag.probe_ratio = adaptive_probing(options) ? options.probe_ratio : 0.0f;
+        cache_tag.routing_beam = effective_routing_beam(options.routing_beam, options.nprobe);
+        if (cache->lookup_results(raw_query, cache_tag, indices, distances)) {
+            if (timed) {
+                const double total_us = elapsed_us(call_start, Clock::now());
+                if (stats) {
+                    stats->total_us = total_us;
+                    stats->cache_hit = true;
+                }
+                if (metrics) {
+                    metrics->record_query(total_us, 0.0, 0.0, 0, 0);
+                }
+            }
+            return;
+        }
+    }
+    
+    // Cosine queries are normalized into the context like the indexed vectors,
+    // then mapped into the graph space when the index is transformed
+    const float* graph_query = query;
+    if (projects_inputs()) {
+        query = prepare_queries(1, query, context.query, context.graph_query, graph_query);
+    }
     
-    std::vector<float> partition_distances(num_partitions_to_search);
-    std::vector<faiss::idx_t> partition_indices(num_partitions_to_search);
+    // Step 3-4: Find the top partitions using the meta-HNSW graph, unless a
+    // near-duplicate query already chose them
+    const int num_partitions_to_search = std::max(1, std::min(options.nprobe, num_clusters_));
+    const int candidates_per_partition = partition_candidates(k, options);
+    context.reserve(num_partitions_to_search, candidates_per_partition);
     
-    meta_graph_->search(1, query, num_partitions_to_search, 
-                       partition_distances.data(), partition_indices.data());
+    // A wider routing tree beam can choose other partitions, so the beam is part of the key
+    const bool cache_routing = cache && cache->caches_routing();
+    const int beam = effective_routing_beam(options.routing_beam, num_partitions_to_search);
+    if (!cache_routing || !cache->lookup_routing(query, num_partitions_to_search, beam,
+                                                 context.partition_ids.data(),
+                                                 context.partition_distances.data())) {
+        route_partitions(1, graph_query, num_partitions_to_search, options.routing_beam,
+                         context.partition_distances.data(), context.partition_ids.data());
+        if (cache_routing) {
+            cache->store_routing(query, num_partitions_to_search, beam, context.partition_ids.data(),
+                                 context.partition_distances.data());
+        }
+    }
+    if (timed) {
+        routing_us = elapsed_us(call_start, Clock::now());
+    }
     
-    // Prepare for merging results (Initialize resSet)
-    std::vector<faiss::idx_t> all_indices;
-    std::vector<float> all_distances;
+    // Prepare for merging results (Initialize resSet): a bounded heap of the k best,
+    // largest first for similarity metrics
+    TopKHeap& results = context.heap;
+    results.reset(k, metric_ != Metric::L2);
     
-    // Step 5-8: Search in each selected partition that contains neighbors
+    // Step 5-8: Search in each selected partition that contains neighbors, nearest first
     for (int p = 0; p < num_partitions_to_search; p++) {
-        int partition_idx = partition_indices[p];
+        faiss::idx_t partition_idx = context.partition_ids[p];
         
-        // Skip if partition is empty or doesn't exist
-        if (partition_idx >= num_clusters_ || !sub_graphs_[partition_idx] || 
-            partition_indices_[partition_idx].empty()) {
+        // Adaptive probing: stop once the next centroid is too far from the current k-th result
+        if (adaptive_probing(options) && p > 0 && results.full() &&
+            !should_probe(routing_distance(context.partition_distances[p]), 
+                          routing_distance(results.worst()), options)) {
+            break;
+        }
+        
+        // Skip if partition is empty, doesn't exist or is not loaded in this process
+        if (!is_searchable(partition_idx)) {
             continue;
         }
         
         // Step 7: Search within this partition's sub-HNSW graph
-        const int local_k = std::min(k, static_cast<int>(partition_indices_[partition_idx].size()));
-        std::vector<float> local_distances(local_k);
-        std::vector<faiss::idx_t> local_indices(local_k);
-        
-        sub_graphs_[partition_idx]->search(1, query, local_k, 
-                                          local_distances.data(), local_indices.data());
+        Clock::time_point sub_start;
+        if (timed) {
+            sub_start = Clock::now();
+        }
+        const int local_k = search_partition(partition_idx, query, graph_query, k, options, context);
+        partitions_probed++;
+        candidates_merged += local_k;
+        if (timed) {
+            const double us = elapsed_us(sub_start, Clock::now());
+            sub_graph_us += us;
+            if (stats) {
+                PartitionSearchStats partition_stats;
+                partition_stats.partition = static_cast<int>(partition_idx);
+                partition_stats.search_us = us;
+                partition_stats.results = local_k;
+                stats->partitions.push_back(partition_stats);
+            }
+        }
         
         // Step 8: Add results to resSet
         for (int i = 0; i < local_k; i++) {
-            all_indices.push_back(partition_indices_[partition_idx][local_indices[i]]);
-            all_distances.push_back(local_distances[i]);
+            results.push(context.local_distances[i], context.local_ids[i], max_replicas_ > 1);
         }
     }
     
-    // If we have no results, return empty
-    if (all_indices.empty()) {
-        for (int i = 0; i < k; i++) {
-            indices[i] = -1;
-            distances[i] = std::numeric_limits<float>::max();
+    // Step 9: Extract the top k neighbors from resSet
+    results.finish(indices, distances);
+    if (cache && cache->caches_results()) {
+        cache->store_results(raw_query, cache_tag, indices, distances);
+    }
+    
+    if (timed) {
+        const double total_us = elapsed_us(call_start, Clock::now());
+        if (stats) {
+            stats->total_us = total_us;
+            stats->routing_us = routing_us;
+            stats->sub_graph_us = sub_graph_us;
+            stats->merge_us = std::max(0.0, total_us - routing_us - sub_graph_us);
+            stats->partitions_probed = partitions_probed;
+            stats->candidates_merged = candidates_merged;
         }
-        return;
+        if (metrics) {
+            metrics->record_query(total_us, routing_us, sub_graph_us, partitions_probed, candidates_merged);
+        }
+    }
+}
+
+void PyramidGraph::route(size_t nq, const float* queries, int nprobe,
+                         faiss::idx_t* partition_ids, float* partition_distances, int beam) const {
+    std::vector<float> normalized_queries;
+    std::vector<float> projected_queries;
+    if (projects_inputs()) {
+        prepare_queries(nq, queries, normalized_queries, projected_queries, queries);
     }
     
-    // Step 9: Extract the top k neighbors from resSet
-    std::vector<std::pair<float, faiss::idx_t>> sorted_results;
-    for (size_t i = 0; i < all_indices.size(); i++) {
-        sorted_results.emplace_back(all_distances[i], all_indices[i]);
+    // Ask the meta-HNSW for at most num_clusters_ partitions, pad the rest
+    const int found = std::max(1, std::min(nprobe, num_clusters_));
+    std::vector<float> found_distances(nq * found);
+    std::vector<faiss::idx_t> found_ids(nq * found);
+    route_partitions(nq, queries, found, beam, found_distances.data(), found_ids.data());
+    
+    for (size_t q = 0; q < nq; q++) {
+        for (int p = 0; p < nprobe; p++) {
+            const bool valid = p < found;
+            partition_ids[q * nprobe + p] = valid ? found_ids[q * found + p] : -1;
+            partition_distances[q * nprobe + p] = valid ? found_distances[q * found + p] : 
+                                                  std::numeric_limits<float>::max();
+        }
+    }
+}
+
+void PyramidGraph::search_partitions(const float* query, int k, const int* partitions, int num_partitions,
+                                     int* indices, float* distances, const SearchParams* params) const {
+    using Clock = std::chrono::high_resolution_clock;
+    const SearchParams options = params ? *params : SearchParams();
+    SearchContext& context = thread_search_context();
+    SearchMetrics* metrics = metrics_.get();
+    Clock::time_point call_start;
+    if (metrics) {
+        call_start = Clock::now();
     }
     
-    std::sort(sorted_results.begin(), sorted_results.end());
+    const float* graph_query = query;
+    if (projects_inputs()) {
+        query = prepare_queries(1, query, context.query, context.graph_query, graph_query);
+    }
+    context.reserve(num_partitions, partition_candidates(k, options));
     
-    // Copy results to output arrays
-    const int result_k = std::min(k, static_cast<int>(sorted_results.size()));
-    for (int i = 0; i < result_k; i++) {
-        distances[i] = sorted_results[i].first;
-        indices[i] = sorted_results[i].second;
+    TopKHeap& results = context.heap;
+    results.reset(k, metric_ != Metric::L2);
+    size_t partitions_probed = 0;
+    size_t candidates_merged = 0;
+    for (int p = 0; p < num_partitions; p++) {
+        if (!is_searchable(partitions[p])) {
+            continue;
+        }
+        const int local_k = search_partition(partitions[p], query, graph_query, k, options, context);
+        partitions_probed++;
+        candidates_merged += local_k;
+        for (int i = 0; i < local_k; i++) {
+            results.push(context.local_distances[i], context.local_ids[i], max_replicas_ > 1);
+        }
     }
+    results.finish(indices, distances);
     
-    // Fill any remaining slots with -1
-    for (int i = result_k; i < k; i++) {
-        indices[i] = -1;
-        distances[i] = std::numeric_limits<float>::max();
+    // Routing happened elsewhere, so this is partition work rather than a query
+    if (metrics) {
+        metrics->record_partitions(elapsed_us(call_start, Clock::now()), partitions_probed, candidates_merged);
     }
 }
 
-std::vector<int> PyramidGraph::partition_data(const float* dataset, size_t n) {
-    std::vector<int> assignments(n);
-    std::vector<float> centroids(num_clusters_ * dim_);
+int PyramidGraph::search_partition(int c, const float* query, const float* graph_query, int k,
+                                   const SearchParams& options, SearchContext& context,
+                                   const uint8_t* allowed, size_t num_allowed) const {
+    const int candidates_per_partition = partition_candidates(k, options);
+    const size_t searchable = allowed ? num_allowed : live_count(c);
+    const int local_k = static_cast<int>(std::min<size_t>(candidates_per_partition, searchable));
+    float* local_distances = context.local_distances.data();
+    faiss::idx_t* local_ids = context.local_ids.data();
     
-    // Perform k-means clustering
-    bool success = kmeans_cluster(dataset, n, dim_, num_clusters_, 
-                               centroids.data(), assignments.data());
+    const std::shared_ptr<const faiss::IndexHNSW> sub_graph = partition_graph(c);
+    if (!sub_graph) {
+        return 0;
+    }
+    SubGraphParams sub_params;
+    sub_graph->search(1, graph_query, local_k, local_distances, local_ids,
+                      sub_params.prepare(*sub_graph, options, deleted_[c], deleted_counts_[c], allowed));
     
-    if (!success) {
-        std::cerr << "K-means clustering failed!" << std::endl;
-        // Fall back to simple assignment if k-means fails
-        for (size_t i = 0; i < n; i++) {
-            assignments[i] = i % num_clusters_;
+    // Translate local ids to global ids
+    const std::vector<faiss::idx_t>& id_map = partition_indices_[c];
+    for (int i = 0; i < local_k; i++) {
+        if (local_ids[i] >= 0) {
+            local_ids[i] = id_map[local_ids[i]];
         }
     }
     
-    return assignments;
+    // Re-rank approximate candidates against the full-precision vectors
+    if (candidates_per_partition > k) {
+        rerank(query, local_k, local_ids, local_distances);
+    }
+    
+    return local_k;
 }
 
-std::vector<float> PyramidGraph::extract_cluster_centers(const float* dataset, size_t n, 
-                                                      const std::vector<int>& cluster_assign) {
-    std::vector<float> centers(num_clusters_ * dim_, 0.0f);
-    std::vector<int> counts(num_clusters_, 0);
+void PyramidGraph::search_filtered(const float* query, int k, const SearchFilter& filter,
+                                   int* indices, float* distances, const SearchParams* params) const {
+    using Clock = std::chrono::high_resolution_clock;
+    const SearchParams options = params ? *params : SearchParams();
+    SearchStats* stats = options.stats;
+    SearchMetrics* metrics = metrics_.get();
+    const bool timed = stats || metrics;
+    Clock::time_point call_start;
+    if (timed) {
+        call_start = Clock::now();
+    }
+    if (stats) {
+        stats->reset();
+    }
+    SearchContext& context = thread_search_context();
+    double routing_us = 0.0;
+    size_t partitions_probed = 0;
+    size_t candidates_merged = 0;
     
-    // Sum vectors in each cluster
-    for (size_t i = 0; i < n; i++) {
-        int cluster = cluster_assign[i];
-        if (cluster < 0 || cluster >= num_clusters_) {
-            continue;  // Skip invalid assignments
+    const float* graph_query = query;
+    if (projects_inputs()) {
+        query = prepare_queries(1, query, context.query, context.graph_query, graph_query);
+    }
+    
+    TopKHeap& results = context.heap;
+    results.reset(k, metric_ != Metric::L2);
+    const bool replicated = max_replicas_ > 1;
+    
+    // Both exits finish the same way; exhaustive scans count as probes in the metrics
+    auto finish = [&] {
+        results.finish(indices, distances);
+        if (!timed) {
+            return;
+        }
+        const double total_us = elapsed_us(call_start, Clock::now());
+        if (stats) {
+            stats->total_us = total_us;
+            stats->routing_us = routing_us;
+        }
+        if (metrics) {
+            metrics->record_query(total_us, routing_us, std::max(0.0, total_us - routing_us),
+                                  partitions_probed, candidates_merged);
+        }
+    };
+    
+    // Partition-level pre-pruning: the attribute counts bound how many vectors
+    // of each partition can qualify
+    std::vector<uint8_t> candidate_partitions(num_clusters_, 0);
+    int num_candidates = 0;
+    size_t qualifying_bound = 0;
+    for (int c = 0; c < num_clusters_; c++) {
+        const size_t bound = is_searchable(c) ? attribute_bound(c, filter) : 0;
+        if (bound > 0) {
+            candidate_partitions[c] = 1;
+            num_candidates++;
+            qualifying_bound += bound;
+        }
+    }
+    
+    // Very selective filter: compare every qualifying vector, which is exact
+    if (num_candidates > 0 && qualifying_bound <= filter.brute_force_limit) {
+        for (int c = 0; c < num_clusters_; c++) {
+            if (candidate_partitions[c] && filter_partition(c, filter, context.filter_flags) > 0) {
+                const size_t scanned = scan_partition(c, query, graph_query, context.filter_flags.data(),
+                                                      context, results);
+                partitions_probed++;
+                candidates_merged += scanned;
+                if (stats) {
+                    stats->partitions_scanned++;
+                    stats->candidates_merged += scanned;
+                }
+            }
+        }
+        finish();
+        return;
+    }
+    
+    // Route to the nearest partitions that can hold qualifying vectors
+    const int nprobe = std::min(std::max(1, options.nprobe), std::max(1, num_candidates));
+    context.reserve(nprobe, partition_candidates(k, options));
+    if (num_candidates > 0) {
+        route_partitions(1, graph_query, nprobe, options.routing_beam, context.partition_distances.data(),
+                         context.partition_ids.data(),
+                         num_candidates < num_clusters_ ? candidate_partitions.data() : nullptr);
+    }
+    if (timed) {
+        routing_us = elapsed_us(call_start, Clock::now());
+    }
+    
+    for (int p = 0; p < nprobe && num_candidates > 0; p++) {
+        const faiss::idx_t partition_idx = context.partition_ids[p];
+        if (!is_searchable(partition_idx)) {
+            continue;
+        }
+        const int c = static_cast<int>(partition_idx);
+        
+        // Translate the filter to local ids of this partition
+        const size_t num_allowed = filter_partition(c, filter, context.filter_flags);
+        if (num_allowed == 0) {
+            if (stats) {
+                stats->partitions_filtered++;
+            }
+            continue;
         }
         
-        for (int d = 0; d < dim_; d++) {
-            centers[cluster * dim_ + d] += dataset[i * dim_ + d];
+        // A graph search mostly walks filtered-out nodes when few vectors qualify
+        if (num_allowed <= filter.brute_force_limit ||
+            num_allowed <= filter.brute_force_ratio * partition_indices_[c].size()) {
+            const size_t scanned = scan_partition(c, query, graph_query, context.filter_flags.data(),
+                                                  context, results);
+            partitions_probed++;
+            candidates_merged += scanned;
+            if (stats) {
+                stats->partitions_scanned++;
+                stats->candidates_merged += scanned;
+            }
+            continue;
+        }
+        
+        const int local_k = search_partition(c, query, graph_query, k, options, context,
+                                             context.filter_flags.data(), num_allowed);
+        for (int i = 0; i < local_k; i++) {
+            results.push(context.local_distances[i], context.local_ids[i], replicated);
+        }
+        partitions_probed++;
+        candidates_merged += local_k;
+        if (stats) {
+            stats->partitions_probed++;
+            stats->candidates_merged += local_k;
+        }
+    }
+    
+    finish();
+}
+
+size_t PyramidGraph::scan_partition(int c, const float* query, const float* graph_query, const uint8_t* allowed,
+                                    SearchContext& context, TopKHeap& results) const {
+    const std::shared_ptr<const faiss::IndexHNSW> sub_graph = partition_graph(c);
+    if (!sub_graph) {
+        return 0;
+    }
+    context.vector.resize(graph_dim_);
+    const bool full_precision = approximate_storage() && rerank_vectors_.base;
+    
+    const std::vector<faiss::idx_t>& id_map = partition_indices_[c];
+    size_t scanned = 0;
+    for (size_t local = 0; local < id_map.size(); local++) {
+        if (!allowed[local]) {
+            continue;
+        }
+        const float* row = full_precision ? rerank_row(id_map[local]) : nullptr;
+        float distance;
+        if (row) {
+            distance = exact_distance(query, row, dim_);
+        } else {
+            sub_graph->reconstruct(local, context.vector.data());
+            distance = exact_distance(graph_query, context.vector.data(), graph_dim_);
+        }
+        results.push(distance, id_map[local], max_replicas_ > 1);
+        scanned++;
+    }
+    return scanned;
+}
+
+size_t PyramidGraph::filter_partition(int c, const SearchFilter& filter, std::vector<uint8_t>& allowed) const {
+    const std::vector<faiss::idx_t>& id_map = partition_indices_[c];
+    const std::vector<uint8_t>& deleted = deleted_[c];
+    allowed.assign(id_map.size(), 0);
+    
+    size_t count = 0;
+    for (size_t local = 0; local < id_map.size(); local++) {
+        const faiss::idx_t id = id_map[local];
+        if (deleted[local]) {
+            continue;
+        }
+        if (!filter.attributes.empty() &&
+            std::find(filter.attributes.begin(), filter.attributes.end(), attribute_of(id)) == filter.attributes.end()) {
+            continue;
+        }
+        if (filter.id_bitmap && (id < 0 || static_cast<size_t>(id) >= filter.id_bitmap_size ||
+                                 !((filter.id_bitmap[id >> 3] >> (id & 7)) & 1))) {
+            continue;
+        }
+        if (filter.predicate && !filter.predicate(id)) {
+            continue;
+        }
+        allowed[local] = 1;
+        count++;
+    }
+    return count;
+}
+
+size_t PyramidGraph::attribute_bound(int c, const SearchFilter& filter) const {
+    if (filter.attributes.empty()) {
+        return live_count(c);
+    }
+    
+    size_t bound = 0;
+    for (int32_t value : filter.attributes) {
+        bound += attribute_count(c, value);
+    }
+    return std::min(bound, live_count(c));
+}
+
+void PyramidGraph::range_search(size_t nq, const float* queries, float radius, RangeSearchResults& results,
+                                const SearchParams* params) const {
+    using Clock = std::chrono::high_resolution_clock;
+    const SearchParams options = params ? *params : SearchParams();
+    SearchStats* stats = options.stats;
+    SearchMetrics* metrics = metrics_.get();
+    const bool timed = stats || metrics;
+    Clock::time_point call_start;
+    if (timed) {
+        call_start = Clock::now();
+    }
+    if (stats) {
+        stats->reset();
+    }
+    
+    std::vector<float> normalized_queries;
+    std::vector<float> projected_queries;
+    const float* graph_queries = queries;
+    if (projects_inputs()) {
+        queries = prepare_queries(nq, queries, normalized_queries, projected_queries, graph_queries);
+    }
+    const bool largest = metric_ != Metric::L2;
+    
+    // Exact distances to every centroid; the meta-HNSW storage is a flat index
+    std::vector<float> centroid_distances(nq * num_clusters_);
+    std::vector<faiss::idx_t> centroid_ids(nq * num_clusters_);
+    meta_graph_->storage->search(nq, graph_queries, num_clusters_, centroid_distances.data(), centroid_ids.data());
+    
+    // Partition c can only hold a hit x if the bound from its covering radius R allows it:
+    // |q - x| >= |q - c| - R for L2, <q, x> <= <q, c> + |q| R for similarities
+    const float radius_l2 = std::sqrt(std::max(0.0f, radius));
+    std::vector<std::vector<size_t>> partition_queries(num_clusters_);
+    size_t pruned = 0;
+    for (size_t q = 0; q < nq; q++) {
+        const float query_norm = metric_ == Metric::INNER_PRODUCT ? 
+                                 std::sqrt(faiss::fvec_norm_L2sqr(graph_queries + q * graph_dim_, graph_dim_)) : 1.0f;
+        for (int j = 0; j < num_clusters_; j++) {
+            const faiss::idx_t c = centroid_ids[q * num_clusters_ + j];
+            if (!is_searchable(c)) {
+                continue;
+            }
+            const float d = centroid_distances[q * num_clusters_ + j];
+            const bool reachable = largest ? d + query_norm * covering_radii_[c] >= radius :
+                                             std::sqrt(std::max(0.0f, d)) - covering_radii_[c] <= radius_l2;
+            if (reachable) {
+                partition_queries[c].push_back(q);
+            } else {
+                pruned++;
+            }
         }
-        counts[cluster]++;
     }
     
-    // Compute average for each cluster
+    std::vector<int> work;
     for (int c = 0; c < num_clusters_; c++) {
-        if (counts[c] > 0) {
-            for (int d = 0; d < dim_; d++) {
-                centers[c * dim_ + d] /= counts[c];
+        if (!partition_queries[c].empty()) {
+            work.push_back(c);
+        }
+    }
+    std::stable_sort(work.begin(), work.end(), [this](int a, int b) {
+        return partition_indices_[a].size() > partition_indices_[b].size();
+    });
+    Clock::time_point sub_start;
+    if (timed) {
+        sub_start = Clock::now();
+    }
+    
+    // Range-search each remaining partition once with all of its queries
+    const bool recheck = approximate_storage() && rerank_vectors_.base;
+    std::vector<std::vector<RangeHit>> partition_hits(num_clusters_);
+    RegionError load_error;
+#pragma omp parallel for schedule(dynamic, 1)
+    for (size_t w = 0; w < work.size(); w++) {
+        const int c = work[w];
+        const std::vector<size_t>& group = partition_queries[c];
+        std::shared_ptr<const faiss::IndexHNSW> sub_graph;
+        try {
+            sub_graph = partition_graph(c);
+        } catch (...) {
+            load_error.capture();
+        }
+        if (!sub_graph) {
+            continue;
+        }
+        
+        std::vector<float> batch_queries(group.size() * graph_dim_);
+        for (size_t i = 0; i < group.size(); i++) {
+            std::copy(graph_queries + group[i] * graph_dim_, graph_queries + (group[i] + 1) * graph_dim_,
+                      batch_queries.data() + i * graph_dim_);
+        }
+        faiss::RangeSearchResult range(group.size());
+        SubGraphParams sub_params;
+        sub_graph->range_search(group.size(), batch_queries.data(), radius, &range,
+                                sub_params.prepare(*sub_graph, options, deleted_[c], deleted_counts_[c]));
+        
+        const std::vector<faiss::idx_t>& id_map = partition_indices_[c];
+        for (size_t i = 0; i < group.size(); i++) {
+            for (size_t j = range.lims[i]; j < range.lims[i + 1]; j++) {
+                if (range.labels[j] < 0) {
+                    continue;
+                }
+                faiss::idx_t id = id_map[range.labels[j]];
+                float distance = range.distances[j];
+                
+                // Approximate distances are checked again against the full-precision vectors
+                if (recheck) {
+                    rerank(queries + group[i] * dim_, 1, &id, &distance);
+                    if (largest ? distance <= radius : distance >= radius) {
+                        continue;
+                    }
+                }
+                partition_hits[c].push_back({group[i], id, distance});
             }
         }
     }
+    load_error.rethrow();
+    
+    Clock::time_point merge_start;
+    if (timed) {
+        merge_start = Clock::now();
+    }
+    
+    // Gather each query's hits, keep the best copy of replicated vectors and sort best first
+    std::vector<std::vector<std::pair<float, faiss::idx_t>>> query_hits(nq);
+    size_t num_hits = 0;
+    for (int c : work) {
+        for (const RangeHit& hit : partition_hits[c]) {
+            query_hits[hit.query].emplace_back(largest ? -hit.distance : hit.distance, hit.id);
+        }
+        num_hits += partition_hits[c].size();
+    }
+    
+    results.lims.assign(nq + 1, 0);
+    results.ids.clear();
+    results.distances.clear();
+    results.ids.reserve(num_hits);
+    results.distances.reserve(num_hits);
+    for (size_t q = 0; q < nq; q++) {
+        std::vector<std::pair<float, faiss::idx_t>>& hits = query_hits[q];
+        if (max_replicas_ > 1) {
+            std::sort(hits.begin(), hits.end(), [](const auto& a, const auto& b) {
+                return a.second != b.second ? a.second < b.second : a.first < b.first;
+            });
+            hits.erase(std::unique(hits.begin(), hits.end(), [](const auto& a, const auto& b) {
+                return a.second == b.second;
+            }), hits.end());
+        }
+        std::sort(hits.begin(), hits.end());
+        for (const auto& hit : hits) {
+            results.distances.push_back(largest ? -hit.first : hit.first);
+            results.ids.push_back(hit.second);
+        }
+        results.lims[q + 1] = results.ids.size();
+    }
+    
+    if (timed) {
+        const Clock::time_point end = Clock::now();
+        const double total_us = elapsed_us(call_start, end);
+        const double routing_us = elapsed_us(call_start, sub_start);
+        const double sub_graph_us = elapsed_us(sub_start, merge_start);
+        size_t partitions_probed = 0;
+        for (int c : work) {
+            partitions_probed += partition_queries[c].size();
+        }
+        if (stats) {
+            stats->total_us = total_us;
+            stats->routing_us = routing_us;
+            stats->sub_graph_us = sub_graph_us;
+            stats->merge_us = elapsed_us(merge_start, end);
+            stats->partitions_pruned = pruned;
+            stats->candidates_merged = num_hits;
+            stats->partitions_probed = partitions_probed;
+        }
+        if (metrics) {
+            metrics->record_batch(nq, total_us, routing_us, sub_graph_us, partitions_probed, num_hits);
+        }
+    }
+}
+
+void PyramidGraph::search_batch(size_t nq, const float* queries, int k,
+                                int* indices, float* distances,
+                                const SearchParams* params) const {
+    // Batched form of Algorithm 4: route every query at once, then search
+    // each sub-HNSW graph with all of the queries that selected it
+    using Clock = std::chrono::high_resolution_clock;
+    const SearchParams options = params ? *params : SearchParams();
+    
+    SearchStats* stats = options.stats;
+    SearchMetrics* metrics = metrics_.get();
+    const bool timed = stats || metrics;
+    Clock::time_point call_start;
+    if (timed) {
+        call_start = Clock::now();
+    }
+    if (stats) {
+        stats->reset();
+    }
+    double routing_us = 0.0;
+    double sub_graph_us = 0.0;
+    size_t partitions_probed = 0;
+    size_t candidates_merged = 0;
+    
+    // Cosine queries are normalized like the indexed vectors, then mapped into
+    // the graph space when the index is transformed
+    std::vector<float> normalized_queries;
+    std::vector<float> projected_queries;
+    const float* graph_queries = queries;
+    if (projects_inputs()) {
+        queries = prepare_queries(nq, queries, normalized_queries, projected_queries, graph_queries);
+    }
+    const bool largest = metric_ != Metric::L2;
+    
+    const int num_partitions_to_search = std::max(1, std::min(options.nprobe, num_clusters_));
+    const size_t num_probes = nq * num_partitions_to_search;
+    
+    // Step 3-4: Route the whole batch through the meta-HNSW graph
+    std::vector<float> partition_distances(num_probes);
+    std::vector<faiss::idx_t> partition_ids(num_probes);
+    
+    route_partitions(nq, graph_queries, num_partitions_to_search, options.routing_beam,
+                     partition_distances.data(), partition_ids.data());
+    if (timed) {
+        routing_us = elapsed_us(call_start, Clock::now());
+    }
+    
+    // Each probe collects up to candidates_per_partition candidates with global ids
+    // (k, or more when quantized candidates are re-ranked)
+    const int candidates_per_partition = partition_candidates(k, options);
+    std::vector<float> candidate_distances(num_probes * candidates_per_partition, 
+                                           std::numeric_limits<float>::max());
+    std::vector<faiss::idx_t> candidate_ids(num_probes * candidates_per_partition, -1);
+    const size_t candidates_per_query = static_cast<size_t>(num_partitions_to_search) * candidates_per_partition;
     
+    // Step 5-8: Without adaptive probing every probe is searched in one round.
+    // Adaptive probing searches the i-th nearest partition of all still-active
+    // queries in round i, so probes stay grouped by partition.
+    const int num_rounds = adaptive_probing(options) ? num_partitions_to_search : 1;
+    const int probes_per_round = adaptive_probing(options) ? 1 : num_partitions_to_search;
+    std::vector<char> active(nq, 1);
+    
+    for (int round = 0; round < num_rounds; round++) {
+        std::vector<size_t> probes;
+        probes.reserve(nq * probes_per_round);
+        for (size_t q = 0; q < nq; q++) {
+            if (!active[q]) {
+                continue;
+            }
+            for (int slot = round * probes_per_round; slot < (round + 1) * probes_per_round; slot++) {
+                probes.push_back(q * num_partitions_to_search + slot);
+            }
+        }
+        
+        Clock::time_point round_start;
+        if (timed) {
+            round_start = Clock::now();
+        }
+        partitions_probed += search_probes(graph_queries, num_partitions_to_search, probes, partition_ids.data(), 
+                                           candidates_per_partition, options,
+                                           candidate_distances.data(), candidate_ids.data());
+        if (timed) {
+            sub_graph_us += elapsed_us(round_start, Clock::now());
+        }
+        
+        if (round + 1 == num_rounds) {
+            break;
+        }
+        
+        // Decide which queries probe their next partition
+#pragma omp parallel for schedule(static)
+        for (size_t q = 0; q < nq; q++) {
+            if (!active[q]) {
+                continue;
+            }
+            
+            TopKHeap& kth = thread_search_context().heap;
+            kth.reset(k, largest);
+            for (size_t i = q * candidates_per_query; i < (q + 1) * candidates_per_query; i++) {
+                kth.push(candidate_distances[i], candidate_ids[i], max_replicas_ > 1);
+            }
+            if (!kth.full()) {
+                continue;
+            }
+            
+            const float next_centroid_distance = partition_distances[q * num_partitions_to_search + round + 1];
+            active[q] = should_probe(routing_distance(next_centroid_distance), 
+                                     routing_distance(kth.worst()), options);
+        }
+    }
+    
+    // Step 9: Extract the top k neighbors for every query
+#pragma omp parallel for schedule(static) reduction(+ : candidates_merged)
+    for (size_t q = 0; q < nq; q++) {
+        // Re-rank approximate candidates against the full-precision vectors
+        if (candidates_per_partition > k) {
+            rerank(queries + q * dim_, candidates_per_query, 
+                   candidate_ids.data() + q * candidates_per_query,
+                   candidate_distances.data() + q * candidates_per_query);
+        }
+        
+        TopKHeap& results = thread_search_context().heap;
+        results.reset(k, largest);
+        for (size_t i = q * candidates_per_query; i < (q + 1) * candidates_per_query; i++) {
+            results.push(candidate_distances[i], candidate_ids[i], max_replicas_ > 1);
+            candidates_merged += candidate_ids[i] != -1;
+        }
+        
+        results.finish(indices + q * k, distances + q * k);
+    }
+    
+    if (timed) {
+        const double total_us = elapsed_us(call_start, Clock::now());
+        if (stats) {
+            stats->total_us = total_us;
+            stats->routing_us = routing_us;
+            stats->sub_graph_us = sub_graph_us;
+            stats->merge_us = std::max(0.0, total_us - routing_us - sub_graph_us);
+            stats->partitions_probed = partitions_probed;
+            stats->candidates_merged = candidates_merged;
+        }
+        if (metrics) {
+            metrics->record_batch(nq, total_us, routing_us, sub_graph_us, partitions_probed, candidates_merged);
+        }
+    }
+}
+
+size_t PyramidGraph::search_probes(const float* queries, int nprobe, const std::vector<size_t>& probes,
+                                   const faiss::idx_t* partition_ids, int k,
+                                   const SearchParams& options,
+                                   float* candidate_distances, faiss::idx_t* candidate_ids) const {
+    // Group probes by partition; a probe is identified by q * nprobe + slot
+    std::vector<std::vector<size_t>> partition_probes(num_clusters_);
+    size_t num_searched = 0;
+    for (size_t probe : probes) {
+        const faiss::idx_t partition_idx = partition_ids[probe];
+        if (!is_searchable(partition_idx)) {
+            continue;
+        }
+        partition_probes[partition_idx].push_back(probe);
+        num_searched++;
+    }
+    
+    // Split each partition's probes into chunks so that a single hot partition
+    // can still be spread over several threads; larger partitions go first
+    struct WorkItem {
+        int partition;
+        size_t begin;
+        size_t end;
+    };
+    
+    int num_threads = 1;
+#ifdef _OPENMP
+    num_threads = omp_get_max_threads();
+#endif
+    const size_t chunk_size = std::max<size_t>(16, probes.size() / (4 * num_threads) + 1);
+    
+    std::vector<WorkItem> work;
+    for (int c = 0; c < num_clusters_; c++) {
+        for (size_t b = 0; b < partition_probes[c].size(); b += chunk_size) {
+            work.push_back({c, b, std::min(b + chunk_size, partition_probes[c].size())});
+        }
+    }
+    std::stable_sort(work.begin(), work.end(), [this](const WorkItem& a, const WorkItem& b) {
+        return partition_indices_[a.partition].size() > partition_indices_[b.partition].size();
+    });
+    
+    // Search each partition once per chunk of queries. FAISS's own OpenMP
+    // loop runs serially inside this region, so one thread owns a chunk.
+    RegionError load_error;
+#pragma omp parallel for schedule(dynamic, 1)
+    for (size_t w = 0; w < work.size(); w++) {
+        const WorkItem& item = work[w];
+        const std::vector<size_t>& group = partition_probes[item.partition];
+        const std::vector<faiss::idx_t>& id_map = partition_indices_[item.partition];
+        const size_t batch_size = item.end - item.begin;
+        const int local_k = std::min(k, static_cast<int>(live_count(item.partition)));
+        
+        // Gather this chunk's queries into a contiguous block of the thread's scratch space
+        SearchContext& context = thread_search_context();
+        context.reserve(0, batch_size * local_k);
+        if (context.batch_queries.size() < batch_size * graph_dim_) {
+            context.batch_queries.resize(batch_size * graph_dim_);
+        }
+        float* batch_queries = context.batch_queries.data();
+        for (size_t i = 0; i < batch_size; i++) {
+            const size_t q = group[item.begin + i] / nprobe;
+            std::copy(queries + q * graph_dim_, queries + (q + 1) * graph_dim_, batch_queries + i * graph_dim_);
+        }
+        
+        // Step 7: Search within this partition's sub-HNSW graph
+        float* local_distances = context.local_distances.data();
+        faiss::idx_t* local_indices = context.local_ids.data();
+        std::shared_ptr<const faiss::IndexHNSW> sub_graph;
+        try {
+            sub_graph = partition_graph(item.partition);
+        } catch (...) {
+            load_error.capture();
+        }
+        if (!sub_graph) {
+            continue;
+        }
+        SubGraphParams sub_params;
+        sub_graph->search(batch_size, batch_queries, local_k,
+                          local_distances, local_indices,
+                          sub_params.prepare(*sub_graph, options, deleted_[item.partition],
+                                             deleted_counts_[item.partition]));
+        
+        // Step 8: Translate local ids and store them in the probe's candidate slot
+        for (size_t i = 0; i < batch_size; i++) {
+            const size_t probe = group[item.begin + i];
+            for (int j = 0; j < local_k; j++) {
+                const faiss::idx_t local = local_indices[i * local_k + j];
+                if (local < 0) {
+                    continue;
+                }
+                candidate_ids[probe * k + j] = id_map[local];
+                candidate_distances[probe * k + j] = local_distances[i * local_k + j];
+            }
+        }
+    }
+    load_error.rethrow();
+    
+    return num_searched;
+}
+
+void PyramidGraph::add(size_t n, const float* vectors, const faiss::idx_t* ids, const int32_t* attributes) {
+    if (n == 0) {
+        return;
+    }
+    if (partial_ || residency_) {
+        std::cerr << "Error: cannot add to a graph loaded partially or lazily" << std::endl;
+        return;
+    }
+    
+    // Candidates without a re-rank row keep their approximate distance
+    if (approximate_storage() && rerank_vectors_.base) {
+        const faiss::idx_t largest_id = ids ? *std::max_element(ids, ids + n) : 
+                                              next_id_ + static_cast<faiss::idx_t>(n) - 1;
+        if (largest_id >= 0 && static_cast<size_t>(largest_id) >= rerank_vectors_.n) {
+            std::cerr << "Warning: added ids reach " << largest_id << " but the re-rank vectors cover "
+                      << rerank_vectors_.n << "; re-attach vectors covering them" << std::endl;
+        }
+    }
+    
+    // Cosine vectors are normalized once on ingestion, and transformed ones
+    // mapped into the graph space
+    std::vector<float> normalized;
+    if (projects_inputs()) {
+        normalized.resize(n * graph_dim_);
+        project_vectors(vectors, n, normalized.data());
+        vectors = normalized.data();
+    }
+    
+    // Route every new vector to its nearest partition, like queries, plus the
+    // nearby partitions it is replicated into
+    const int r = std::min(max_replicas_, num_clusters_);
+    std::vector<float> route_distances(n * r);
+    std::vector<faiss::idx_t> route_ids(n * r);
+    route_partitions(n, vectors, r, 0, route_distances.data(), route_ids.data());
+    normalize_similarities(n, r, vectors, route_distances.data());
+    
+    std::vector<std::vector<size_t>> members(num_clusters_);
+    for (size_t i = 0; i < n; i++) {
+        const faiss::idx_t cluster = route_ids[i * r];
+        members[cluster >= 0 && cluster < num_clusters_ ? cluster : 0].push_back(i);
+        
+        for (int j = 1; j < r; j++) {
+            const faiss::idx_t replica = route_ids[i * r + j];
+            if (replica >= 0 && replica < num_clusters_ && 
+                within_replication_ratio(route_distances[i * r + j], route_distances[i * r])) {
+                members[replica].push_back(i);
+            }
+        }
+    }
+    
+    // Graphs used in place from a load() mapping cannot grow; copy the ones that receive entries
+    for (int c = 0; c < num_clusters_; c++) {
+        if (!members[c].empty() && !own_sub_graph(c)) {
+            return;
+        }
+    }
+    
+    // Record the attributes before the partitions count them
+    const bool counted = !attribute_counts_.empty();
+    if (attributes) {
+        for (size_t i = 0; i < n; i++) {
+            const faiss::idx_t id = ids ? ids[i] : next_id_ + static_cast<faiss::idx_t>(i);
+            if (id < 0) {
+                continue;
+            }
+            if (static_cast<size_t>(id) >= attributes_.size()) {
+                attributes_.resize(id + 1, -1);
+            }
+            attributes_[id] = attributes[i];
+        }
+    }
+    
+    // Append each group to its partition; partitions are independent
+#pragma omp parallel for schedule(dynamic, 1)
+    for (int c = 0; c < num_clusters_; c++) {
+        const std::vector<size_t>& group = members[c];
+        if (group.empty()) {
+            continue;
+        }
+        
+        if (!sub_graphs_[c]) {
+            sub_graphs_[c] = new_sub_graph();
+        }
+        
+        std::vector<float> cluster_data(group.size() * graph_dim_);
+        for (size_t i = 0; i < group.size(); i++) {
+            std::copy(vectors + group[i] * graph_dim_, vectors + (group[i] + 1) * graph_dim_, 
+                      cluster_data.data() + i * graph_dim_);
+        }
+        sub_graphs_[c]->add(group.size(), cluster_data.data());
+        
+        // Grow the covering ball to the new entries
+        std::vector<float> centroid(graph_dim_);
+        meta_graph_->reconstruct(c, centroid.data());
+        covering_radii_[c] = std::max(covering_radii_[c],
+                                      enclosing_radius(centroid.data(), cluster_data.data(), group.size(), graph_dim_));
+        
+        for (size_t i : group) {
+            const faiss::idx_t id = ids ? ids[i] : next_id_ + static_cast<faiss::idx_t>(i);
+            partition_indices_[c].push_back(id);
+            if (counted) {
+                attribute_counts_[c][attribute_of(id)]++;
+            }
+        }
+        deleted_[c].resize(partition_indices_[c].size(), 0);
+    }
+    if (!counted && !attributes_.empty()) {
+        count_attributes();
+    }
+    
+    if (ids) {
+        next_id_ = std::max(next_id_, *std::max_element(ids, ids + n) + 1);
+    } else {
+        next_id_ += n;
+    }
+    total_vectors_ += n;
+    index_changed();
+}
+
+size_t PyramidGraph::remove(size_t n, const faiss::idx_t* ids) {
+    const std::unordered_set<faiss::idx_t> to_remove(ids, ids + n);
+    std::vector<std::vector<faiss::idx_t>> removed(num_clusters_);
+    
+    // Tombstone every live entry whose global id is in the set
+#pragma omp parallel for schedule(dynamic, 1)
+    for (int c = 0; c < num_clusters_; c++) {
+        for (size_t local = 0; local < partition_indices_[c].size(); local++) {
+            if (!deleted_[c][local] && to_remove.count(partition_indices_[c][local])) {
+                deleted_[c][local] = 1;
+                removed[c].push_back(partition_indices_[c][local]);
+            }
+        }
+    }
+    
+    // Replicas of one vector are tombstoned in every partition but counted once
+    std::unordered_set<faiss::idx_t> removed_ids;
+    for (int c = 0; c < num_clusters_; c++) {
+        deleted_counts_[c] += removed[c].size();
+        removed_ids.insert(removed[c].begin(), removed[c].end());
+    }
+    total_vectors_ -= removed_ids.size();
+    if (!removed_ids.empty()) {
+        index_changed();
+    }
+    
+    return removed_ids.size();
+}
+
+int PyramidGraph::compact(const CompactParams& params) {
+    if (partial_ || residency_) {
+        std::cerr << "Error: cannot compact a graph loaded partially or lazily" << std::endl;
+        return 0;
+    }
+    
+    // Current routing centroids; rebuilt or split partitions update them
+    std::vector<float> centroids(static_cast<size_t>(num_clusters_) * graph_dim_);
+    meta_graph_->reconstruct_n(0, num_clusters_, centroids.data());
+    
+    const int initial_clusters = num_clusters_;
+    bool centroids_changed = false;
+    int rebuilt = 0;
+    
+    for (int c = 0; c < initial_clusters; c++) {
+        const size_t size = partition_indices_[c].size();
+        const size_t live = live_count(c);
+        const bool too_deleted = size > 0 && deleted_counts_[c] > params.max_deleted_fraction * size;
+        const bool too_large = params.max_partition_size > 0 && live > params.max_partition_size;
+        
+        if (!too_deleted && !too_large) {
+            continue;
+        }
+        rebuilt++;
+        
+        // Collect the live vectors and their global ids from the current graph
+        std::vector<float> live_data(live * graph_dim_);
+        std::vector<faiss::idx_t> live_ids;
+        live_ids.reserve(live);
+        for (size_t local = 0; local < size; local++) {
+            if (!deleted_[c][local]) {
+                reconstruct_vector(*sub_graphs_[c], c, local, live_data.data() + live_ids.size() * graph_dim_);
+                live_ids.push_back(partition_indices_[c][local]);
+            }
+        }
+        
+        // Decoded vectors drift off the unit sphere, so cosine data is normalized again
+        if (metric_ == Metric::COSINE) {
+            ingest_vectors(live_data.data(), live, live_data.data());
+        }
+        
+        if (live == 0) {
+            sub_graphs_[c].reset();
+            covering_radii_[c] = 0.0f;
+            partition_indices_[c].clear();
+            deleted_[c].clear();
+            deleted_counts_[c] = 0;
+            continue;
+        }
+        
+        // Split oversized partitions into pieces of at most max_partition_size
+        int pieces = 1;
+        std::vector<int> piece_assignments(live, 0);
+        if (too_large) {
+            pieces = static_cast<int>((live + params.max_partition_size - 1) / params.max_partition_size);
+            std::vector<float> piece_centers(static_cast<size_t>(pieces) * graph_dim_);
+            if (!kmeans_cluster(live_data.data(), live, graph_dim_, pieces, 
+                                piece_centers.data(), piece_assignments.data(),
+                                25, false, 0, build_params_.kmeans_seed, faiss_metric())) {
+                pieces = 1;
+                std::fill(piece_assignments.begin(), piece_assignments.end(), 0);
+            } else {
+                // Enforce the size limit on every piece
+                balanced_assign_to_clusters(live_data.data(), live, graph_dim_, piece_centers.data(), pieces,
+                                            params.max_partition_size, piece_assignments.data(),
+                                            8, faiss_metric());
+            }
+        }
+        
+        for (int piece = 0; piece < pieces; piece++) {
+            // The first piece keeps the partition slot, the others become new partitions
+            int target = c;
+            if (piece > 0) {
+                target = num_clusters_++;
+                if (routing_tree_) {
+                    routing_tree_->attach_partition(c, target);
+                }
+                sub_graphs_.emplace_back();
+                partition_indices_.emplace_back();
+                deleted_.emplace_back();
+                deleted_counts_.push_back(0);
+                covering_radii_.push_back(0.0f);
+                centroids.resize(static_cast<size_t>(num_clusters_) * graph_dim_);
+            }
+            
+            std::vector<float> piece_data;
+            std::vector<faiss::idx_t> piece_ids;
+            std::vector<float> centroid(graph_dim_, 0.0f);
+            for (size_t i = 0; i < live; i++) {
+                if (piece_assignments[i] != piece) {
+                    continue;
+                }
+                const float* vec = live_data.data() + i * graph_dim_;
+                piece_data.insert(piece_data.end(), vec, vec + graph_dim_);
+                piece_ids.push_back(live_ids[i]);
+                for (int d = 0; d < graph_dim_; d++) {
+                    centroid[d] += vec[d];
+                }
+            }
+            
+            sub_graphs_[target] = piece_ids.empty() ? nullptr : new_sub_graph();
+            if (sub_graphs_[target]) {
+                sub_graphs_[target]->add(piece_ids.size(), piece_data.data());
+                float* target_centroid = centroids.data() + static_cast<size_t>(target) * graph_dim_;
+                for (int d = 0; d < graph_dim_; d++) {
+                    target_centroid[d] = centroid[d] / piece_ids.size();
+                }
+                // Similarity routing uses spherical centroids
+                if (metric_ != Metric::L2) {
+                    faiss::fvec_renorm_L2(graph_dim_, 1, target_centroid);
+                }
+                covering_radii_[target] = enclosing_radius(target_centroid, piece_data.data(), piece_ids.size(), graph_dim_);
+                centroids_changed = true;
+            } else {
+                covering_radii_[target] = 0.0f;
+            }
+            
+            deleted_[target].assign(piece_ids.size(), 0);
+            deleted_counts_[target] = 0;
+            partition_indices_[target] = std::move(piece_ids);
+            if (sub_graphs_[target] && build_params_.locality_order) {
+                reorder_sub_graph(target);
+            }
+        }
+    }
+    
+    // Re-route over the updated centroids; the meta-HNSW graph is small, so rebuild it
+    if (centroids_changed) {
+        reset_meta_graph();
+        meta_graph_->add(num_clusters_, centroids.data());
+        if (routing_tree_) {
+            routing_tree_->set_partition_centroids(centroids.data(), num_clusters_);
+        }
+    }
+    
+    if (rebuilt > 0) {
+        count_attributes();
+        index_changed();
+    }
+    return rebuilt;
+}
+
+int PyramidGraph::reorder_partitions() {
+    if (partial_ || residency_ || mapped_file_) {
+        std::cerr << "Error: cannot reorder a graph loaded in place, partially or lazily" << std::endl;
+        return 0;
+    }
+    
+    std::vector<int> partitions;
+    for (int c = 0; c < num_clusters_; c++) {
+        if (sub_graphs_[c]) {
+            partitions.push_back(c);
+        }
+    }
+#pragma omp parallel for schedule(dynamic, 1)
+    for (size_t i = 0; i < partitions.size(); i++) {
+        reorder_sub_graph(partitions[i]);
+    }
+    return static_cast<int>(partitions.size());
+}
+
+size_t PyramidGraph::replicate_boundary_vectors(const float* dataset, size_t n, 
+                                                const std::vector<float>& centers,
+                                                const std::vector<int>& primary) {
+    const int r = std::min(max_replicas_, num_clusters_);
+    faiss::IndexFlat center_index(graph_dim_, faiss_metric());
+    center_index.add(num_clusters_, centers.data());
+    
+    // Search the r nearest centers in chunks to bound the temporary buffers
+    const size_t chunk_size = 65536;
+    std::vector<float> distances(std::min(n, chunk_size) * r);
+    std::vector<faiss::idx_t> candidates(std::min(n, chunk_size) * r);
+    std::vector<float> normalized(metric_ == Metric::COSINE ? std::min(n, chunk_size) * graph_dim_ : 0);
+    size_t replicated = 0;
+    
+    for (size_t begin = 0; begin < n; begin += chunk_size) {
+        const size_t count = std::min(chunk_size, n - begin);
+        const float* chunk = dataset + begin * graph_dim_;
+        if (metric_ == Metric::COSINE) {
+            // Similarity ratios are only comparable between unit-length vectors
+            ingest_vectors(chunk, count, normalized.data());
+            chunk = normalized.data();
+        }
+        center_index.search(count, chunk, r, distances.data(), candidates.data());
+        normalize_similarities(count, r, chunk, distances.data());
+        
+        for (size_t i = 0; i < count; i++) {
+            const size_t id = begin + i;
+            for (int j = 1; j < r; j++) {
+                const faiss::idx_t c = candidates[i * r + j];
+                if (c < 0 || c == primary[id] || 
+                    !within_replication_ratio(distances[i * r + j], distances[i * r])) {
+                    continue;
+                }
+                partition_indices_[c].push_back(id);
+                replicated++;
+            }
+        }
+    }
+    
+    return replicated;
+}
+
+bool PyramidGraph::within_replication_ratio(float distance, float nearest_distance) const {
+    // Distances are squared L2 (or converted to it), so the ratio applies squared
+    return routing_distance(distance) <= 
+           replication_ratio_ * replication_ratio_ * routing_distance(nearest_distance);
+}
+
+void PyramidGraph::normalize_similarities(size_t n, int r, const float* vectors, float* similarities) const {
+    if (metric_ != Metric::INNER_PRODUCT) {
+        return;
+    }
+#pragma omp parallel for schedule(static) if (n > 1024)
+    for (size_t i = 0; i < n; i++) {
+        const float norm = std::sqrt(faiss::fvec_norm_L2sqr(vectors + i * graph_dim_, graph_dim_));
+        if (norm > 0.0f) {
+            for (int j = 0; j < r; j++) {
+                similarities[i * r + j] /= norm;
+            }
+        }
+    }
+}
+
+void PyramidGraph::ingest_vectors(const float* src, size_t n, float* dst) const {
+    if (src != dst) {
+        std::copy(src, src + n * graph_dim_, dst);
+    }
+    if (metric_ == Metric::COSINE) {
+        faiss::fvec_renorm_L2(graph_dim_, n, dst);
+    }
+}
+
+void PyramidGraph::project_vectors(const float* src, size_t n, float* dst) const {
+    if (!transform_) {
+        ingest_vectors(src, n, dst);
+        return;
+    }
+    
+    std::vector<float> normalized;
+    if (metric_ == Metric::COSINE) {
+        normalized.assign(src, src + n * dim_);
+        faiss::fvec_renorm_L2(dim_, n, normalized.data());
+        src = normalized.data();
+    }
+    transform_->apply_noalloc(n, src, dst);
+    ingest_vectors(dst, n, dst);
+}
+
+const float* PyramidGraph::prepare_queries(size_t nq, const float* queries, std::vector<float>& normalized,
+                                           std::vector<float>& projected, const float*& graph_queries) const {
+    if (metric_ == Metric::COSINE) {
+        normalized.assign(queries, queries + nq * dim_);
+        faiss::fvec_renorm_L2(dim_, nq, normalized.data());
+        queries = normalized.data();
+    }
+    
+    graph_queries = queries;
+    if (transform_) {
+        projected.resize(nq * graph_dim_);
+        transform_->apply_noalloc(nq, queries, projected.data());
+        ingest_vectors(projected.data(), nq, projected.data());
+        graph_queries = projected.data();
+    }
+    return queries;
+}
+
+void PyramidGraph::reset_meta_graph() {
+    meta_graph_ = std::make_unique<faiss::IndexHNSWFlat>(graph_dim_, m_, faiss_metric());
+    meta_graph_->hnsw.efConstruction = ef_construction_;
+    meta_graph_->hnsw.efSearch = ef_search_;
+}
+
+std::unique_ptr<faiss::IndexHNSW> PyramidGraph::new_sub_graph() const {
+    std::unique_ptr<faiss::IndexHNSW> sub_graph;
+    if (codec_template_) {
+        // Quantized storage: copy the codec trained once for all partitions
+        sub_graph.reset(dynamic_cast<faiss::IndexHNSW*>(faiss::clone_index(codec_template_.get())));
+    } else {
+        sub_graph = std::make_unique<faiss::IndexHNSWFlat>(graph_dim_, m_, faiss_metric());
+    }
+    sub_graph->hnsw.efConstruction = ef_construction_;
+    sub_graph->hnsw.efSearch = ef_search_;
+    return sub_graph;
+}
+
+void PyramidGraph::reorder_sub_graph(int c) {
+    faiss::IndexHNSW& graph = *sub_graphs_[c];
+    const faiss::HNSW& hnsw = graph.hnsw;
+    const size_t n = static_cast<size_t>(graph.ntotal);
+    if (n < 2 || hnsw.entry_point < 0) {
+        return;
+    }
+    
+    // order[new] = old: breadth-first over the base layer, nodes the entry
+    // point does not reach start new traversals in their current order
+    std::vector<faiss::idx_t> order;
+    order.reserve(n);
+    std::vector<uint8_t> visited(n, 0);
+    order.push_back(hnsw.entry_point);
+    visited[hnsw.entry_point] = 1;
+    size_t next_root = 0;
+    for (size_t head = 0; order.size() < n; head++) {
+        if (head == order.size()) {
+            while (visited[next_root]) {
+                next_root++;
+            }
+            order.push_back(next_root);
+            visited[next_root] = 1;
+        }
+        size_t begin, end;
+        hnsw.neighbor_range(order[head], 0, &begin, &end);
+        for (size_t j = begin; j < end; j++) {
+            const faiss::HNSW::storage_idx_t neighbor = hnsw.neighbors[j];
+            if (neighbor < 0) {
+                break;
+            }
+            if (!visited[neighbor]) {
+                visited[neighbor] = 1;
+                order.push_back(neighbor);
+            }
+        }
+    }
+    graph.permute_entries(order.data());
+    
+    std::vector<faiss::idx_t> ids(n);
+    std::vector<uint8_t> deleted(n);
+    for (size_t i = 0; i < n; i++) {
+        ids[i] = partition_indices_[c][order[i]];
+        deleted[i] = deleted_[c][order[i]];
+    }
+    partition_indices_[c] = std::move(ids);
+    deleted_[c] = std::move(deleted);
+}
+
+void PyramidGraph::train_transform(const float* dataset, size_t n) {
+    transform_.reset();
+    graph_dim_ = dim_;
+    if (build_params_.transform == VectorTransform::NONE) {
+        return;
+    }
+    
+    const int out_dim = build_params_.transform_dim > 0 ? build_params_.transform_dim : std::max(1, dim_ / 4);
+    if (out_dim >= dim_) {
+        std::cerr << "Transform dimension " << out_dim << " does not reduce dimension " << dim_ 
+                  << ", keeping the vectors as given" << std::endl;
+        return;
+    }
+    
+    VectorTransform kind = build_params_.transform;
+    if (kind == VectorTransform::OPQ && (build_params_.pq_m <= 0 || out_dim % build_params_.pq_m != 0)) {
+        std::cerr << "OPQ needs a sub-quantizer count dividing the transform dimension (" << out_dim
+                  << " % " << build_params_.pq_m << " != 0), using PCA instead" << std::endl;
+        kind = VectorTransform::PCA;
+    }
+    
+    std::unique_ptr<faiss::LinearTransform> transform;
+    if (kind == VectorTransform::OPQ) {
+        transform = std::make_unique<faiss::OPQMatrix>(dim_, build_params_.pq_m, out_dim);
+    } else {
+        transform = std::make_unique<faiss::PCAMatrix>(dim_, out_dim);
+    }
+    
+    // Train on an evenly strided sample of the dataset, normalized for cosine
+    const size_t sample_size = std::min(n, build_params_.codec_train_size);
+    const size_t step = std::max<size_t>(1, n / std::max<size_t>(1, sample_size));
+    std::vector<float> sample(sample_size * dim_);
+    for (size_t i = 0; i < sample_size; i++) {
+        std::copy(dataset + i * step * dim_, dataset + (i * step + 1) * dim_, sample.data() + i * dim_);
+    }
+    if (metric_ == Metric::COSINE) {
+        faiss::fvec_renorm_L2(dim_, sample_size, sample.data());
+    }
+    transform->train(sample_size, sample.data());
+    
+    // Without the mean shift the projection keeps inner products, not only differences
+    transform->have_bias = false;
+    transform_ = std::move(transform);
+    graph_dim_ = out_dim;
+}
+
+void PyramidGraph::train_codec(const float* dataset, size_t n) {
+    codec_template_.reset();
+    codec_ = build_params_.codec;
+    pq_m_ = build_params_.pq_m;
+    
+    if (codec_ == StorageCodec::PQ && (pq_m_ <= 0 || graph_dim_ % pq_m_ != 0)) {
+        std::cerr << "PQ needs a sub-quantizer count dividing the dimension (" << graph_dim_ 
+                  << " % " << pq_m_ << " != 0), storing flat vectors instead" << std::endl;
+        codec_ = StorageCodec::FLAT;
+    }
+    
+    switch (codec_) {
+        case StorageCodec::FLAT:
+            return;
+        case StorageCodec::SQ8:
+            codec_template_ = std::make_unique<faiss::IndexHNSWSQ>(graph_dim_, faiss::ScalarQuantizer::QT_8bit, m_,
+                                                                   faiss_metric());
+            break;
+        case StorageCodec::FP16:
+            codec_template_ = std::make_unique<faiss::IndexHNSWSQ>(graph_dim_, faiss::ScalarQuantizer::QT_fp16, m_,
+                                                                   faiss_metric());
+            break;
+        case StorageCodec::PQ:
+            codec_template_ = std::make_unique<faiss::IndexHNSWPQ>(graph_dim_, pq_m_, m_, 8, faiss_metric());
+            break;
+    }
+    
+    // Train on an evenly strided sample of the dataset
+    const size_t sample_size = std::min(n, build_params_.codec_train_size);
+    const size_t step = std::max<size_t>(1, n / std::max<size_t>(1, sample_size));
+    std::vector<float> sample(sample_size * graph_dim_);
+    for (size_t i = 0; i < sample_size; i++) {
+        ingest_vectors(dataset + i * step * graph_dim_, 1, sample.data() + i * graph_dim_);
+    }
+    codec_template_->train(sample_size, sample.data());
+}
+
+void PyramidGraph::set_rerank_vectors(const float* vectors, size_t n) {
+    rerank_file_.reset();
+    rerank_vectors_ = VecsView<float>{reinterpret_cast<const uint8_t*>(vectors), n, dim_, dim_ * sizeof(float)};
+    index_changed();
+}
+
+bool PyramidGraph::attach_rerank_vectors(const std::string& path) {
+    auto file = std::make_unique<VecsFile>();
+    if (!file->open(path, VecsFormat::FVECS)) {
+        return false;
+    }
+    if (file->dim() != dim_) {
+        std::cerr << "Error: re-rank vectors in " << path << " have dimension " << file->dim() 
+                  << ", index has " << dim_ << std::endl;
+        return false;
+    }
+    
+    rerank_vectors_ = file->fvecs();
+    rerank_file_ = std::move(file);
+    index_changed();
+    return true;
+}
+
+void PyramidGraph::enable_query_cache(const QueryCacheParams& params) {
+    if (params.max_bytes == 0 || (!params.cache_results && params.routing_quantum <= 0.0f)) {
+        query_cache_.reset();
+    } else {
+        query_cache_ = std::make_unique<QueryCache>(dim_, params);
+    }
+}
+
+QueryCacheStats PyramidGraph::query_cache_stats() const {
+    return query_cache_ ? query_cache_->stats() : QueryCacheStats();
+}
+
+ResidencyStats PyramidGraph::residency_stats() const {
+    return residency_ ? residency_->stats() : ResidencyStats();
+}
+
+size_t PyramidGraph::memory_bytes() const {
+    size_t bytes = graph_bytes(*meta_graph_) + attributes_.size() * sizeof(int32_t);
+    if (transform_) {
+        bytes += (transform_->A.size() + transform_->b.size()) * sizeof(float);
+    }
+    for (int c = 0; c < num_clusters_; c++) {
+        if (sub_graphs_[c]) {
+            bytes += graph_bytes(*sub_graphs_[c]);
+        }
+        bytes += partition_indices_[c].size() * sizeof(faiss::idx_t) + deleted_[c].size();
+    }
+    if (residency_) {
+        bytes += residency_->stats().resident_bytes;
+    }
+    return bytes;
+}
+
+void PyramidGraph::set_attributes(const int32_t* values, size_t n) {
+    attributes_.assign(values, values + n);
+    count_attributes();
+}
+
+size_t PyramidGraph::attribute_count(int c, int32_t value) const {
+    if (attribute_counts_.empty()) {
+        // No attributes were set, so every entry has none
+        return value == -1 ? partition_indices_[c].size() : 0;
+    }
+    const auto it = attribute_counts_[c].find(value);
+    return it != attribute_counts_[c].end() ? it->second : 0;
+}
+
+void PyramidGraph::count_attributes() {
+    attribute_counts_.clear();
+    if (attributes_.empty()) {
+        return;
+    }
+    attribute_counts_.resize(num_clusters_);
+    for (int c = 0; c < num_clusters_; c++) {
+        for (faiss::idx_t id : partition_indices_[c]) {
+            attribute_counts_[c][attribute_of(id)]++;
+        }
+    }
+}
+
+void PyramidGraph::index_changed() {
+    if (query_cache_) {
+        query_cache_->invalidate();
+    }
+}
+
+void PyramidGraph::enable_metrics(bool enable) {
+    if (!enable) {
+        metrics_.reset();
+    } else if (!metrics_) {
+        metrics_ = std::make_unique<SearchMetrics>();
+    }
+}
+
+SearchMetricsSnapshot PyramidGraph::metrics() const {
+    return metrics_ ? metrics_->snapshot() : SearchMetricsSnapshot();
+}
+
+void PyramidGraph::reset_metrics() {
+    if (metrics_) {
+        metrics_->reset();
+    }
+}
+
+int PyramidGraph::partition_candidates(int k, const SearchParams& options) const {
+    if (!approximate_storage() || !rerank_vectors_.base || options.rerank_factor <= 1) {
+        return k;
+    }
+    return k * options.rerank_factor;
+}
+
+void PyramidGraph::rerank(const float* query, size_t n, const faiss::idx_t* ids, float* distances) const {
+    // L2 candidates that all have a row are scored in one gather that
+    // prefetches each scattered row while the previous one is computed
+    const bool gather = metric_ == Metric::L2 && rerank_vectors_.base &&
+                        rerank_vectors_.stride % sizeof(float) == 0 &&
+                        std::all_of(ids, ids + n, [this](faiss::idx_t id) {
+                            return id < 0 || static_cast<size_t>(id) < rerank_vectors_.n;
+                        });
+    if (gather) {
+        euclidean_distance_by_ids(query, rerank_vectors_.row(0), rerank_vectors_.stride / sizeof(float), dim_,
+                                  ids, n, distances);
+        return;
+    }
+    
+    for (size_t i = 0; i < n; i++) {
+        const float* row = rerank_row(ids[i]);
+        if (row) {
+            distances[i] = exact_distance(query, row, dim_);
+        }
+    }
+}
+
+float PyramidGraph::exact_distance(const float* query, const float* vec, int dim) const {
+    switch (metric_) {
+        case Metric::INNER_PRODUCT:
+            return inner_product(query, vec, dim);
+        case Metric::COSINE: {
+            // The query is normalized, raw re-rank vectors are not
+            const float norm = std::sqrt(inner_product(vec, vec, dim));
+            return norm > 0.0f ? inner_product(query, vec, dim) / norm : 0.0f;
+        }
+        case Metric::L2:
+        default:
+            return euclidean_distance(query, vec, dim);
+    }
+}
+
+std::shared_ptr<const faiss::IndexHNSW> PyramidGraph::partition_graph(int c) const {
+    if (residency_) {
+        return residency_->acquire(c);
+    }
+    // Non-owning: the graph lives in sub_graphs_
+    return std::shared_ptr<const faiss::IndexHNSW>(std::shared_ptr<void>(), sub_graphs_[c].get());
+}
+
+void PyramidGraph::reconstruct_vector(const faiss::IndexHNSW& graph, int c, size_t local, float* out) const {
+    const float* row = codec_ != StorageCodec::FLAT ? rerank_row(partition_indices_[c][local]) : nullptr;
+    if (row) {
+        project_vectors(row, 1, out);
+    } else {
+        graph.reconstruct(local, out);
+    }
+}
+
+std::vector<int> PyramidGraph::partition_data(const float* dataset, size_t n, 
+                                              std::vector<float>& centroids) {
+    std::vector<int> assignments(n);
+    centroids.assign(static_cast<size_t>(num_clusters_) * graph_dim_, 0.0f);
+    
+    // Perform k-means clustering on a sample
+    // Similarity metrics use spherical k-means; cosine normalizes the training sample
+    bool success = kmeans_cluster(dataset, n, graph_dim_, num_clusters_, 
+                               centroids.data(), assignments.data(), 25, false,
+                               build_params_.kmeans_sample_size, build_params_.kmeans_seed,
+                               faiss_metric(), metric_ == Metric::COSINE);
+    
+    if (!success) {
+        std::cerr << "K-means clustering failed!" << std::endl;
+        // Fall back to simple assignment if k-means fails
+        for (size_t i = 0; i < n; i++) {
+            assignments[i] = i % num_clusters_;
+        }
+    } else if (build_params_.balanced) {
+        // Re-assign under a capacity so that no partition outgrows the others
+        const double ratio = std::max(1.0f, build_params_.max_partition_ratio);
+        const size_t capacity = static_cast<size_t>(std::ceil(ratio * n / num_clusters_));
+        balanced_assign_to_clusters(dataset, n, graph_dim_, centroids.data(), num_clusters_, 
+                                    capacity, assignments.data(), 8, faiss_metric());
+    }
+    
+    // Trained centroids only match nearest-centroid assignments
+    if (!success || build_params_.balanced) {
+        centroids.clear();
+    }
+    
+    return assignments;
+}
+
+std::vector<int> PyramidGraph::partition_hierarchical(const float* dataset, size_t n,
+                                                      std::vector<float>& centroids) {
+    std::vector<int> sizes = build_params_.routing_levels;
+    sizes.push_back(num_clusters_);
+    for (size_t l = 0; l < sizes.size(); l++) {
+        if (sizes[l] <= 0 || (l > 0 && sizes[l] <= sizes[l - 1])) {
+            std::cerr << "Warning: routing levels must increase towards " << num_clusters_ 
+                      << " partitions; building two levels" << std::endl;
+            return partition_data(dataset, n, centroids);
+        }
+    }
+    if (n < static_cast<size_t>(num_clusters_)) {
+        return partition_data(dataset, n, centroids);
+    }
+    const bool cosine = metric_ == Metric::COSINE;
+    
+    // Top level: k-means over a sample of the dataset with a small k
+    std::vector<int> node_of(n);
+    std::vector<float> level_centroids(static_cast<size_t>(sizes[0]) * graph_dim_);
+    if (!kmeans_cluster(dataset, n, graph_dim_, sizes[0], level_centroids.data(), node_of.data(), 25, false,
+                        build_params_.kmeans_sample_size, build_params_.kmeans_seed, faiss_metric(), cosine)) {
+        std::cerr << "K-means clustering failed!" << std::endl;
+        return partition_data(dataset, n, centroids);
+    }
+    auto tree = std::make_unique<RoutingTree>(graph_dim_, faiss_metric());
+    
+    for (size_t l = 1; l < sizes.size(); l++) {
+        const int parents = sizes[l - 1];
+        const bool partitions = l + 1 == sizes.size();
+        
+        std::vector<std::vector<size_t>> members(parents);
+        for (size_t i = 0; i < n; i++) {
+            members[node_of[i]].push_back(i);
+        }
+        std::vector<size_t> member_counts(parents);
+        for (int g = 0; g < parents; g++) {
+            member_counts[g] = members[g].size();
+        }
+        const std::vector<int> shares = split_children(member_counts, sizes[l]);
+        
+        std::vector<size_t> child_offsets(parents + 1, 0);
+        for (int g = 0; g < parents; g++) {
+            child_offsets[g + 1] = child_offsets[g] + shares[g];
+        }
+        std::vector<float> child_centroids(child_offsets[parents] * graph_dim_, 0.0f);
+        
+        // Each node clusters only its own points into its share of the children
+        for (int g = 0; g < parents; g++) {
+            if (shares[g] == 0) {
+                continue;
+            }
+            const size_t count = members[g].size();
+            std::vector<float> points(count * graph_dim_);
+            for (size_t i = 0; i < count; i++) {
+                std::copy(dataset + members[g][i] * graph_dim_, dataset + (members[g][i] + 1) * graph_dim_, 
+                          points.data() + i * graph_dim_);
+            }
+            
+            float* centers = child_centroids.data() + child_offsets[g] * graph_dim_;
+            std::vector<int> local(count, 0);
+            bool centers_valid = shares[g] > 1 &&
+                                 kmeans_cluster(points.data(), count, graph_dim_, shares[g], centers, local.data(),
+                                                25, false, 0, build_params_.kmeans_seed + g, faiss_metric(), cosine);
+            if (shares[g] > 1 && !centers_valid) {
+                for (size_t i = 0; i < count; i++) {
+                    local[i] = static_cast<int>(i % shares[g]);
+                }
+            } else if (centers_valid && partitions && build_params_.balanced) {
+                // Cap partition sizes within this node
+                const double ratio = std::max(1.0f, build_params_.max_partition_ratio);
+                const size_t capacity = static_cast<size_t>(std::ceil(ratio * count / shares[g]));
+                balanced_assign_to_clusters(points.data(), count, graph_dim_, centers, shares[g], 
+                                            capacity, local.data(), 8, faiss_metric());
+                centers_valid = false;
+            }
+            if (!centers_valid) {
+                compute_cluster_means(points.data(), count, graph_dim_, local.data(), shares[g], centers,
+                                      metric_ != Metric::L2);
+            }
+            
+            for (size_t i = 0; i < count; i++) {
+                node_of[members[g][i]] = static_cast<int>(child_offsets[g]) + local[i];
+            }
+        }
+        
+        // Children of a node are numbered contiguously
+        std::vector<int> child_ids(child_offsets[parents]);
+        for (size_t j = 0; j < child_ids.size(); j++) {
+            child_ids[j] = static_cast<int>(j);
+        }
+        tree->add_level(std::move(level_centroids), std::move(child_offsets), std::move(child_ids));
+        level_centroids = std::move(child_centroids);
+    }
+    
+    routing_tree_ = std::move(tree);
+    centroids = std::move(level_centroids);
+    return node_of;
+}
+
+void PyramidGraph::route_partitions(size_t nq, const float* queries, int nprobe, int beam,
+                                    float* distances, faiss::idx_t* ids, const uint8_t* allowed) const {
+    // The meta-HNSW restricted to the allowed partitions
+    faiss::SearchParametersHNSW routing_params;
+    AllowedSelector routing_filter;
+    const faiss::SearchParameters* routing = nullptr;
+    if (allowed) {
+        routing_filter.allowed = allowed;
+        routing_params.sel = &routing_filter;
+        routing_params.efSearch = std::max(meta_graph_->hnsw.efSearch, nprobe);
+        routing = &routing_params;
+    }
+    if (!routing_tree_) {
+        meta_graph_->search(nq, queries, nprobe, distances, ids, routing);
+        return;
+    }
+    
+    beam = effective_routing_beam(beam, nprobe);
+#pragma omp parallel for schedule(static) if (nq > 1)
+    for (size_t q = 0; q < nq; q++) {
+        const float* query = queries + q * graph_dim_;
+        routing_tree_->route(query, nprobe, beam, distances + q * nprobe, ids + q * nprobe, allowed);
+        // The beam may have kept nodes that own no allowed partition
+        if (allowed && ids[q * nprobe + nprobe - 1] < 0) {
+            meta_graph_->search(1, query, nprobe, distances + q * nprobe, ids + q * nprobe, routing);
+        }
+    }
+}
+
+std::vector<float> PyramidGraph::extract_cluster_centers(const float* dataset, size_t n, 
+                                                      const std::vector<int>& cluster_assign) {
+    std::vector<float> centers(static_cast<size_t>(num_clusters_) * graph_dim_, 0.0f);
+    compute_cluster_means(dataset, n, graph_dim_, cluster_assign.data(), num_clusters_, centers.data(),
+                          metric_ != Metric::L2);
     return centers;
 }
 
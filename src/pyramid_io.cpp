@@ -0,0 +1,446 @@
+#include "../include/pyramid.h"
+#include "../include/mapped_file.h"
+#include <faiss/index_io.h>
+#include <faiss/impl/io.h>
+#include <faiss/impl/zerocopy_io.h>
+#include <fstream>
+#include <iostream>
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+#include <algorithm>
+#include <stdexcept>
+
+namespace pyramid {
+
+namespace {
+
+// File layout (all integers little-endian):
+//   FileHeader
+//   SectionEntry[num_clusters + 1]   entry 0 is the meta-HNSW graph
+//   partition id maps, tombstones and serialized FAISS indexes, each aligned to kAlignment
+const char kFileMagic[8] = {'P', 'Y', 'R', 'A', 'M', 'I', 'D', '\0'};
+const uint32_t kFormatVersion = 9;
+const uint64_t kAlignment = 64;
+
+struct FileHeader {
+    char magic[8];
+    uint32_t version;
+    int32_t dim;
+    int32_t num_clusters;
+    int32_t m;
+    int32_t ef_construction;
+    int32_t ef_search;
+    uint64_t total_vectors;
+    int64_t next_id;
+    int32_t codec;           // StorageCodec of the sub-HNSW graphs
+    int32_t pq_m;
+    uint64_t codec_offset;   // Offset of the empty, trained codec template graph
+    uint64_t codec_size;     // Size of the template in bytes (0: flat storage)
+    int32_t max_replicas;    // Boundary replication settings
+    float replication_ratio;
+    int32_t metric;          // Metric of the index
+    uint64_t attributes_offset;  // Offset of the int32 attribute value of each global id
+    uint64_t attributes_count;   // Number of attribute values (0: none set)
+    uint64_t routing_offset;     // Offset of the serialized routing tree levels
+    uint64_t routing_size;       // Size of the routing tree in bytes (0: meta-HNSW routing)
+    uint64_t transform_offset;   // Offset of the serialized FAISS transform into the graph space
+    uint64_t transform_size;     // Size of the transform in bytes (0: graphs hold the vectors as given)
+};
+
+struct SectionEntry {
+    uint64_t graph_offset;   // Offset of the serialized HNSW graph
+    uint64_t graph_size;     // Size of the serialized graph in bytes (0: empty partition)
+    uint64_t ids_offset;     // Offset of the partition's global id array
+    uint64_t ids_count;      // Number of ids in the partition
+    uint64_t deleted_offset; // Offset of the partition's tombstone flags (ids_count bytes)
+    uint64_t deleted_count;  // Number of tombstoned entries (0: no tombstone array stored)
+    float covering_radius;   // Distance from the partition's centroid to its farthest entry
+    uint32_t reserved;
+};
+
+// Check that count items of item_size bytes at offset lie within the file,
+// without a sum or product that a corrupt header could make wrap around
+bool section_fits(uint64_t offset, uint64_t count, uint64_t item_size, uint64_t file_size) {
+    return offset <= file_size && count <= (file_size - offset) / item_size;
+}
+
+// Pad the stream with zeros up to the next multiple of kAlignment
+uint64_t align_stream(std::ofstream& out) {
+    uint64_t pos = static_cast<uint64_t>(out.tellp());
+    static const char zeros[kAlignment] = {};
+    const uint64_t padding = (kAlignment - pos % kAlignment) % kAlignment;
+    out.write(zeros, padding);
+    return pos + padding;
+}
+
+// Serialize a FAISS index at the current (aligned) position of the stream
+void write_graph(std::ofstream& out, const faiss::Index* index, uint64_t& offset, uint64_t& size) {
+    faiss::VectorIOWriter writer;
+    faiss::write_index(index, &writer);
+    
+    offset = align_stream(out);
+    size = writer.data.size();
+    out.write(reinterpret_cast<const char*>(writer.data.data()), writer.data.size());
+}
+
+// Deserialize an HNSW graph, either as views into the mapping or as a copy
+std::unique_ptr<faiss::IndexHNSW> read_graph(const uint8_t* data, size_t size, bool zero_copy) {
+    std::unique_ptr<faiss::Index> index;
+    
+    if (zero_copy) {
+        faiss::ZeroCopyIOReader reader(data, size);
+        index.reset(faiss::read_index(&reader, faiss::IO_FLAG_MMAP_IFC));
+    } else {
+        faiss::VectorIOReader reader;
+        reader.data.assign(data, data + size);
+        index.reset(faiss::read_index(&reader));
+    }
+    
+    auto* graph = dynamic_cast<faiss::IndexHNSW*>(index.get());
+    if (!graph) {
+        throw std::runtime_error("section does not contain an HNSW index");
+    }
+    index.release();
+    return std::unique_ptr<faiss::IndexHNSW>(graph);
+}
+
+} // namespace
+
+bool PyramidGraph::save(const std::string& path) const {
+    if (partial_ || residency_) {
+        std::cerr << "Error: cannot save a graph loaded partially or lazily" << std::endl;
+        return false;
+    }
+    
+    // Write next to the target and rename it into place: the graphs may be
+    // views into a mapping of the file being replaced
+    const std::string temp_path = path + ".tmp";
+    std::ofstream out(temp_path, std::ios::binary | std::ios::trunc);
+    if (!out) {
+        std::cerr << "Error opening index file for writing: " << temp_path << std::endl;
+        return false;
+    }
+    
+    try {
+        FileHeader header;
+        std::memcpy(header.magic, kFileMagic, sizeof(kFileMagic));
+        header.version = kFormatVersion;
+        header.dim = dim_;
+        header.num_clusters = num_clusters_;
+        header.m = m_;
+        header.ef_construction = ef_construction_;
+        header.ef_search = ef_search_;
+        header.total_vectors = total_vectors_;
+        header.next_id = next_id_;
+        header.codec = static_cast<int32_t>(codec_);
+        header.pq_m = pq_m_;
+        header.codec_offset = 0;
+        header.codec_size = 0;
+        header.max_replicas = max_replicas_;
+        header.replication_ratio = replication_ratio_;
+        header.metric = static_cast<int32_t>(metric_);
+        header.attributes_offset = 0;
+        header.attributes_count = 0;
+        header.routing_offset = 0;
+        header.routing_size = 0;
+        header.transform_offset = 0;
+        header.transform_size = 0;
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        
+        // Reserve the section table, it is filled in once all offsets are known
+        std::vector<SectionEntry> sections(num_clusters_ + 1, SectionEntry{0, 0, 0, 0, 0, 0, 0.0f, 0});
+        const std::streampos table_pos = out.tellp();
+        out.write(reinterpret_cast<const char*>(sections.data()), sections.size() * sizeof(SectionEntry));
+        
+        write_graph(out, meta_graph_.get(), sections[0].graph_offset, sections[0].graph_size);
+        
+        if (codec_template_) {
+            write_graph(out, codec_template_.get(), header.codec_offset, header.codec_size);
+        }
+        
+        if (transform_) {
+            faiss::VectorIOWriter writer;
+            faiss::write_VectorTransform(transform_.get(), &writer);
+            header.transform_offset = align_stream(out);
+            header.transform_size = writer.data.size();
+            out.write(reinterpret_cast<const char*>(writer.data.data()), writer.data.size());
+        }
+        
+        if (!attributes_.empty()) {
+            header.attributes_offset = align_stream(out);
+            header.attributes_count = attributes_.size();
+            out.write(reinterpret_cast<const char*>(attributes_.data()), attributes_.size() * sizeof(int32_t));
+        }
+        
+        if (routing_tree_) {
+            std::vector<uint8_t> levels;
+            routing_tree_->serialize(levels);
+            header.routing_offset = align_stream(out);
+            header.routing_size = levels.size();
+            out.write(reinterpret_cast<const char*>(levels.data()), levels.size());
+        }
+        
+        for (int c = 0; c < num_clusters_; c++) {
+            SectionEntry& entry = sections[c + 1];
+            const std::vector<faiss::idx_t>& ids = partition_indices_[c];
+            
+            entry.covering_radius = covering_radii_[c];
+            entry.ids_offset = align_stream(out);
+            entry.ids_count = ids.size();
+            out.write(reinterpret_cast<const char*>(ids.data()), ids.size() * sizeof(faiss::idx_t));
+            
+            if (deleted_counts_[c] > 0) {
+                entry.deleted_offset = align_stream(out);
+                entry.deleted_count = deleted_counts_[c];
+                out.write(reinterpret_cast<const char*>(deleted_[c].data()), deleted_[c].size());
+            }
+            
+            if (sub_graphs_[c]) {
+                write_graph(out, sub_graphs_[c].get(), entry.graph_offset, entry.graph_size);
+            }
+        }
+        
+        // Rewrite the header and section table now that all offsets are known
+        out.seekp(0);
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        out.seekp(table_pos);
+        out.write(reinterpret_cast<const char*>(sections.data()), sections.size() * sizeof(SectionEntry));
+    } catch (const std::exception& e) {
+        std::cerr << "Error while saving index: " << e.what() << std::endl;
+        out.close();
+        std::remove(temp_path.c_str());
+        return false;
+    }
+    
+    out.close();
+    if (!out) {
+        std::cerr << "Error writing index file: " << temp_path << std::endl;
+        std::remove(temp_path.c_str());
+        return false;
+    }
+    if (std::rename(temp_path.c_str(), path.c_str()) != 0) {
+        std::cerr << "Error replacing index file: " << path << " (" << std::strerror(errno) << ")" << std::endl;
+        std::remove(temp_path.c_str());
+        return false;
+    }
+    
+    return true;
+}
+
+bool PyramidGraph::own_sub_graph(int c) {
+    const faiss::IndexHNSW* graph = sub_graphs_[c].get();
+    if (!graph || graph->hnsw.neighbors.is_owned) {
+        return true;
+    }
+    
+    try {
+        faiss::VectorIOWriter writer;
+        faiss::write_index(graph, &writer);
+        sub_graphs_[c] = read_graph(writer.data.data(), writer.data.size(), false);
+    } catch (const std::exception& e) {
+        std::cerr << "Error copying partition " << c << " out of the mapping: " << e.what() << std::endl;
+        return false;
+    }
+    return true;
+}
+
+std::unique_ptr<PyramidGraph> PyramidGraph::load(const std::string& path, bool use_mmap,
+                                                 const std::vector<int>* partitions) {
+    LoadOptions options;
+    options.use_mmap = use_mmap;
+    options.partitions = partitions;
+    return load(path, options);
+}
+
+std::unique_ptr<PyramidGraph> PyramidGraph::load(const std::string& path, const LoadOptions& options) {
+    // An arena is read once and then used in place just like a mapping
+    const bool arena = options.arena && !options.lazy;
+    const bool use_mmap = options.use_mmap || arena;
+    const std::vector<int>* partitions = options.partitions;
+    auto file = std::make_unique<MappedFile>();
+    if (arena ? !file->load(path, options.huge_pages) : !file->open(path, use_mmap)) {
+        return nullptr;
+    }
+    
+    FileHeader header;
+    if (file->size() < sizeof(header)) {
+        std::cerr << "Error: index file is truncated: " << path << std::endl;
+        return nullptr;
+    }
+    std::memcpy(&header, file->data(), sizeof(header));
+    
+    if (std::memcmp(header.magic, kFileMagic, sizeof(kFileMagic)) != 0) {
+        std::cerr << "Error: not a pyramid index file: " << path << std::endl;
+        return nullptr;
+    }
+    if (header.version != kFormatVersion) {
+        std::cerr << "Error: unsupported index format version " << header.version 
+                  << " (expected " << kFormatVersion << ")" << std::endl;
+        return nullptr;
+    }
+    
+    const size_t table_size = (static_cast<size_t>(header.num_clusters) + 1) * sizeof(SectionEntry);
+    if (header.num_clusters <= 0 || file->size() < sizeof(header) + table_size) {
+        std::cerr << "Error: index file is truncated: " << path << std::endl;
+        return nullptr;
+    }
+    std::vector<SectionEntry> sections(header.num_clusters + 1);
+    std::memcpy(sections.data(), file->data() + sizeof(header), table_size);
+    
+    for (const SectionEntry& entry : sections) {
+        if (!section_fits(entry.graph_offset, entry.graph_size, 1, file->size()) ||
+            !section_fits(entry.ids_offset, entry.ids_count, sizeof(faiss::idx_t), file->size()) ||
+            (entry.deleted_count > 0 && !section_fits(entry.deleted_offset, entry.ids_count, 1, file->size()))) {
+            std::cerr << "Error: index file section out of bounds: " << path << std::endl;
+            return nullptr;
+        }
+    }
+    
+    if (header.metric < static_cast<int32_t>(Metric::L2) || header.metric > static_cast<int32_t>(Metric::COSINE)) {
+        std::cerr << "Error: unknown metric " << header.metric << " in " << path << std::endl;
+        return nullptr;
+    }
+    
+    auto graph = std::make_unique<PyramidGraph>(header.dim, header.num_clusters, header.m,
+                                                header.ef_construction, header.ef_search,
+                                                static_cast<Metric>(header.metric));
+    graph->total_vectors_ = header.total_vectors;
+    graph->next_id_ = header.next_id;
+    graph->codec_ = static_cast<StorageCodec>(header.codec);
+    graph->pq_m_ = header.pq_m;
+    graph->max_replicas_ = header.max_replicas;
+    graph->replication_ratio_ = header.replication_ratio;
+    
+    // Partitions to materialize; a shard leaves the others empty
+    std::vector<uint8_t> selected(header.num_clusters, partitions ? 0 : 1);
+    if (partitions) {
+        for (int c : *partitions) {
+            if (c < 0 || c >= header.num_clusters) {
+                std::cerr << "Error: partition " << c << " out of range in " << path << std::endl;
+                return nullptr;
+            }
+            selected[c] = 1;
+        }
+        graph->partial_ = std::count(selected.begin(), selected.end(), 1) < header.num_clusters;
+    }
+    
+    if (!section_fits(header.codec_offset, header.codec_size, 1, file->size()) ||
+        !section_fits(header.attributes_offset, header.attributes_count, sizeof(int32_t), file->size()) ||
+        !section_fits(header.routing_offset, header.routing_size, 1, file->size()) ||
+        !section_fits(header.transform_offset, header.transform_size, 1, file->size())) {
+        std::cerr << "Error: index file section out of bounds: " << path << std::endl;
+        return nullptr;
+    }
+    
+    if (header.attributes_count > 0) {
+        const int32_t* values = reinterpret_cast<const int32_t*>(file->data() + header.attributes_offset);
+        graph->attributes_.assign(values, values + header.attributes_count);
+    }
+    
+    try {
+        if (header.transform_size > 0) {
+            faiss::VectorIOReader reader;
+            reader.data.assign(file->data() + header.transform_offset, 
+                               file->data() + header.transform_offset + header.transform_size);
+            std::unique_ptr<faiss::VectorTransform> transform(faiss::read_VectorTransform(&reader));
+            auto* linear = dynamic_cast<faiss::LinearTransform*>(transform.get());
+            if (!linear || linear->d_in != header.dim) {
+                throw std::runtime_error("transform does not map the index dimension");
+            }
+            transform.release();
+            graph->transform_.reset(linear);
+            graph->graph_dim_ = linear->d_out;
+        }
+        
+        std::unique_ptr<faiss::IndexHNSW> meta_graph = read_graph(file->data() + sections[0].graph_offset, 
+                                                                  sections[0].graph_size, use_mmap);
+        graph->meta_graph_.reset(dynamic_cast<faiss::IndexHNSWFlat*>(meta_graph.get()));
+        if (!graph->meta_graph_) {
+            throw std::runtime_error("meta graph is not an IndexHNSWFlat");
+        }
+        meta_graph.release();
+        if (graph->meta_graph_->d != graph->graph_dim_) {
+            throw std::runtime_error("meta graph dimension does not match the transform");
+        }
+        
+        if (header.codec_size > 0) {
+            // The template is tiny and gets cloned, so it is always copied
+            graph->codec_template_ = read_graph(file->data() + header.codec_offset, 
+                                                header.codec_size, false);
+        }
+        
+        if (header.routing_size > 0) {
+            auto tree = std::make_unique<RoutingTree>(graph->graph_dim_, graph->faiss_metric());
+            if (!tree->deserialize(file->data() + header.routing_offset, header.routing_size,
+                                   header.num_clusters)) {
+                throw std::runtime_error("malformed routing tree");
+            }
+            // The partition centroids are the meta-HNSW's vectors
+            std::vector<float> centroids(static_cast<size_t>(header.num_clusters) * graph->graph_dim_);
+            graph->meta_graph_->reconstruct_n(0, header.num_clusters, centroids.data());
+            tree->set_partition_centroids(centroids.data(), header.num_clusters);
+            graph->routing_tree_ = std::move(tree);
+        }
+        
+        for (int c = 0; c < header.num_clusters; c++) {
+            graph->covering_radii_[c] = sections[c + 1].covering_radius;
+            if (!selected[c]) {
+                continue;
+            }
+            const SectionEntry& entry = sections[c + 1];
+            const faiss::idx_t* ids = reinterpret_cast<const faiss::idx_t*>(file->data() + entry.ids_offset);
+            graph->partition_indices_[c].assign(ids, ids + entry.ids_count);
+            
+            if (entry.deleted_count > 0) {
+                const uint8_t* flags = file->data() + entry.deleted_offset;
+                graph->deleted_[c].assign(flags, flags + entry.ids_count);
+            } else {
+                graph->deleted_[c].assign(entry.ids_count, 0);
+            }
+            graph->deleted_counts_[c] = entry.deleted_count;
+            
+            if (entry.graph_size > 0 && !options.lazy) {
+                graph->sub_graphs_[c] = read_graph(file->data() + entry.graph_offset, 
+                                                   entry.graph_size, use_mmap);
+            }
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Error while loading index: " << e.what() << std::endl;
+        return nullptr;
+    }
+    
+    if (options.lazy) {
+        // Sub-graphs are read from the mapping on demand; evicting one also
+        // drops its file pages so the budget bounds the resident set
+        std::vector<uint64_t> offsets(header.num_clusters);
+        std::vector<size_t> sizes(header.num_clusters, 0);
+        for (int c = 0; c < header.num_clusters; c++) {
+            offsets[c] = sections[c + 1].graph_offset;
+            if (selected[c]) {
+                sizes[c] = sections[c + 1].graph_size;
+            }
+        }
+        
+        const MappedFile* mapping = file.get();
+        auto loader = [mapping, offsets, sizes, use_mmap](int c) {
+            return std::shared_ptr<faiss::IndexHNSW>(read_graph(mapping->data() + offsets[c], sizes[c], use_mmap));
+        };
+        auto releaser = [mapping, offsets, sizes](int c) {
+            mapping->release(offsets[c], sizes[c]);
+        };
+        graph->residency_ = std::make_unique<PartitionResidency>(sizes, options.residency_budget,
+                                                                 std::move(loader), std::move(releaser));
+    }
+    
+    graph->count_attributes();
+    
+    // Graphs loaded as views keep pointing into the mapping
+    if (use_mmap || options.lazy) {
+        graph->mapped_file_ = std::move(file);
+    }
+    
+    return graph;
+}
+
+} // namespace pyramid
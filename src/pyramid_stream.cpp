@@ -0,0 +1,370 @@
+#include "../include/pyramid.h"
+#include "../include/partition.h"
+#include "../include/dataset.h"
+#include <faiss/IndexFlat.h>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <algorithm>
+
+namespace pyramid {
+
+namespace {
+
+// Milliseconds between two time points
+double elapsed_ms(std::chrono::high_resolution_clock::time_point start,
+                  std::chrono::high_resolution_clock::time_point end) {
+    return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+// Fixed-capacity hand-off between two pipeline stages; push() blocks while
+// the queue is full, pop() while it is empty and open
+template <typename T>
+class BoundedQueue {
+public:
+    explicit BoundedQueue(size_t capacity) : capacity_(capacity) {}
+    
+    // False (and the item dropped) once the queue is closed
+    bool push(T item) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        not_full_.wait(lock, [this] { return items_.size() < capacity_ || closed_; });
+        if (closed_) {
+            return false;
+        }
+        items_.push_back(std::move(item));
+        not_empty_.notify_one();
+        return true;
+    }
+    
+    // False once the queue is closed and drained
+    bool pop(T& item) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        not_empty_.wait(lock, [this] { return !items_.empty() || closed_; });
+        if (items_.empty()) {
+            return false;
+        }
+        item = std::move(items_.front());
+        items_.pop_front();
+        not_full_.notify_one();
+        return true;
+    }
+    
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        closed_ = true;
+        not_full_.notify_all();
+        not_empty_.notify_all();
+    }
+
+private:
+    size_t capacity_;
+    bool closed_ = false;
+    std::deque<T> items_;
+    std::mutex mutex_;
+    std::condition_variable not_full_;
+    std::condition_variable not_empty_;
+};
+
+// Consecutive rows of the base file, converted to float
+struct RawChunk {
+    size_t begin = 0;
+    std::vector<float> rows;
+};
+
+// Graph-space vectors of one chunk, grouped by destination partition
+using SpillBatch = std::vector<std::vector<float>>;
+
+// Reader and writer threads of the streaming pipeline; the queues are closed
+// and both threads joined on every exit path, so an exception on the
+// assigning thread never destroys a joinable thread
+struct PipelineThreads {
+    BoundedQueue<RawChunk>& chunks;
+    BoundedQueue<SpillBatch>& spills;
+    std::thread reader;
+    std::thread writer;
+    
+    PipelineThreads(BoundedQueue<RawChunk>& chunks, BoundedQueue<SpillBatch>& spills)
+        : chunks(chunks), spills(spills) {}
+    
+    ~PipelineThreads() {
+        join();
+    }
+    
+    // The writer drains what was queued before its queue closed
+    void join() {
+        chunks.close();
+        if (reader.joinable()) {
+            reader.join();
+        }
+        spills.close();
+        if (writer.joinable()) {
+            writer.join();
+        }
+    }
+};
+
+// Spill directory that is removed with its content on every exit path
+struct SpillDirectory {
+    std::filesystem::path path;
+    
+    ~SpillDirectory() {
+        std::error_code ec;
+        std::filesystem::remove_all(path, ec);
+    }
+    
+    std::filesystem::path partition(int c) const {
+        return path / (std::to_string(c) + ".bin");
+    }
+};
+
+} // namespace
+
+bool PyramidGraph::build_from_file(const std::string& path) {
+    using Clock = std::chrono::high_resolution_clock;
+    const auto build_start = Clock::now();
+    
+    // A corrupt row header would otherwise be streamed as vectors into every partition
+    VecsFile file;
+    if (!file.open(path) || !file.validate()) {
+        return false;
+    }
+    if (file.format() == VecsFormat::IVECS || file.dim() != dim_) {
+        std::cerr << "Error: " << path << " does not hold " << dim_ << "-dimensional base vectors" << std::endl;
+        return false;
+    }
+    const size_t n = file.num_vectors();
+    if (n < static_cast<size_t>(configured_clusters_)) {
+        std::cerr << "Error: " << path << " holds fewer vectors than partitions" << std::endl;
+        return false;
+    }
+    
+    SpillDirectory spill;
+    std::error_code ec;
+    const std::filesystem::path spill_root = build_params_.spill_directory.empty() ?
+                                             std::filesystem::temp_directory_path(ec) :
+                                             std::filesystem::path(build_params_.spill_directory);
+    spill.path = spill_root / ("pyramid-spill-" + std::to_string(Clock::now().time_since_epoch().count()));
+    if (ec || !std::filesystem::create_directories(spill.path, ec)) {
+        std::cerr << "Error creating spill directory " << spill.path << std::endl;
+        return false;
+    }
+    
+    build_stats_ = BuildStats();
+    index_changed();
+    routing_tree_.reset();
+    reset_partitions();
+    
+    // Everything trained is trained on one sample: k-means, the transform and the codec
+    auto phase_start = Clock::now();
+    const size_t kmeans_rows = build_params_.kmeans_sample_size > 0 ?
+                               build_params_.kmeans_sample_size : 256 * static_cast<size_t>(num_clusters_);
+    const std::vector<size_t> rows = sample_rows(n, std::max(kmeans_rows, build_params_.codec_train_size),
+                                                 build_params_.kmeans_seed);
+    std::vector<float> sample(rows.size() * dim_);
+#pragma omp parallel for schedule(static)
+    for (size_t i = 0; i < rows.size(); i++) {
+        file.read_rows(rows[i], rows[i] + 1, sample.data() + i * dim_);
+    }
+    train_transform(sample.data(), rows.size());
+    std::vector<float> projected(rows.size() * graph_dim_);
+    project_vectors(sample.data(), rows.size(), projected.data());
+    sample = std::vector<float>();
+    reset_meta_graph();
+    
+    std::vector<float> centers;
+    std::vector<int> sample_assignments = build_params_.routing_levels.empty() ?
+                                          partition_data(projected.data(), rows.size(), centers) :
+                                          partition_hierarchical(projected.data(), rows.size(), centers);
+    build_stats_.kmeans_ms = elapsed_ms(phase_start, Clock::now());
+    
+    phase_start = Clock::now();
+    if (centers.empty()) {
+        centers = extract_cluster_centers(projected.data(), rows.size(), sample_assignments);
+    }
+    meta_graph_->add(num_clusters_, centers.data());
+    if (routing_tree_) {
+        routing_tree_->set_partition_centroids(centers.data(), num_clusters_);
+    }
+    build_stats_.centroid_ms = elapsed_ms(phase_start, Clock::now());
+    
+    max_replicas_ = std::max(1, build_params_.max_replicas);
+    replication_ratio_ = build_params_.replication_ratio;
+    train_codec(projected.data(), rows.size());
+    projected = std::vector<float>();
+    
+    // Stream the file: read chunk i + 1, assign chunk i and spill chunk i - 1 concurrently
+    phase_start = Clock::now();
+    const size_t chunk_size = std::max<size_t>(1, build_params_.stream_chunk_size);
+    BoundedQueue<RawChunk> chunks(2);
+    BoundedQueue<SpillBatch> spills(2);
+    std::atomic<bool> read_failed(false);
+    std::atomic<bool> spill_failed(false);
+    std::atomic<bool> assign_failed(false);
+    PipelineThreads pipeline(chunks, spills);
+    
+    // Errors end the stage and close its queue, so that no other stage blocks on it
+    pipeline.reader = std::thread([&] {
+        try {
+            for (size_t begin = 0; begin < n; begin += chunk_size) {
+                RawChunk chunk;
+                chunk.begin = begin;
+                chunk.rows.resize(std::min(chunk_size, n - begin) * dim_);
+                file.read_rows(begin, std::min(n, begin + chunk_size), chunk.rows.data());
+                if (!chunks.push(std::move(chunk))) {
+                    return;
+                }
+            }
+        } catch (const std::exception& e) {
+            std::cerr << "Error reading " << path << ": " << e.what() << std::endl;
+            read_failed = true;
+        }
+        chunks.close();
+    });
+    
+    // Buffer small appends and flush them all once a few chunks have accumulated
+    pipeline.writer = std::thread([&] {
+        try {
+            SpillBatch pending(num_clusters_);
+            size_t pending_floats = 0;
+            const size_t flush_floats = 4 * chunk_size * graph_dim_;
+            auto flush = [&] {
+                for (int c = 0; c < num_clusters_; c++) {
+                    if (pending[c].empty()) {
+                        continue;
+                    }
+                    if (!spill_failed) {
+                        std::ofstream out(spill.partition(c), std::ios::binary | std::ios::app);
+                        out.write(reinterpret_cast<const char*>(pending[c].data()), pending[c].size() * sizeof(float));
+                        if (!out) {
+                            spill_failed = true;
+                        }
+                    }
+                    pending[c] = std::vector<float>();
+                }
+                pending_floats = 0;
+            };
+            
+            SpillBatch batch;
+            while (spills.pop(batch)) {
+                for (int c = 0; c < num_clusters_; c++) {
+                    pending[c].insert(pending[c].end(), batch[c].begin(), batch[c].end());
+                    pending_floats += batch[c].size();
+                }
+                if (pending_floats >= flush_floats) {
+                    flush();
+                }
+            }
+            flush();
+        } catch (const std::exception& e) {
+            std::cerr << "Error spilling partitions: " << e.what() << std::endl;
+            spill_failed = true;
+            spills.close();
+        }
+    });
+    
+    // The assigning thread runs on the caller; a failure here still ends both other stages
+    try {
+        faiss::IndexFlat center_index(graph_dim_, faiss_metric());
+        center_index.add(num_clusters_, centers.data());
+        const int r = std::min(max_replicas_, num_clusters_);
+        const double ratio = std::max(1.0f, build_params_.max_partition_ratio);
+        std::vector<float> chunk_vectors(chunk_size * graph_dim_);
+        std::vector<float> distances(chunk_size * r);
+        std::vector<faiss::idx_t> candidates(chunk_size * r);
+        std::vector<int> primary(chunk_size);
+        
+        RawChunk chunk;
+        while (!spill_failed && chunks.pop(chunk)) {
+            const size_t count = chunk.rows.size() / dim_;
+            project_vectors(chunk.rows.data(), count, chunk_vectors.data());
+            center_index.search(count, chunk_vectors.data(), r, distances.data(), candidates.data());
+            normalize_similarities(count, r, chunk_vectors.data(), distances.data());
+            for (size_t i = 0; i < count; i++) {
+                primary[i] = static_cast<int>(candidates[i * r]);
+            }
+            if (build_params_.balanced && count >= static_cast<size_t>(num_clusters_)) {
+                // Capacities apply per chunk, which bounds the partitions of the whole file alike
+                const size_t capacity = static_cast<size_t>(std::ceil(ratio * count / num_clusters_));
+                balanced_assign_to_clusters(chunk_vectors.data(), count, graph_dim_, centers.data(), num_clusters_,
+                                            capacity, primary.data(), 8, faiss_metric());
+            }
+            
+            // Entries join partition_indices_ in the order they are spilled
+            SpillBatch batch(num_clusters_);
+            for (size_t i = 0; i < count; i++) {
+                const float* vector = chunk_vectors.data() + i * graph_dim_;
+                partition_indices_[primary[i]].push_back(chunk.begin + i);
+                batch[primary[i]].insert(batch[primary[i]].end(), vector, vector + graph_dim_);
+                for (int j = 1; j < r; j++) {
+                    const faiss::idx_t c = candidates[i * r + j];
+                    if (c < 0 || c == primary[i] ||
+                        !within_replication_ratio(distances[i * r + j], distances[i * r])) {
+                        continue;
+                    }
+                    partition_indices_[c].push_back(chunk.begin + i);
+                    batch[c].insert(batch[c].end(), vector, vector + graph_dim_);
+                    build_stats_.replicated_entries++;
+                }
+            }
+            spills.push(std::move(batch));
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Error assigning " << path << ": " << e.what() << std::endl;
+        assign_failed = true;
+    }
+    
+    pipeline.join();
+    build_stats_.stream_ms = elapsed_ms(phase_start, Clock::now());
+    for (int c = 0; c < num_clusters_; c++) {
+        deleted_[c].assign(partition_indices_[c].size(), 0);
+        deleted_counts_[c] = 0;
+    }
+    
+    // Build every sub-HNSW graph from its spill file, deleting the file once read
+    phase_start = Clock::now();
+    const bool streamed = !read_failed && !spill_failed && !assign_failed;
+    const bool built = streamed && build_sub_graphs(centers, [&](int c, float* cluster_data) {
+        const std::filesystem::path spill_path = spill.partition(c);
+        const std::streamsize bytes = partition_indices_[c].size() * graph_dim_ * sizeof(float);
+        std::ifstream in(spill_path, std::ios::binary);
+        in.read(reinterpret_cast<char*>(cluster_data), bytes);
+        const bool complete = in.gcount() == bytes && in.peek() == std::ifstream::traits_type::eof();
+        in.close();
+        std::error_code remove_error;
+        std::filesystem::remove(spill_path, remove_error);
+        return complete;
+    });
+    build_stats_.sub_graphs_ms = elapsed_ms(phase_start, Clock::now());
+    
+    if (!built) {
+        if (streamed || spill_failed) {
+            std::cerr << "Error " << (spill_failed ? "writing" : "reading") << " partition spill files in "
+                      << spill.path << std::endl;
+        }
+        for (int c = 0; c < num_clusters_; c++) {
+            sub_graphs_[c].reset();
+            partition_indices_[c].clear();
+            deleted_[c].clear();
+            deleted_counts_[c] = 0;
+        }
+        total_vectors_ = 0;
+        next_id_ = 0;
+        return false;
+    }
+    
+    total_vectors_ = n;
+    next_id_ = n;
+    build_stats_.total_ms = elapsed_ms(build_start, Clock::now());
+    count_attributes();
+    report_build();
+    return true;
+}
+
+} // namespace pyramid
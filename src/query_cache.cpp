@@ -0,0 +1,221 @@
+#include "../include/query_cache.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+
+namespace pyramid {
+
+namespace {
+
+// Bookkeeping charged to every entry on top of its arrays (list node, map slot)
+const size_t kEntryOverhead = 128;
+
+// 64-bit mix of one word into a running hash (splitmix64 finalizer)
+uint64_t mix(uint64_t hash, uint64_t word) {
+    hash ^= word + 0x9e3779b97f4a7c15ULL + (hash << 6) + (hash >> 2);
+    hash ^= hash >> 30;
+    hash *= 0xbf58476d1ce4e5b9ULL;
+    hash ^= hash >> 27;
+    hash *= 0x94d049bb133111ebULL;
+    return hash ^ (hash >> 31);
+}
+
+// Hash of a byte range, eight bytes at a time
+uint64_t hash_bytes(uint64_t hash, const void* data, size_t size) {
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        std::memcpy(&word, bytes + i, 8);
+        hash = mix(hash, word);
+    }
+    uint64_t tail = 0;
+    std::memcpy(&tail, bytes + i, size - i);
+    return mix(hash, tail ^ size);
+}
+
+} // namespace
+
+struct QueryCache::Shard {
+    struct Entry {
+        uint64_t hash;
+        uint64_t epoch;
+        QueryCacheTag tag;
+        std::vector<float> query;           // Empty for routing entries
+        std::vector<float> distances;
+        std::vector<faiss::idx_t> ids;
+        size_t bytes;
+    };
+    
+    std::mutex mutex;
+    std::list<Entry> lru;                   // Most recently used first
+    std::unordered_map<uint64_t, std::list<Entry>::iterator> index;
+    size_t bytes = 0;
+    size_t max_bytes = 0;
+    
+    void erase(std::list<Entry>::iterator it) {
+        bytes -= it->bytes;
+        index.erase(it->hash);
+        lru.erase(it);
+    }
+};
+
+QueryCache::QueryCache(int dim, const QueryCacheParams& params)
+    : dim_(dim), params_(params) {
+    params_.num_shards = std::max(1, params_.num_shards);
+    shards_.reset(new Shard[params_.num_shards]);
+    for (int s = 0; s < params_.num_shards; s++) {
+        shards_[s].max_bytes = params_.max_bytes / params_.num_shards;
+    }
+}
+
+QueryCache::~QueryCache() = default;
+
+bool QueryCache::lookup_results(const float* query, const QueryCacheTag& tag, int* indices, float* distances) {
+    const uint64_t hash = hash_bytes(hash_bytes(0, &tag, sizeof(tag)), query, dim_ * sizeof(float));
+    const bool hit = find(hash, query, tag, distances, nullptr, indices);
+    (hit ? result_hits_ : result_misses_).fetch_add(1, std::memory_order_relaxed);
+    return hit;
+}
+
+void QueryCache::store_results(const float* query, const QueryCacheTag& tag, 
+                               const int* indices, const float* distances) {
+    const uint64_t hash = hash_bytes(hash_bytes(0, &tag, sizeof(tag)), query, dim_ * sizeof(float));
+    std::vector<faiss::idx_t> ids(indices, indices + tag.k);
+    insert(hash, query, tag, distances, ids.data(), tag.k);
+}
+
+bool QueryCache::lookup_routing(const float* query, int nprobe, int beam,
+                                faiss::idx_t* partition_ids, float* partition_distances) {
+    QueryCacheTag tag;
+    tag.nprobe = nprobe;
+    tag.routing_beam = beam;
+    const bool hit = find(routing_hash(query, nprobe, beam), nullptr, tag, partition_distances, partition_ids,
+                          nullptr);
+    (hit ? routing_hits_ : routing_misses_).fetch_add(1, std::memory_order_relaxed);
+    return hit;
+}
+
+void QueryCache::store_routing(const float* query, int nprobe, int beam, const faiss::idx_t* partition_ids,
+                               const float* partition_distances) {
+    QueryCacheTag tag;
+    tag.nprobe = nprobe;
+    tag.routing_beam = beam;
+    insert(routing_hash(query, nprobe, beam), nullptr, tag, partition_distances, partition_ids, nprobe);
+}
+
+void QueryCache::invalidate() {
+    epoch_.fetch_add(1, std::memory_order_acq_rel);
+}
+
+QueryCacheStats QueryCache::stats() const {
+    QueryCacheStats result;
+    result.result_hits = result_hits_.load(std::memory_order_relaxed);
+    result.result_misses = result_misses_.load(std::memory_order_relaxed);
+    result.routing_hits = routing_hits_.load(std::memory_order_relaxed);
+    result.routing_misses = routing_misses_.load(std::memory_order_relaxed);
+    result.evictions = evictions_.load(std::memory_order_relaxed);
+    for (int s = 0; s < params_.num_shards; s++) {
+        std::lock_guard<std::mutex> lock(shards_[s].mutex);
+        result.entries += shards_[s].lru.size();
+        result.bytes += shards_[s].bytes;
+    }
+    return result;
+}
+
+bool QueryCache::find(uint64_t hash, const float* query, const QueryCacheTag& tag,
+                      float* distances, faiss::idx_t* ids, int* int_ids) {
+    Shard& shard = shard_for(hash);
+    const uint64_t epoch = epoch_.load(std::memory_order_acquire);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    
+    auto found = shard.index.find(hash);
+    if (found == shard.index.end()) {
+        return false;
+    }
+    auto it = found->second;
+    if (it->epoch != epoch) {
+        // Written before the index changed
+        shard.erase(it);
+        return false;
+    }
+    
+    // A different query or tier with the same hash is a miss
+    if (!(it->tag == tag) || it->query.empty() != (query == nullptr) ||
+        (query && std::memcmp(it->query.data(), query, dim_ * sizeof(float)) != 0)) {
+        return false;
+    }
+    
+    std::copy(it->distances.begin(), it->distances.end(), distances);
+    if (ids) {
+        std::copy(it->ids.begin(), it->ids.end(), ids);
+    }
+    if (int_ids) {
+        std::transform(it->ids.begin(), it->ids.end(), int_ids, 
+                       [](faiss::idx_t id) { return static_cast<int>(id); });
+    }
+    shard.lru.splice(shard.lru.begin(), shard.lru, it);
+    return true;
+}
+
+void QueryCache::insert(uint64_t hash, const float* query, const QueryCacheTag& tag,
+                        const float* distances, const faiss::idx_t* ids, size_t count) {
+    Shard& shard = shard_for(hash);
+    const size_t bytes = kEntryOverhead + (query ? dim_ * sizeof(float) : 0) + 
+                         count * (sizeof(float) + sizeof(faiss::idx_t));
+    if (bytes > shard.max_bytes) {
+        return;
+    }
+    
+    Shard::Entry entry;
+    entry.hash = hash;
+    entry.epoch = epoch_.load(std::memory_order_acquire);
+    entry.tag = tag;
+    if (query) {
+        entry.query.assign(query, query + dim_);
+    }
+    entry.distances.assign(distances, distances + count);
+    entry.ids.assign(ids, ids + count);
+    entry.bytes = bytes;
+    
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto found = shard.index.find(hash);
+    if (found != shard.index.end()) {
+        shard.erase(found->second);
+    }
+    
+    // Evict least recently used entries until the new one fits
+    uint64_t evicted = 0;
+    while (!shard.lru.empty() && shard.bytes + bytes > shard.max_bytes) {
+        shard.erase(std::prev(shard.lru.end()));
+        evicted++;
+    }
+    if (evicted > 0) {
+        evictions_.fetch_add(evicted, std::memory_order_relaxed);
+    }
+    
+    shard.lru.push_front(std::move(entry));
+    shard.index[hash] = shard.lru.begin();
+    shard.bytes += bytes;
+}
+
+uint64_t QueryCache::routing_hash(const float* query, int nprobe, int beam) const {
+    // Components in the same quantization cell give the same signature
+    uint64_t hash = mix(0x70797261ULL, static_cast<uint64_t>(nprobe));
+    hash = mix(hash, static_cast<uint64_t>(beam));
+    const float inverse_quantum = 1.0f / params_.routing_quantum;
+    for (int d = 0; d < dim_; d++) {
+        const int64_t cell = static_cast<int64_t>(std::floor(query[d] * inverse_quantum));
+        hash = mix(hash, static_cast<uint64_t>(cell));
+    }
+    return hash;
+}
+
+QueryCache::Shard& QueryCache::shard_for(uint64_t hash) const {
+    return shards_[(hash >> 32) % params_.num_shards];
+}
+
+} // namespace pyramid
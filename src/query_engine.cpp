@@ -0,0 +1,201 @@
+#include "../include/query_engine.h"
+#include "../include/search_context.h"
+#include <algorithm>
+
+namespace pyramid {
+
+// A query in flight: its own copy of the vector and one result slot per probe
+struct QueryEngine::Query {
+    std::vector<float> vector;
+    int k;
+    SearchParams params;
+    std::vector<int> partitions;         // Partition of each probe slot
+    std::vector<int> candidate_ids;      // k candidates per slot
+    std::vector<float> candidate_distances;
+    std::atomic<int> pending;            // Slots not searched yet
+    std::mutex error_mutex;              // Guards error
+    std::exception_ptr error;            // First exception of any slot
+    Callback callback;
+};
+
+QueryEngine::QueryEngine(const PyramidGraph& index, const QueryEngineParams& params)
+    : index_(index) {
+    int num_threads = params.num_threads;
+    if (num_threads <= 0) {
+        num_threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    
+    for (int w = 0; w < num_threads; w++) {
+        queues_.push_back(std::make_unique<Worker>());
+    }
+    for (int w = 0; w < num_threads; w++) {
+        workers_.emplace_back(&QueryEngine::worker_loop, this, w);
+    }
+}
+
+QueryEngine::~QueryEngine() {
+    {
+        std::lock_guard<std::mutex> lock(sleep_mutex_);
+        stopping_ = true;
+    }
+    wake_.notify_all();
+    for (std::thread& worker : workers_) {
+        worker.join();
+    }
+}
+
+std::future<QueryResult> QueryEngine::submit(const float* query, int k, const SearchParams* params) {
+    auto promise = std::make_shared<std::promise<QueryResult>>();
+    std::future<QueryResult> future = promise->get_future();
+    submit(query, k, [promise](QueryResult&& result) {
+        if (result.error) {
+            promise->set_exception(result.error);
+            return;
+        }
+        promise->set_value(std::move(result));
+    }, params);
+    return future;
+}
+
+void QueryEngine::submit(const float* query, int k, Callback callback, const SearchParams* params) {
+    auto q = std::make_shared<Query>();
+    const int dim = index_.dim();
+    q->vector.assign(query, query + dim);
+    q->k = k;
+    q->params = params ? *params : SearchParams();
+    q->params.stats = nullptr;
+    q->callback = std::move(callback);
+    
+    // Route on the caller's thread; the meta-HNSW is small and stays hot
+    const int nprobe = std::max(1, std::min(q->params.nprobe, index_.num_partitions()));
+    std::vector<faiss::idx_t> partition_ids(nprobe);
+    std::vector<float> partition_distances(nprobe);
+    index_.route(1, q->vector.data(), nprobe, partition_ids.data(), partition_distances.data(),
+                 q->params.routing_beam);
+    
+    for (faiss::idx_t c : partition_ids) {
+        if (c >= 0) {
+            q->partitions.push_back(static_cast<int>(c));
+        }
+    }
+    const int num_slots = static_cast<int>(q->partitions.size());
+    q->candidate_ids.assign(static_cast<size_t>(num_slots) * k, -1);
+    q->candidate_distances.assign(static_cast<size_t>(num_slots) * k, 0.0f);
+    q->pending.store(num_slots);
+    
+    if (num_slots == 0) {
+        WorkItem empty{q, -1};
+        run(empty);
+        return;
+    }
+    
+    // Queue each probe on the worker that owns its partition
+    for (int slot = 0; slot < num_slots; slot++) {
+        Worker& worker = *queues_[q->partitions[slot] % queues_.size()];
+        std::lock_guard<std::mutex> lock(worker.mutex);
+        worker.queue.push_back(WorkItem{q, slot});
+    }
+    queued_.fetch_add(num_slots);
+    {
+        // Pairs with the predicate check in worker_loop so no wake-up is lost
+        std::lock_guard<std::mutex> lock(sleep_mutex_);
+    }
+    if (num_slots == 1) {
+        wake_.notify_one();
+    } else {
+        wake_.notify_all();
+    }
+}
+
+QueryEngineStats QueryEngine::stats() const {
+    QueryEngineStats result;
+    result.queries = queries_.load(std::memory_order_relaxed);
+    result.work_items = work_items_.load(std::memory_order_relaxed);
+    result.steals = steals_.load(std::memory_order_relaxed);
+    return result;
+}
+
+bool QueryEngine::take(int w, WorkItem& item) {
+    const int num_workers = static_cast<int>(queues_.size());
+    
+    // Own queue first (oldest item), then the other queues in ring order
+    for (int i = 0; i < num_workers; i++) {
+        Worker& worker = *queues_[(w + i) % num_workers];
+        std::lock_guard<std::mutex> lock(worker.mutex);
+        if (worker.queue.empty()) {
+            continue;
+        }
+        item = std::move(worker.queue.front());
+        worker.queue.pop_front();
+        queued_.fetch_sub(1);
+        if (i > 0) {
+            steals_.fetch_add(1, std::memory_order_relaxed);
+        }
+        return true;
+    }
+    return false;
+}
+
+void QueryEngine::run(WorkItem& item) {
+    Query& q = *item.query;
+    if (item.slot >= 0) {
+        try {
+            index_.search_partitions(q.vector.data(), q.k, &q.partitions[item.slot], 1,
+                                     q.candidate_ids.data() + static_cast<size_t>(item.slot) * q.k,
+                                     q.candidate_distances.data() + static_cast<size_t>(item.slot) * q.k,
+                                     &q.params);
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(q.error_mutex);
+            if (!q.error) {
+                q.error = std::current_exception();
+            }
+        }
+        work_items_.fetch_add(1, std::memory_order_relaxed);
+        
+        // The last slot merges; acq_rel makes the other slots' writes visible
+        if (q.pending.fetch_sub(1, std::memory_order_acq_rel) != 1) {
+            return;
+        }
+    }
+    
+    // Replicated vectors may appear in several partitions
+    QueryResult result;
+    result.error = q.error;
+    if (!result.error) {
+        try {
+            TopKHeap heap;
+            heap.reset(q.k, index_.metric() != Metric::L2);
+            for (size_t i = 0; i < q.candidate_ids.size(); i++) {
+                heap.push(q.candidate_distances[i], q.candidate_ids[i], true);
+            }
+            result.indices.resize(q.k);
+            result.distances.resize(q.k);
+            heap.finish(result.indices.data(), result.distances.data());
+        } catch (...) {
+            result = QueryResult();
+            result.error = std::current_exception();
+        }
+    }
+    
+    queries_.fetch_add(1, std::memory_order_relaxed);
+    q.callback(std::move(result));
+}
+
+void QueryEngine::worker_loop(int w) {
+    WorkItem item;
+    while (true) {
+        if (take(w, item)) {
+            run(item);
+            item.query.reset();
+            continue;
+        }
+        
+        std::unique_lock<std::mutex> lock(sleep_mutex_);
+        wake_.wait(lock, [this] { return stopping_ || queued_.load() > 0; });
+        if (stopping_ && queued_.load() == 0) {
+            return;
+        }
+    }
+}
+
+} // namespace pyramid
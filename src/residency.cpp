@@ -0,0 +1,99 @@
+#include "../include/residency.h"
+#include <chrono>
+#include <stdexcept>
+#include <string>
+
+namespace pyramid {
+
+PartitionResidency::PartitionResidency(std::vector<size_t> sizes, size_t budget_bytes,
+                                       Loader loader, Releaser releaser)
+    : sizes_(std::move(sizes)), budget_bytes_(budget_bytes),
+      loader_(std::move(loader)), releaser_(std::move(releaser)),
+      graphs_(sizes_.size()), positions_(sizes_.size()),
+      load_mutexes_(new std::mutex[sizes_.size()]) {}
+
+std::shared_ptr<const faiss::IndexHNSW> PartitionResidency::acquire(int c) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (graphs_[c]) {
+            lru_.splice(lru_.begin(), lru_, positions_[c]);
+            hits_.fetch_add(1, std::memory_order_relaxed);
+            return graphs_[c];
+        }
+    }
+    if (sizes_[c] == 0) {
+        return nullptr;
+    }
+    
+    // Only one thread reads a given partition; the others wait for it
+    std::lock_guard<std::mutex> load_lock(load_mutexes_[c]);
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (graphs_[c]) {
+            lru_.splice(lru_.begin(), lru_, positions_[c]);
+            hits_.fetch_add(1, std::memory_order_relaxed);
+            return graphs_[c];
+        }
+    }
+    
+    // A failed load is counted and reported to the caller; the next probe tries again
+    const auto start = std::chrono::steady_clock::now();
+    std::shared_ptr<faiss::IndexHNSW> graph;
+    try {
+        graph = loader_(c);
+    } catch (...) {
+        load_failures_.fetch_add(1, std::memory_order_relaxed);
+        throw;
+    }
+    if (!graph) {
+        load_failures_.fetch_add(1, std::memory_order_relaxed);
+        throw std::runtime_error("partition " + std::to_string(c) + " could not be loaded");
+    }
+    load_ns_.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                           std::chrono::steady_clock::now() - start).count(), std::memory_order_relaxed);
+    loads_.fetch_add(1, std::memory_order_relaxed);
+    
+    std::vector<int> evicted;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        graphs_[c] = graph;
+        lru_.push_front(c);
+        positions_[c] = lru_.begin();
+        resident_bytes_ += sizes_[c];
+        
+        // Evict from the cold end, keeping the graph that was just loaded
+        while (budget_bytes_ > 0 && resident_bytes_ > budget_bytes_ && lru_.size() > 1) {
+            const int victim = lru_.back();
+            lru_.pop_back();
+            graphs_[victim].reset();
+            resident_bytes_ -= sizes_[victim];
+            evicted.push_back(victim);
+        }
+    }
+    
+    evictions_.fetch_add(evicted.size(), std::memory_order_relaxed);
+    if (releaser_) {
+        for (int victim : evicted) {
+            releaser_(victim);
+        }
+    }
+    return graph;
+}
+
+ResidencyStats PartitionResidency::stats() const {
+    ResidencyStats result;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        result.resident_partitions = lru_.size();
+        result.resident_bytes = resident_bytes_;
+    }
+    result.budget_bytes = budget_bytes_;
+    result.hits = hits_.load(std::memory_order_relaxed);
+    result.loads = loads_.load(std::memory_order_relaxed);
+    result.load_failures = load_failures_.load(std::memory_order_relaxed);
+    result.evictions = evictions_.load(std::memory_order_relaxed);
+    result.load_ms = load_ns_.load(std::memory_order_relaxed) / 1e6;
+    return result;
+}
+
+} // namespace pyramid
@@ -0,0 +1,175 @@
+#include "../include/routing_tree.h"
+#include "../include/search_context.h"
+#include <faiss/utils/distances.h>
+#include <algorithm>
+#include <cstring>
+
+namespace pyramid {
+
+namespace {
+
+// Append the raw bytes of n values to a buffer
+template <typename T>
+void append(std::vector<uint8_t>& out, const T* values, size_t n) {
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(values);
+    out.insert(out.end(), bytes, bytes + n * sizeof(T));
+}
+
+// Read n values from a buffer, advancing the position; false if the buffer is too short
+template <typename T>
+bool extract(const uint8_t* data, size_t size, size_t& pos, T* values, size_t n) {
+    if (n > (size - pos) / sizeof(T)) {
+        return false;
+    }
+    std::memcpy(values, data + pos, n * sizeof(T));
+    pos += n * sizeof(T);
+    return true;
+}
+
+} // namespace
+
+RoutingTree::RoutingTree(int dim, faiss::MetricType metric)
+    : dim_(dim), metric_(metric) {}
+
+void RoutingTree::add_level(std::vector<float> centroids, std::vector<size_t> child_offsets,
+                            std::vector<int> child_ids) {
+    Level level;
+    level.centroids = std::move(centroids);
+    level.child_offsets = std::move(child_offsets);
+    level.child_ids = std::move(child_ids);
+    levels_.push_back(std::move(level));
+}
+
+void RoutingTree::set_partition_centroids(const float* centroids, int num_partitions) {
+    partition_centroids_.assign(centroids, centroids + static_cast<size_t>(num_partitions) * dim_);
+}
+
+void RoutingTree::attach_partition(int sibling, int partition) {
+    if (levels_.empty()) {
+        return;
+    }
+    Level& last = levels_.back();
+    const auto it = std::find(last.child_ids.begin(), last.child_ids.end(), sibling);
+    if (it == last.child_ids.end()) {
+        return;
+    }
+    
+    // Insert right after the sibling and shift the offsets of the following nodes
+    const size_t pos = static_cast<size_t>(it - last.child_ids.begin());
+    last.child_ids.insert(last.child_ids.begin() + pos + 1, partition);
+    for (size_t& offset : last.child_offsets) {
+        if (offset > pos) {
+            offset++;
+        }
+    }
+}
+
+void RoutingTree::route(const float* query, int nprobe, int beam, float* distances, faiss::idx_t* ids,
+                        const uint8_t* allowed) const {
+    const bool largest = metric_ == faiss::METRIC_INNER_PRODUCT;
+    beam = std::max(1, beam);
+    TopKHeap heap;
+    std::vector<faiss::idx_t> frontier(beam);
+    std::vector<float> frontier_distances(beam);
+    
+    // Every node of the top level is a candidate
+    heap.reset(beam, largest);
+    for (size_t i = 0; i < level_size(0); i++) {
+        heap.push(distance(query, levels_[0].centroids.data() + i * dim_), static_cast<faiss::idx_t>(i));
+    }
+    heap.finish(frontier.data(), frontier_distances.data());
+    
+    // Expand the children of the beam, down to the partitions
+    for (size_t l = 0; l < levels_.size(); l++) {
+        const Level& level = levels_[l];
+        const bool last = l + 1 == levels_.size();
+        const float* child_centroids = last ? partition_centroids_.data() : levels_[l + 1].centroids.data();
+        
+        heap.reset(last ? nprobe : beam, largest);
+        for (faiss::idx_t node : frontier) {
+            if (node < 0) {
+                continue;
+            }
+            for (size_t j = level.child_offsets[node]; j < level.child_offsets[node + 1]; j++) {
+                const int child = level.child_ids[j];
+                if (last && allowed && !allowed[child]) {
+                    continue;
+                }
+                heap.push(distance(query, child_centroids + static_cast<size_t>(child) * dim_), child);
+            }
+        }
+        
+        if (last) {
+            heap.finish(ids, distances);
+        } else {
+            heap.finish(frontier.data(), frontier_distances.data());
+        }
+    }
+}
+
+void RoutingTree::serialize(std::vector<uint8_t>& out) const {
+    const uint32_t num_levels = static_cast<uint32_t>(levels_.size());
+    append(out, &num_levels, 1);
+    for (const Level& level : levels_) {
+        const uint64_t counts[2] = {level.child_offsets.size() - 1, level.child_ids.size()};
+        append(out, counts, 2);
+        append(out, level.centroids.data(), level.centroids.size());
+        append(out, level.child_offsets.data(), level.child_offsets.size());
+        append(out, level.child_ids.data(), level.child_ids.size());
+    }
+}
+
+bool RoutingTree::deserialize(const uint8_t* data, size_t size, int num_partitions) {
+    size_t pos = 0;
+    uint32_t num_levels = 0;
+    if (!extract(data, size, pos, &num_levels, 1)) {
+        return false;
+    }
+    
+    std::vector<Level> levels(num_levels);
+    for (Level& level : levels) {
+        uint64_t counts[2];
+        // Bound the counts by the bytes left before allocating
+        if (!extract(data, size, pos, counts, 2) ||
+            counts[0] > (size - pos) / (sizeof(float) * std::max(1, dim_)) ||
+            counts[1] > (size - pos) / sizeof(int)) {
+            return false;
+        }
+        level.centroids.resize(counts[0] * dim_);
+        level.child_offsets.resize(counts[0] + 1);
+        level.child_ids.resize(counts[1]);
+        if (!extract(data, size, pos, level.centroids.data(), level.centroids.size()) ||
+            !extract(data, size, pos, level.child_offsets.data(), level.child_offsets.size()) ||
+            !extract(data, size, pos, level.child_ids.data(), level.child_ids.size()) ||
+            level.child_offsets.front() != 0 || level.child_offsets.back() != level.child_ids.size() ||
+            !std::is_sorted(level.child_offsets.begin(), level.child_offsets.end())) {
+            return false;
+        }
+    }
+    
+    // Children must refer to nodes of the next level, or to partitions
+    for (size_t l = 0; l < levels.size(); l++) {
+        const size_t next_size = l + 1 < levels.size() ? levels[l + 1].child_offsets.size() - 1 :
+                                                         static_cast<size_t>(num_partitions);
+        for (int child : levels[l].child_ids) {
+            if (child < 0 || static_cast<size_t>(child) >= next_size) {
+                return false;
+            }
+        }
+    }
+    
+    if (levels.empty() || levels[0].child_offsets.size() < 2) {
+        return false;
+    }
+    levels_ = std::move(levels);
+    return true;
+}
+
+float RoutingTree::distance(const float* query, const float* centroid) const {
+    if (metric_ == faiss::METRIC_INNER_PRODUCT) {
+        return faiss::fvec_inner_product(query, centroid, dim_);
+    }
+    return faiss::fvec_L2sqr(query, centroid, dim_);
+}
+
+} // namespace pyramid
@@ -1,4 +1,5 @@
 #include "../include/search.h"
+#include "../include/search_context.h"
 #include <faiss/Index.h>
 #include <algorithm>
 #include <vector>
@@ -38,42 +39,35 @@ SearchResult find_partitions(const faiss::Index* meta_index, const float* query,
     return result;
 }
 
-// Combines multiple search results and sorts by distance
-SearchResult merge_results(const std::vector<SearchResult>& results, int k) {
+// Combines multiple search results, keeping the k best in a bounded heap
+SearchResult merge_results(const std::vector<SearchResult>& results, int k, bool descending) {
     // Count total number of results to merge
     size_t total_results = 0;
     for (const auto& result : results) {
         total_results += result.indices.size();
     }
     
-    if (total_results == 0) {
+    if (total_results == 0 || k <= 0) {
         return SearchResult(0);
     }
     
-    // Collect all indices and distances
-    std::vector<std::pair<float, faiss::idx_t>> all_results;
-    all_results.reserve(total_results);
+    // Offer every valid result to a heap that holds at most k entries;
+    // invalid indices (marked as -1) are rejected by the heap
+    const int heap_k = static_cast<int>(std::min(static_cast<size_t>(k), total_results));
+    TopKHeap heap;
+    heap.reset(heap_k, descending);
     
     for (const auto& result : results) {
         for (size_t i = 0; i < result.indices.size(); i++) {
-            // Skip invalid indices (marked as -1)
-            if (result.indices[i] != -1) {
-                all_results.emplace_back(result.distances[i], result.indices[i]);
-            }
+            heap.push(result.distances[i], result.indices[i]);
         }
     }
     
-    // Sort by distance (ascending)
-    std::sort(all_results.begin(), all_results.end());
-    
     // Create final result with top-k
-    int final_k = std::min(k, static_cast<int>(all_results.size()));
-    SearchResult merged_result(final_k);
-    
-    for (int i = 0; i < final_k; i++) {
-        merged_result.distances[i] = all_results[i].first;
-        merged_result.indices[i] = all_results[i].second;
-    }
+    SearchResult merged_result(heap_k);
+    const size_t final_k = heap.finish(merged_result.indices.data(), merged_result.distances.data());
+    merged_result.indices.resize(final_k);
+    merged_result.distances.resize(final_k);
     
     return merged_result;
 }
@@ -0,0 +1,129 @@
+#include "../include/search_stats.h"
+#include <algorithm>
+#include <cmath>
+
+namespace pyramid {
+
+namespace {
+
+uint64_t to_ns(double us) {
+    return us > 0.0 ? static_cast<uint64_t>(us * 1000.0) : 0;
+}
+
+} // namespace
+
+void SearchStats::reset() {
+    total_us = 0.0;
+    routing_us = 0.0;
+    sub_graph_us = 0.0;
+    merge_us = 0.0;
+    partitions_probed = 0;
+    candidates_merged = 0;
+    partitions_scanned = 0;
+    partitions_filtered = 0;
+    partitions_pruned = 0;
+    cache_hit = false;
+    partitions.clear();
+}
+
+void LatencyHistogram::record(double us) {
+    int bucket = 0;
+    if (us >= 1.0) {
+        bucket = std::min(kNumBuckets - 1, static_cast<int>(std::log2(us)) + 1);
+    }
+    counts_[bucket].fetch_add(1, std::memory_order_relaxed);
+    total_us_.fetch_add(static_cast<uint64_t>(us), std::memory_order_relaxed);
+}
+
+std::vector<uint64_t> LatencyHistogram::buckets() const {
+    std::vector<uint64_t> result(kNumBuckets);
+    for (int i = 0; i < kNumBuckets; i++) {
+        result[i] = counts_[i].load(std::memory_order_relaxed);
+    }
+    return result;
+}
+
+void LatencyHistogram::reset() {
+    for (auto& count : counts_) {
+        count.store(0, std::memory_order_relaxed);
+    }
+    total_us_.store(0, std::memory_order_relaxed);
+}
+
+double LatencyHistogram::percentile(const std::vector<uint64_t>& buckets, double p) {
+    uint64_t total = 0;
+    for (uint64_t count : buckets) {
+        total += count;
+    }
+    if (total == 0) {
+        return 0.0;
+    }
+    
+    // Smallest bucket whose cumulative count reaches the requested rank
+    const uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(p * total)));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < buckets.size(); i++) {
+        seen += buckets[i];
+        if (seen >= rank) {
+            return bucket_limit(static_cast<int>(i));
+        }
+    }
+    return bucket_limit(static_cast<int>(buckets.size()) - 1);
+}
+
+void SearchMetrics::record_query(double latency_us, double routing_us, double sub_graph_us,
+                                 size_t partitions_probed, size_t candidates_merged) {
+    queries_.fetch_add(1, std::memory_order_relaxed);
+    partitions_probed_.fetch_add(partitions_probed, std::memory_order_relaxed);
+    candidates_merged_.fetch_add(candidates_merged, std::memory_order_relaxed);
+    routing_ns_.fetch_add(to_ns(routing_us), std::memory_order_relaxed);
+    sub_graph_ns_.fetch_add(to_ns(sub_graph_us), std::memory_order_relaxed);
+    query_latency_.record(latency_us);
+}
+
+void SearchMetrics::record_batch(size_t nq, double latency_us, double routing_us, double sub_graph_us,
+                                 size_t partitions_probed, size_t candidates_merged) {
+    queries_.fetch_add(nq, std::memory_order_relaxed);
+    batches_.fetch_add(1, std::memory_order_relaxed);
+    partitions_probed_.fetch_add(partitions_probed, std::memory_order_relaxed);
+    candidates_merged_.fetch_add(candidates_merged, std::memory_order_relaxed);
+    routing_ns_.fetch_add(to_ns(routing_us), std::memory_order_relaxed);
+    sub_graph_ns_.fetch_add(to_ns(sub_graph_us), std::memory_order_relaxed);
+    batch_latency_.record(latency_us);
+}
+
+void SearchMetrics::record_partitions(double sub_graph_us, size_t partitions_probed, size_t candidates_merged) {
+    partition_searches_.fetch_add(1, std::memory_order_relaxed);
+    partitions_probed_.fetch_add(partitions_probed, std::memory_order_relaxed);
+    candidates_merged_.fetch_add(candidates_merged, std::memory_order_relaxed);
+    sub_graph_ns_.fetch_add(to_ns(sub_graph_us), std::memory_order_relaxed);
+}
+
+SearchMetricsSnapshot SearchMetrics::snapshot() const {
+    SearchMetricsSnapshot result;
+    result.queries = queries_.load(std::memory_order_relaxed);
+    result.batches = batches_.load(std::memory_order_relaxed);
+    result.partition_searches = partition_searches_.load(std::memory_order_relaxed);
+    result.partitions_probed = partitions_probed_.load(std::memory_order_relaxed);
+    result.candidates_merged = candidates_merged_.load(std::memory_order_relaxed);
+    result.routing_us = routing_ns_.load(std::memory_order_relaxed) / 1000.0;
+    result.sub_graph_us = sub_graph_ns_.load(std::memory_order_relaxed) / 1000.0;
+    result.query_latency = query_latency_.buckets();
+    result.batch_latency = batch_latency_.buckets();
+    result.query_latency_sum_us = query_latency_.sum();
+    return result;
+}
+
+void SearchMetrics::reset() {
+    queries_.store(0, std::memory_order_relaxed);
+    batches_.store(0, std::memory_order_relaxed);
+    partition_searches_.store(0, std::memory_order_relaxed);
+    partitions_probed_.store(0, std::memory_order_relaxed);
+    candidates_merged_.store(0, std::memory_order_relaxed);
+    routing_ns_.store(0, std::memory_order_relaxed);
+    sub_graph_ns_.store(0, std::memory_order_relaxed);
+    query_latency_.reset();
+    batch_latency_.reset();
+}
+
+} // namespace pyramid
@@ -0,0 +1,479 @@
+#include "../include/shard.h"
+#include "../include/search_context.h"
+#include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace pyramid {
+
+namespace {
+
+// Wire format, native byte order (both ends run on the same machine):
+//   request:  RequestHeader, int32_t partitions[num_partitions], float query[dim]
+//   response: ResponseHeader, float distances[count], int64_t ids[count]
+const uint32_t kRequestMagic = 0x51445950;   // "PYDQ"
+const uint32_t kResponseMagic = 0x52445950;  // "PYDR"
+const int32_t kMaxK = 1 << 20;               // Bounds the buffers a request can make a worker allocate
+
+struct RequestHeader {
+    uint32_t magic;
+    int32_t dim;
+    uint64_t request_id;
+    int32_t k;
+    int32_t ef_search;
+    int32_t rerank_factor;
+    int32_t num_partitions;
+};
+
+struct ResponseHeader {
+    uint32_t magic;
+    int32_t status;          // 0: ok, otherwise the request was rejected
+    uint64_t request_id;
+    int32_t count;
+    int32_t reserved;
+};
+
+using Clock = std::chrono::steady_clock;
+
+// Write the whole buffer; false if the peer is gone
+bool write_all(int fd, const void* data, size_t size) {
+    const char* p = static_cast<const char*>(data);
+    while (size > 0) {
+        const ssize_t written = ::send(fd, p, size, MSG_NOSIGNAL);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return false;
+        }
+        p += written;
+        size -= written;
+    }
+    return true;
+}
+
+// Read exactly size bytes; false on end of stream or error
+bool read_all(int fd, void* data, size_t size) {
+    char* p = static_cast<char*>(data);
+    while (size > 0) {
+        const ssize_t got = ::recv(fd, p, size, 0);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            return false;
+        }
+        p += got;
+        size -= got;
+    }
+    return true;
+}
+
+// Read exactly size bytes before the deadline; false on timeout, end of stream or error
+bool read_until(int fd, void* data, size_t size, Clock::time_point deadline) {
+    char* p = static_cast<char*>(data);
+    while (size > 0) {
+        const auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - Clock::now());
+        if (remaining.count() <= 0) {
+            return false;
+        }
+        
+        pollfd pfd{fd, POLLIN, 0};
+        const int ready = ::poll(&pfd, 1, static_cast<int>(remaining.count()));
+        if (ready < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ready <= 0) {
+            return false;
+        }
+        
+        const ssize_t got = ::recv(fd, p, size, MSG_DONTWAIT);
+        if (got < 0 && (errno == EINTR || errno == EAGAIN)) {
+            continue;
+        }
+        if (got <= 0) {
+            return false;
+        }
+        p += got;
+        size -= got;
+    }
+    return true;
+}
+
+// Fill a Unix-domain socket address; false if the path does not fit
+bool make_address(const std::string& path, sockaddr_un& address) {
+    std::memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(address.sun_path)) {
+        std::cerr << "Error: invalid socket path: " << path << std::endl;
+        return false;
+    }
+    std::memcpy(address.sun_path, path.c_str(), path.size());
+    return true;
+}
+
+// Connect to a worker socket, or return -1
+int connect_socket(const std::string& path) {
+    sockaddr_un address;
+    if (!make_address(path, address)) {
+        return -1;
+    }
+    
+    const int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (::connect(fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0) {
+        ::close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Send a response with no results
+bool write_error(int fd, uint64_t request_id) {
+    ResponseHeader response{kResponseMagic, 1, request_id, 0, 0};
+    return write_all(fd, &response, sizeof(response));
+}
+
+} // namespace
+
+ShardServer::ShardServer(const PyramidGraph& index) : index_(index) {}
+
+ShardServer::~ShardServer() {
+    stop();
+    if (listen_fd_ >= 0) {
+        ::close(listen_fd_);
+        ::unlink(socket_path_.c_str());
+    }
+    for (int fd : wake_fds_) {
+        if (fd >= 0) {
+            ::close(fd);
+        }
+    }
+}
+
+bool ShardServer::listen(const std::string& socket_path) {
+    sockaddr_un address;
+    if (!make_address(socket_path, address)) {
+        return false;
+    }
+    if (::pipe2(wake_fds_, O_CLOEXEC) != 0) {
+        std::cerr << "Error creating wake pipe: " << std::strerror(errno) << std::endl;
+        return false;
+    }
+    
+    listen_fd_ = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd_ < 0) {
+        std::cerr << "Error creating socket: " << std::strerror(errno) << std::endl;
+        return false;
+    }
+    
+    // A socket file left by a previous worker would make bind() fail
+    ::unlink(socket_path.c_str());
+    if (::bind(listen_fd_, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0 ||
+        ::listen(listen_fd_, SOMAXCONN) != 0) {
+        std::cerr << "Error listening on " << socket_path << ": " << std::strerror(errno) << std::endl;
+        ::close(listen_fd_);
+        listen_fd_ = -1;
+        return false;
+    }
+    socket_path_ = socket_path;
+    return true;
+}
+
+void ShardServer::serve() {
+    while (!stopping_.load()) {
+        pollfd fds[2] = {{listen_fd_, POLLIN, 0}, {wake_fds_[0], POLLIN, 0}};
+        if (::poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            std::cerr << "Error waiting for connections: " << std::strerror(errno) << std::endl;
+            break;
+        }
+        if (fds[1].revents || !(fds[0].revents & POLLIN)) {
+            continue;
+        }
+        
+        const int fd = ::accept4(listen_fd_, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0) {
+            continue;
+        }
+        
+        // Threads of closed connections are joined here, so a long-running
+        // worker only keeps the threads of its open connections
+        std::vector<std::thread> finished;
+        {
+            std::lock_guard<std::mutex> lock(connections_mutex_);
+            for (std::thread::id id : finished_) {
+                auto it = std::find_if(workers_.begin(), workers_.end(),
+                                       [id](const std::thread& worker) { return worker.get_id() == id; });
+                if (it != workers_.end()) {
+                    finished.push_back(std::move(*it));
+                    workers_.erase(it);
+                }
+            }
+            finished_.clear();
+            connection_fds_.push_back(fd);
+            workers_.emplace_back(&ShardServer::handle_connection, this, fd);
+        }
+        for (std::thread& worker : finished) {
+            worker.join();
+        }
+    }
+    
+    // Unblock the connection threads; each one closes its own socket
+    std::vector<std::thread> workers;
+    {
+        std::lock_guard<std::mutex> lock(connections_mutex_);
+        for (int fd : connection_fds_) {
+            ::shutdown(fd, SHUT_RDWR);
+        }
+        workers.swap(workers_);
+        finished_.clear();
+    }
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+}
+
+void ShardServer::stop() {
+    // Only async-signal-safe calls, so stop() may run in a signal handler
+    stopping_.store(true);
+    if (wake_fds_[1] >= 0) {
+        const char byte = 0;
+        (void)!::write(wake_fds_[1], &byte, 1);
+    }
+}
+
+void ShardServer::handle_connection(int fd) {
+    std::vector<int32_t> partitions;
+    std::vector<float> query(index_.dim());
+    std::vector<int> indices;
+    std::vector<float> distances;
+    std::vector<int64_t> ids;
+    
+    RequestHeader request;
+    while (read_all(fd, &request, sizeof(request))) {
+        if (request.magic != kRequestMagic || request.dim != index_.dim() ||
+            request.k <= 0 || request.k > kMaxK ||
+            request.num_partitions < 0 || request.num_partitions > index_.num_partitions()) {
+            // The stream can no longer be trusted, so the connection is dropped
+            write_error(fd, request.request_id);
+            break;
+        }
+        
+        partitions.resize(request.num_partitions);
+        if (!read_all(fd, partitions.data(), partitions.size() * sizeof(int32_t)) ||
+            !read_all(fd, query.data(), query.size() * sizeof(float))) {
+            break;
+        }
+        
+        SearchParams params;
+        params.ef_search = request.ef_search;
+        params.rerank_factor = request.rerank_factor;
+        indices.resize(request.k);
+        distances.resize(request.k);
+        try {
+            index_.search_partitions(query.data(), request.k, partitions.data(), request.num_partitions,
+                                     indices.data(), distances.data(), &params);
+        } catch (const std::exception& e) {
+            // The request was read whole, so the connection can take the next one
+            std::cerr << "Error searching partitions: " << e.what() << std::endl;
+            if (!write_error(fd, request.request_id)) {
+                break;
+            }
+            continue;
+        }
+        
+        ids.assign(indices.begin(), indices.end());
+        ResponseHeader response{kResponseMagic, 0, request.request_id, request.k, 0};
+        if (!write_all(fd, &response, sizeof(response)) ||
+            !write_all(fd, distances.data(), distances.size() * sizeof(float)) ||
+            !write_all(fd, ids.data(), ids.size() * sizeof(int64_t))) {
+            break;
+        }
+    }
+    
+    std::lock_guard<std::mutex> lock(connections_mutex_);
+    connection_fds_.erase(std::remove(connection_fds_.begin(), connection_fds_.end(), fd),
+                          connection_fds_.end());
+    finished_.push_back(std::this_thread::get_id());
+    ::close(fd);
+}
+
+ShardRouter::ShardRouter(std::unique_ptr<PyramidGraph> routing_index, std::vector<ShardEndpoint> shards,
+                         const RouterOptions& options)
+    : index_(std::move(routing_index)), shards_(std::move(shards)), options_(options),
+      owner_(index_->num_partitions(), -1), pools_(new ConnectionPool[shards_.size()]) {
+    
+    for (size_t s = 0; s < shards_.size(); s++) {
+        for (int c : shards_[s].partitions) {
+            if (c >= 0 && c < index_->num_partitions() && owner_[c] < 0) {
+                owner_[c] = static_cast<int>(s);
+            }
+        }
+    }
+}
+
+ShardRouter::~ShardRouter() {
+    for (size_t s = 0; s < shards_.size(); s++) {
+        for (int fd : pools_[s].idle) {
+            ::close(fd);
+        }
+    }
+}
+
+int ShardRouter::acquire(size_t s, bool& reused) const {
+    ConnectionPool& pool = pools_[s];
+    {
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        if (!pool.idle.empty()) {
+            const int fd = pool.idle.back();
+            pool.idle.pop_back();
+            reused = true;
+            return fd;
+        }
+    }
+    reused = false;
+    return connect_socket(shards_[s].socket_path);
+}
+
+void ShardRouter::release(size_t s, int fd) const {
+    ConnectionPool& pool = pools_[s];
+    {
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        if (pool.idle.size() < static_cast<size_t>(std::max(0, options_.idle_connections))) {
+            pool.idle.push_back(fd);
+            return;
+        }
+    }
+    ::close(fd);
+}
+
+bool ShardRouter::search(const float* query, int k, int* indices, float* distances,
+                         const SearchParams* params, ShardSearchStatus* status) const {
+    const SearchParams options = params ? *params : SearchParams();
+    const int dim = index_->dim();
+    const int nprobe = std::max(1, std::min(options.nprobe, index_->num_partitions()));
+    ShardSearchStatus result;
+    
+    // Route locally, then group the probed partitions by owning shard
+    std::vector<faiss::idx_t> partition_ids(nprobe);
+    std::vector<float> partition_distances(nprobe);
+    index_->route(1, query, nprobe, partition_ids.data(), partition_distances.data(), options.routing_beam);
+    
+    std::vector<std::vector<int32_t>> shard_partitions(shards_.size());
+    for (faiss::idx_t c : partition_ids) {
+        if (c < 0 || c >= index_->num_partitions()) {
+            continue;
+        }
+        if (owner_[c] < 0) {
+            result.partitions_missed++;
+            continue;
+        }
+        shard_partitions[owner_[c]].push_back(static_cast<int32_t>(c));
+    }
+    
+    // Scatter: the search owns the connections it takes, so concurrent searches never wait on each other
+    const Clock::time_point deadline = Clock::now() + std::chrono::milliseconds(options_.timeout_ms);
+    std::vector<int> sent;
+    std::vector<int> fds;
+    std::vector<uint64_t> request_ids;
+    for (size_t s = 0; s < shards_.size(); s++) {
+        if (shard_partitions[s].empty()) {
+            continue;
+        }
+        result.shards_queried++;
+        
+        const RequestHeader request{kRequestMagic, dim, pools_[s].next_request.fetch_add(1), k,
+                                    options.ef_search, options.rerank_factor,
+                                    static_cast<int32_t>(shard_partitions[s].size())};
+        
+        // Pooled connections may belong to a worker that restarted: drop them
+        // until one takes the request, and try a new connection once
+        int fd = -1;
+        while (true) {
+            bool reused = false;
+            fd = acquire(s, reused);
+            if (fd < 0) {
+                break;
+            }
+            if (write_all(fd, &request, sizeof(request)) &&
+                write_all(fd, shard_partitions[s].data(), shard_partitions[s].size() * sizeof(int32_t)) &&
+                write_all(fd, query, dim * sizeof(float))) {
+                break;
+            }
+            ::close(fd);
+            fd = -1;
+            if (!reused) {
+                break;
+            }
+        }
+        if (fd < 0) {
+            result.shards_failed++;
+            result.partitions_missed += shard_partitions[s].size();
+            continue;
+        }
+        sent.push_back(static_cast<int>(s));
+        fds.push_back(fd);
+        request_ids.push_back(request.request_id);
+    }
+    
+    // Gather: every shard searches in parallel, so reading them in turn
+    // against the shared deadline waits at most for the slowest one
+    TopKHeap results;
+    results.reset(k, index_->metric() != Metric::L2);
+    std::vector<float> shard_distances;
+    std::vector<int64_t> shard_ids;
+    for (size_t i = 0; i < sent.size(); i++) {
+        const int s = sent[i];
+        const int fd = fds[i];
+        
+        ResponseHeader response;
+        bool ok = read_until(fd, &response, sizeof(response), deadline) &&
+                  response.magic == kResponseMagic && response.status == 0 &&
+                  response.request_id == request_ids[i] && response.count >= 0 && response.count <= k;
+        if (ok) {
+            shard_distances.resize(response.count);
+            shard_ids.resize(response.count);
+            ok = read_until(fd, shard_distances.data(), response.count * sizeof(float), deadline) &&
+                 read_until(fd, shard_ids.data(), response.count * sizeof(int64_t), deadline);
+        }
+        if (!ok) {
+            // A late answer would be read by the next search, so the connection is dropped
+            ::close(fd);
+            result.shards_failed++;
+            result.partitions_missed += shard_partitions[s].size();
+            continue;
+        }
+        
+        release(s, fd);
+        
+        // Replicated vectors may come back from several shards
+        for (int j = 0; j < response.count; j++) {
+            results.push(shard_distances[j], shard_ids[j], true);
+        }
+    }
+    
+    const bool ok = result.shards_failed == 0 || options_.partial_results == PartialResults::ALLOW;
+    if (!ok) {
+        results.reset(k, index_->metric() != Metric::L2);
+    }
+    results.finish(indices, distances);
+    
+    if (status) {
+        *status = result;
+    }
+    return ok;
+}
+
+} // namespace pyramid
@@ -1,10 +1,24 @@
 #include "../include/similarity.h"
 #include <cmath>
 #include <algorithm>
+#include <limits>
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define PYRAMID_X86_DISPATCH 1
+#include <immintrin.h>
+#endif
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 namespace pyramid {
 
-float euclidean_distance(const float* a, const float* b, int dim) {
+namespace {
+
+// Scalar kernels, also used for the tails of the SIMD kernels
+
+float l2sqr_scalar(const float* a, const float* b, int dim) {
     float dist = 0.0f;
     for (int i = 0; i < dim; i++) {
         float diff = a[i] - b[i];
@@ -13,16 +27,212 @@ float euclidean_distance(const float* a, const float* b, int dim) {
     return dist;
 }
 
-float angular_distance(const float* a, const float* b, int dim) {
-    float dot_product = 0.0f;
-    float norm_a = 0.0f;
-    float norm_b = 0.0f;
-    
+float inner_product_scalar(const float* a, const float* b, int dim) {
+    float dot = 0.0f;
     for (int i = 0; i < dim; i++) {
-        dot_product += a[i] * b[i];
-        norm_a += a[i] * a[i];
-        norm_b += b[i] * b[i];
+        dot += a[i] * b[i];
+    }
+    return dot;
+}
+
+#ifdef PYRAMID_X86_DISPATCH
+
+__attribute__((target("sse3")))
+float horizontal_sum(__m128 v) {
+    __m128 shuf = _mm_movehdup_ps(v);
+    __m128 sums = _mm_add_ps(v, shuf);
+    shuf = _mm_movehl_ps(shuf, sums);
+    sums = _mm_add_ss(sums, shuf);
+    return _mm_cvtss_f32(sums);
+}
+
+__attribute__((target("sse3")))
+float l2sqr_sse(const float* a, const float* b, int dim) {
+    __m128 sum = _mm_setzero_ps();
+    int i = 0;
+    for (; i + 4 <= dim; i += 4) {
+        const __m128 diff = _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i));
+        sum = _mm_add_ps(sum, _mm_mul_ps(diff, diff));
+    }
+    return horizontal_sum(sum) + l2sqr_scalar(a + i, b + i, dim - i);
+}
+
+__attribute__((target("sse3")))
+float inner_product_sse(const float* a, const float* b, int dim) {
+    __m128 sum = _mm_setzero_ps();
+    int i = 0;
+    for (; i + 4 <= dim; i += 4) {
+        sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+    }
+    return horizontal_sum(sum) + inner_product_scalar(a + i, b + i, dim - i);
+}
+
+__attribute__((target("avx2,fma")))
+float horizontal_sum_avx(__m256 v) {
+    return horizontal_sum(_mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1)));
+}
+
+__attribute__((target("avx2,fma")))
+float l2sqr_avx2(const float* a, const float* b, int dim) {
+    // Two accumulators hide the FMA latency
+    __m256 sum0 = _mm256_setzero_ps();
+    __m256 sum1 = _mm256_setzero_ps();
+    int i = 0;
+    for (; i + 16 <= dim; i += 16) {
+        const __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+        const __m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8));
+        sum0 = _mm256_fmadd_ps(d0, d0, sum0);
+        sum1 = _mm256_fmadd_ps(d1, d1, sum1);
+    }
+    for (; i + 8 <= dim; i += 8) {
+        const __m256 d = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+        sum0 = _mm256_fmadd_ps(d, d, sum0);
+    }
+    return horizontal_sum_avx(_mm256_add_ps(sum0, sum1)) + l2sqr_scalar(a + i, b + i, dim - i);
+}
+
+__attribute__((target("avx2,fma")))
+float inner_product_avx2(const float* a, const float* b, int dim) {
+    __m256 sum0 = _mm256_setzero_ps();
+    __m256 sum1 = _mm256_setzero_ps();
+    int i = 0;
+    for (; i + 16 <= dim; i += 16) {
+        sum0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), sum0);
+        sum1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), sum1);
+    }
+    for (; i + 8 <= dim; i += 8) {
+        sum0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), sum0);
+    }
+    return horizontal_sum_avx(_mm256_add_ps(sum0, sum1)) + inner_product_scalar(a + i, b + i, dim - i);
+}
+
+__attribute__((target("avx512f")))
+float horizontal_sum_avx512(__m512 v) {
+    // Spilling avoids _mm512_reduce_add_ps, which trips -Wuninitialized in some GCC headers
+    alignas(64) float lanes[16];
+    _mm512_store_ps(lanes, v);
+    float sum = 0.0f;
+    for (float lane : lanes) {
+        sum += lane;
     }
+    return sum;
+}
+
+__attribute__((target("avx512f")))
+float l2sqr_avx512(const float* a, const float* b, int dim) {
+    __m512 sum = _mm512_setzero_ps();
+    int i = 0;
+    for (; i + 16 <= dim; i += 16) {
+        const __m512 d = _mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i));
+        sum = _mm512_fmadd_ps(d, d, sum);
+    }
+    if (i < dim) {
+        // Masked loads cover the tail without a scalar loop
+        const __mmask16 mask = static_cast<__mmask16>((1u << (dim - i)) - 1);
+        const __m512 d = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, a + i), _mm512_maskz_loadu_ps(mask, b + i));
+        sum = _mm512_fmadd_ps(d, d, sum);
+    }
+    return horizontal_sum_avx512(sum);
+}
+
+__attribute__((target("avx512f")))
+float inner_product_avx512(const float* a, const float* b, int dim) {
+    __m512 sum = _mm512_setzero_ps();
+    int i = 0;
+    for (; i + 16 <= dim; i += 16) {
+        sum = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), sum);
+    }
+    if (i < dim) {
+        const __mmask16 mask = static_cast<__mmask16>((1u << (dim - i)) - 1);
+        sum = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(mask, a + i), _mm512_maskz_loadu_ps(mask, b + i), sum);
+    }
+    return horizontal_sum_avx512(sum);
+}
+
+#endif // PYRAMID_X86_DISPATCH
+
+// Kernels selected for a SIMD level
+struct Kernels {
+    SimdLevel level;
+    float (*l2sqr)(const float*, const float*, int);
+    float (*inner_product)(const float*, const float*, int);
+};
+
+Kernels kernels_for(SimdLevel level) {
+    switch (level) {
+#ifdef PYRAMID_X86_DISPATCH
+        case SimdLevel::AVX512:
+            return {SimdLevel::AVX512, l2sqr_avx512, inner_product_avx512};
+        case SimdLevel::AVX2:
+            return {SimdLevel::AVX2, l2sqr_avx2, inner_product_avx2};
+        case SimdLevel::SSE:
+            return {SimdLevel::SSE, l2sqr_sse, inner_product_sse};
+#endif
+        default:
+            return {SimdLevel::SCALAR, l2sqr_scalar, inner_product_scalar};
+    }
+}
+
+// Active kernels; chosen from the CPU on first use
+Kernels& active_kernels() {
+    static Kernels kernels = kernels_for(detect_simd_level());
+    return kernels;
+}
+
+} // namespace
+
+SimdLevel detect_simd_level() {
+#ifdef PYRAMID_X86_DISPATCH
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        return SimdLevel::AVX512;
+    }
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        return SimdLevel::AVX2;
+    }
+    if (__builtin_cpu_supports("sse3")) {
+        return SimdLevel::SSE;
+    }
+#endif
+    return SimdLevel::SCALAR;
+}
+
+SimdLevel simd_level() {
+    return active_kernels().level;
+}
+
+SimdLevel set_simd_level(SimdLevel level) {
+    level = std::min(level, detect_simd_level());
+    active_kernels() = kernels_for(level);
+    return active_kernels().level;
+}
+
+const char* simd_level_name(SimdLevel level) {
+    switch (level) {
+        case SimdLevel::AVX512:
+            return "avx512";
+        case SimdLevel::AVX2:
+            return "avx2";
+        case SimdLevel::SSE:
+            return "sse";
+        default:
+            return "scalar";
+    }
+}
+
+float euclidean_distance(const float* a, const float* b, int dim) {
+    return active_kernels().l2sqr(a, b, dim);
+}
+
+float inner_product(const float* a, const float* b, int dim) {
+    return active_kernels().inner_product(a, b, dim);
+}
+
+float angular_distance(const float* a, const float* b, int dim) {
+    const Kernels& kernels = active_kernels();
+    float dot_product = kernels.inner_product(a, b, dim);
+    float norm_a = kernels.inner_product(a, a, dim);
+    float norm_b = kernels.inner_product(b, b, dim);
     
     if (norm_a == 0.0f || norm_b == 0.0f) {
         return 1.0f;  // Maximum distance for zero vectors
@@ -38,29 +248,95 @@ float angular_distance(const float* a, const float* b, int dim) {
     return 1.0f - cosine;
 }
 
-void normalize_vector(float* vec, int dim) {
-    float norm = 0.0f;
+float angular_distance_normalized(const float* a, const float* b, int dim) {
+    const float cosine = active_kernels().inner_product(a, b, dim);
+    return 1.0f - std::max(-1.0f, std::min(1.0f, cosine));
+}
+
+void euclidean_distance_batch(const float* query, const float* data, size_t n, int dim, float* distances) {
+    const auto l2sqr = active_kernels().l2sqr;
+    for (size_t i = 0; i < n; i++) {
+        distances[i] = l2sqr(query, data + i * dim, dim);
+    }
+}
+
+void angular_distance_batch(const float* query, const float* data, size_t n, int dim,
+                            bool normalized, float* distances) {
+    const Kernels& kernels = active_kernels();
+    if (normalized) {
+        for (size_t i = 0; i < n; i++) {
+            const float cosine = kernels.inner_product(query, data + i * dim, dim);
+            distances[i] = 1.0f - std::max(-1.0f, std::min(1.0f, cosine));
+        }
+        return;
+    }
     
-    // Compute L2 norm
-    for (int i = 0; i < dim; i++) {
-        norm += vec[i] * vec[i];
+    // The query norm is computed once for the whole batch
+    const float norm_q = std::sqrt(kernels.inner_product(query, query, dim));
+    for (size_t i = 0; i < n; i++) {
+        const float* vec = data + i * dim;
+        const float norm_v = std::sqrt(kernels.inner_product(vec, vec, dim));
+        if (norm_q == 0.0f || norm_v == 0.0f) {
+            distances[i] = 1.0f;
+            continue;
+        }
+        const float cosine = kernels.inner_product(query, vec, dim) / (norm_q * norm_v);
+        distances[i] = 1.0f - std::max(-1.0f, std::min(1.0f, cosine));
     }
+}
+
+void euclidean_distance_matrix(const float* queries, size_t nq, const float* data, size_t n, int dim,
+                               float* distances) {
+    const auto l2sqr = active_kernels().l2sqr;
     
-    norm = std::sqrt(norm);
+    // Blocks of data rows stay in cache while every query of a block visits them
+    const size_t block = 256;
+#pragma omp parallel for schedule(dynamic, 1) collapse(2) if (nq * n > 16384)
+    for (size_t qb = 0; qb < nq; qb += 16) {
+        for (size_t db = 0; db < n; db += block) {
+            const size_t q_end = std::min(qb + 16, nq);
+            const size_t d_end = std::min(db + block, n);
+            for (size_t q = qb; q < q_end; q++) {
+                for (size_t i = db; i < d_end; i++) {
+                    distances[q * n + i] = l2sqr(queries + q * dim, data + i * dim, dim);
+                }
+            }
+        }
+    }
+}
+
+void euclidean_distance_by_ids(const float* query, const float* data, size_t stride, int dim,
+                               const int64_t* ids, size_t n, float* distances) {
+    const auto l2sqr = active_kernels().l2sqr;
+    for (size_t i = 0; i < n; i++) {
+        // Rows are scattered, so fetch the next one while this one is computed
+        if (i + 1 < n && ids[i + 1] >= 0) {
+            __builtin_prefetch(data + ids[i + 1] * stride);
+        }
+        distances[i] = ids[i] >= 0 ? l2sqr(query, data + ids[i] * stride, dim)
+                                   : std::numeric_limits<float>::max();
+    }
+}
+
+void normalize_vector(float* vec, int dim) {
+    // Compute L2 norm
+    float norm = std::sqrt(active_kernels().inner_product(vec, vec, dim));
     
     // Avoid division by zero
     if (norm > 0.0f) {
+        const float scale = 1.0f / norm;
         for (int i = 0; i < dim; i++) {
-            vec[i] /= norm;
+            vec[i] *= scale;
         }
     }
 }
 
 void normalize_dataset(float* data, size_t n, int dim) {
-    // Normalize each vector
+    // Normalize each vector; rows are independent
+#pragma omp parallel for schedule(static) if (n > 1024)
     for (size_t i = 0; i < n; i++) {
         normalize_vector(data + i * dim, dim);
     }
 }
 
-} // namespace pyramid 
\ No newline at end of file
+} // namespace pyramid
@@ -0,0 +1,294 @@
+#include <iostream>
+#include <atomic>
+#include <vector>
+#include <string>
+#include <random>
+#include <thread>
+#include <chrono>
+#include <cmath>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <memory>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "../include/pyramid.h"
+#include "../include/shard.h"
+
+// Scatter-gather search against shard workers running in child processes.
+//
+// The test builds and saves a small index, then starts each worker as
+// "shard_test serve INDEX SOCKET FIRST LAST" and checks that the router
+// returns what PyramidGraph::search() returns, that a stalled worker is cut
+// off by the deadline under both PartialResults policies, and that the
+// router reconnects to a worker that was restarted.
+
+namespace {
+
+const int kDim = 16;
+const int kClusters = 8;
+const size_t kVectors = 4000;
+const int kQueries = 50;
+const int kK = 10;
+
+std::atomic<int> failures{0};  // Checks failed on any thread
+
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": check failed: " #condition << std::endl; \
+            failures++; \
+        } \
+    } while (0)
+
+pyramid::ShardServer* active_server = nullptr;  // Stopped by SIGTERM
+
+void stop_server(int) {
+    if (active_server) {
+        active_server->stop();
+    }
+}
+
+// Worker process: serve partitions first..last of the saved index
+int run_worker(const std::string& index_path, const std::string& socket_path, int first, int last) {
+    std::vector<int> partitions;
+    for (int c = first; c <= last; c++) {
+        partitions.push_back(c);
+    }
+    pyramid::LoadOptions options;
+    options.partitions = &partitions;
+    auto index = pyramid::PyramidGraph::load(index_path, options);
+    if (!index) {
+        return 1;
+    }
+    
+    pyramid::ShardServer server(*index);
+    if (!server.listen(socket_path)) {
+        return 1;
+    }
+    active_server = &server;
+    std::signal(SIGTERM, stop_server);
+    server.serve();
+    active_server = nullptr;
+    return 0;
+}
+
+// A worker child process and the arguments it was started with
+struct Worker {
+    std::string socket_path;
+    int first = 0;
+    int last = 0;
+    pid_t pid = -1;
+};
+
+// True once something accepts connections on the socket path
+bool accepts_connections(const std::string& path) {
+    sockaddr_un address;
+    std::memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    std::strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+    
+    const int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return false;
+    }
+    const bool connected = ::connect(fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) == 0;
+    ::close(fd);
+    return connected;
+}
+
+// Fork and exec a worker, then wait until it listens
+bool start_worker(const std::string& index_path, Worker& worker) {
+    const std::string first = std::to_string(worker.first);
+    const std::string last = std::to_string(worker.last);
+    
+    // exec keeps the child clear of the parent's OpenMP threads
+    worker.pid = ::fork();
+    if (worker.pid == 0) {
+        ::execl("/proc/self/exe", "shard_test", "serve", index_path.c_str(), worker.socket_path.c_str(),
+                first.c_str(), last.c_str(), static_cast<char*>(nullptr));
+        std::_Exit(127);
+    }
+    if (worker.pid < 0) {
+        return false;
+    }
+    
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(30);
+    while (std::chrono::steady_clock::now() < deadline) {
+        if (accepts_connections(worker.socket_path)) {
+            return true;
+        }
+        int status = 0;
+        if (::waitpid(worker.pid, &status, WNOHANG) == worker.pid) {
+            worker.pid = -1;
+            return false;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+    return false;
+}
+
+void stop_worker(Worker& worker, int signal) {
+    if (worker.pid > 0) {
+        ::kill(worker.pid, signal);
+        ::waitpid(worker.pid, nullptr, 0);
+        worker.pid = -1;
+    }
+}
+
+// Router results must be the ones of a local search over the same partitions
+void check_matches(const pyramid::PyramidGraph& index, const pyramid::ShardRouter& router,
+                   const std::vector<float>& queries, const pyramid::SearchParams& params, int first, int count) {
+    std::vector<int> expected_ids(kK);
+    std::vector<float> expected_distances(kK);
+    std::vector<int> ids(kK);
+    std::vector<float> distances(kK);
+    
+    for (int q = first; q < first + count; q++) {
+        const float* query = queries.data() + static_cast<size_t>(q) * kDim;
+        index.search(query, kK, expected_ids.data(), expected_distances.data(), &params);
+        
+        pyramid::ShardSearchStatus status;
+        CHECK(router.search(query, kK, ids.data(), distances.data(), &params, &status));
+        CHECK(status.shards_queried == 2);
+        CHECK(status.shards_failed == 0);
+        CHECK(status.partitions_missed == 0);
+        CHECK(ids == expected_ids);
+        for (int j = 0; j < kK; j++) {
+            CHECK(std::fabs(distances[j] - expected_distances[j]) <= 1e-4f * (1.0f + std::fabs(expected_distances[j])));
+        }
+    }
+}
+
+// Stall worker 1, search under a policy, and check the deadline and outcome
+void check_timeout(const std::vector<float>& queries, const pyramid::SearchParams& params,
+                   Worker& stalled, pyramid::PartialResults policy,
+                   const std::string& index_path, const std::vector<pyramid::ShardEndpoint>& shards) {
+    const std::vector<int> no_partitions;
+    pyramid::RouterOptions options;
+    options.timeout_ms = 200;
+    options.partial_results = policy;
+    pyramid::ShardRouter router(pyramid::PyramidGraph::load(index_path, true, &no_partitions), shards, options);
+    
+    std::vector<int> ids(kK);
+    std::vector<float> distances(kK);
+    ::kill(stalled.pid, SIGSTOP);
+    const auto start = std::chrono::steady_clock::now();
+    pyramid::ShardSearchStatus status;
+    const bool ok = router.search(queries.data(), kK, ids.data(), distances.data(), &params, &status);
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    ::kill(stalled.pid, SIGCONT);
+    
+    CHECK(seconds < 2.0);
+    CHECK(status.shards_queried == 2);
+    CHECK(status.shards_failed == 1);
+    CHECK(status.partitions_missed == stalled.last - stalled.first + 1);
+    if (policy == pyramid::PartialResults::ALLOW) {
+        CHECK(ok);
+        CHECK(ids[0] >= 0);
+    } else {
+        CHECK(!ok);
+        for (int j = 0; j < kK; j++) {
+            CHECK(ids[j] == -1);
+        }
+    }
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    if (argc == 6 && std::string(argv[1]) == "serve") {
+        return run_worker(argv[2], argv[3], std::atoi(argv[4]), std::atoi(argv[5]));
+    }
+    
+    char directory_template[] = "/tmp/pyramid-shard-test-XXXXXX";
+    if (!::mkdtemp(directory_template)) {
+        std::cerr << "Error creating a temporary directory" << std::endl;
+        return 1;
+    }
+    const std::filesystem::path directory = directory_template;
+    const std::string index_path = (directory / "index.bin").string();
+    
+    // Gaussian data, queries drawn like the base vectors
+    std::mt19937 rng(42);
+    std::normal_distribution<float> normal(0.0f, 1.0f);
+    std::vector<float> data(kVectors * kDim);
+    std::vector<float> queries(static_cast<size_t>(kQueries) * kDim);
+    for (float& x : data) {
+        x = normal(rng);
+    }
+    for (float& x : queries) {
+        x = normal(rng);
+    }
+    
+    pyramid::PyramidGraph index(kDim, kClusters, 16, 40, 64);
+    index.build(data.data(), kVectors);
+    if (!index.save(index_path)) {
+        std::filesystem::remove_all(directory);
+        return 1;
+    }
+    
+    std::vector<Worker> workers(2);
+    workers[0].socket_path = (directory / "shard0.sock").string();
+    workers[0].first = 0;
+    workers[0].last = kClusters / 2 - 1;
+    workers[1].socket_path = (directory / "shard1.sock").string();
+    workers[1].first = kClusters / 2;
+    workers[1].last = kClusters - 1;
+    std::vector<pyramid::ShardEndpoint> shards(2);
+    for (size_t s = 0; s < workers.size(); s++) {
+        shards[s].socket_path = workers[s].socket_path;
+        for (int c = workers[s].first; c <= workers[s].last; c++) {
+            shards[s].partitions.push_back(c);
+        }
+    }
+    
+    bool started = true;
+    for (Worker& worker : workers) {
+        started = start_worker(index_path, worker) && started;
+    }
+    CHECK(started);
+    
+    if (started) {
+        // Every partition is probed, so both shards take part in each search
+        pyramid::SearchParams params;
+        params.nprobe = kClusters;
+        const std::vector<int> no_partitions;
+        pyramid::ShardRouter router(pyramid::PyramidGraph::load(index_path, true, &no_partitions), shards);
+        check_matches(index, router, queries, params, 0, kQueries);
+        
+        // Concurrent searches each take their own connections
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 4; t++) {
+            threads.emplace_back(check_matches, std::cref(index), std::cref(router), std::cref(queries),
+                                 std::cref(params), t * (kQueries / 4), kQueries / 4);
+        }
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+        
+        check_timeout(queries, params, workers[1], pyramid::PartialResults::ALLOW, index_path, shards);
+        check_timeout(queries, params, workers[1], pyramid::PartialResults::FAIL, index_path, shards);
+        
+        // The pooled connections to a killed worker are stale; the router must reconnect
+        stop_worker(workers[0], SIGKILL);
+        CHECK(start_worker(index_path, workers[0]));
+        check_matches(index, router, queries, params, 0, kQueries);
+    }
+    
+    for (Worker& worker : workers) {
+        stop_worker(worker, SIGTERM);
+    }
+    std::filesystem::remove_all(directory);
+    
+    if (failures > 0) {
+        std::cerr << failures << " check(s) failed" << std::endl;
+        return 1;
+    }
+    std::cout << "All shard checks passed" << std::endl;
+    return 0;
+}
@@ -0,0 +1,172 @@
+#include <iostream>
+#include <vector>
+#include <string>
+#include <random>
+#include <cstdlib>
+#include <filesystem>
+#include <memory>
+
+#include "../include/pyramid.h"
+
+// Updates and the on-disk format on one small index.
+//
+// The test builds an index, removes and adds vectors, compacts it with a
+// size limit that splits partitions, saves and loads it (copied and mapped)
+// and checks after every step that removed ids are gone, live ids are found
+// and the loaded index answers exactly like the one it was saved from.
+// Finally it rebuilds the compacted index and checks that no state of the
+// updates survives the new build.
+
+namespace {
+
+const int kDim = 16;
+const int kClusters = 8;
+const size_t kVectors = 3000;
+const size_t kRemoved = 500;   // Ids 0 .. kRemoved - 1 are removed
+const size_t kAdded = 500;     // Ids kVectors .. kVectors + kAdded - 1 are added
+const int kK = 10;
+
+int failures = 0;
+
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": check failed: " #condition << std::endl; \
+            failures++; \
+        } \
+    } while (0)
+
+// Probe every partition so that exact matches are always reachable
+pyramid::SearchParams full_probe(const pyramid::PyramidGraph& index) {
+    pyramid::SearchParams params;
+    params.nprobe = index.num_partitions();
+    params.ef_search = 128;
+    return params;
+}
+
+// Search for a stored vector and return its top k ids
+std::vector<int> neighbors(const pyramid::PyramidGraph& index, const float* vector) {
+    const pyramid::SearchParams params = full_probe(index);
+    std::vector<int> ids(kK);
+    std::vector<float> distances(kK);
+    index.search(vector, kK, ids.data(), distances.data(), &params);
+    return ids;
+}
+
+// Removed ids never come back; live vectors find themselves first
+void check_contents(const pyramid::PyramidGraph& index, const std::vector<float>& vectors, size_t live_end) {
+    for (size_t id = 0; id < live_end; id += 37) {
+        const std::vector<int> ids = neighbors(index, vectors.data() + id * kDim);
+        for (int found : ids) {
+            CHECK(found < 0 || static_cast<size_t>(found) >= kRemoved);
+        }
+        if (id >= kRemoved) {
+            CHECK(ids[0] == static_cast<int>(id));
+        }
+    }
+}
+
+// Two indexes give identical answers to the same queries
+void check_same_answers(const pyramid::PyramidGraph& expected, const pyramid::PyramidGraph& actual,
+                        const std::vector<float>& queries, size_t num_queries) {
+    CHECK(actual.ntotal() == expected.ntotal());
+    CHECK(actual.num_partitions() == expected.num_partitions());
+    
+    const pyramid::SearchParams params = full_probe(expected);
+    std::vector<int> expected_ids(kK);
+    std::vector<int> ids(kK);
+    std::vector<float> expected_distances(kK);
+    std::vector<float> distances(kK);
+    for (size_t q = 0; q < num_queries; q++) {
+        expected.search(queries.data() + q * kDim, kK, expected_ids.data(), expected_distances.data(), &params);
+        actual.search(queries.data() + q * kDim, kK, ids.data(), distances.data(), &params);
+        CHECK(ids == expected_ids);
+        CHECK(distances == expected_distances);
+    }
+}
+
+} // namespace
+
+int main() {
+    char directory_template[] = "/tmp/pyramid-update-test-XXXXXX";
+    if (!::mkdtemp(directory_template)) {
+        std::cerr << "Error creating a temporary directory" << std::endl;
+        return 1;
+    }
+    const std::filesystem::path directory = directory_template;
+    const std::string index_path = (directory / "index.bin").string();
+    
+    // Base vectors followed by the vectors added later, with ids equal to their row
+    std::mt19937 rng(7);
+    std::normal_distribution<float> normal(0.0f, 1.0f);
+    std::vector<float> vectors((kVectors + kAdded) * kDim);
+    for (float& x : vectors) {
+        x = normal(rng);
+    }
+    const size_t num_queries = 50;
+    std::vector<float> queries(num_queries * kDim);
+    for (float& x : queries) {
+        x = normal(rng);
+    }
+    
+    pyramid::PyramidGraph index(kDim, kClusters, 16, 40, 64);
+    index.build(vectors.data(), kVectors);
+    CHECK(index.ntotal() == kVectors);
+    check_contents(index, vectors, kVectors);
+    
+    std::vector<faiss::idx_t> removed(kRemoved);
+    for (size_t i = 0; i < kRemoved; i++) {
+        removed[i] = static_cast<faiss::idx_t>(i);
+    }
+    CHECK(index.remove(removed.size(), removed.data()) == kRemoved);
+    CHECK(index.ntotal() == kVectors - kRemoved);
+    check_contents(index, vectors, kVectors);
+    
+    std::vector<faiss::idx_t> added(kAdded);
+    for (size_t i = 0; i < kAdded; i++) {
+        added[i] = static_cast<faiss::idx_t>(kVectors + i);
+    }
+    index.add(kAdded, vectors.data() + kVectors * kDim, added.data());
+    CHECK(index.ntotal() == kVectors - kRemoved + kAdded);
+    check_contents(index, vectors, kVectors + kAdded);
+    
+    // Partitions average 375 entries, so a limit of 300 splits most of them
+    pyramid::CompactParams compact_params;
+    compact_params.max_partition_size = 300;
+    compact_params.max_deleted_fraction = 0.05f;
+    CHECK(index.compact(compact_params) > 0);
+    CHECK(index.num_partitions() > kClusters);
+    CHECK(index.ntotal() == kVectors - kRemoved + kAdded);
+    check_contents(index, vectors, kVectors + kAdded);
+    
+    CHECK(index.save(index_path));
+    for (bool use_mmap : {false, true}) {
+        std::unique_ptr<pyramid::PyramidGraph> loaded = pyramid::PyramidGraph::load(index_path, use_mmap);
+        CHECK(loaded != nullptr);
+        if (loaded) {
+            check_same_answers(index, *loaded, queries, num_queries);
+            check_contents(*loaded, vectors, kVectors + kAdded);
+        }
+    }
+    
+    // A rebuild starts over: configured partitions, every base id, none of the added ones
+    index.build(vectors.data(), kVectors);
+    CHECK(index.num_partitions() == kClusters);
+    CHECK(index.ntotal() == kVectors);
+    for (size_t id = 0; id < kVectors; id += 37) {
+        const std::vector<int> ids = neighbors(index, vectors.data() + id * kDim);
+        CHECK(ids[0] == static_cast<int>(id));
+        for (int found : ids) {
+            CHECK(found < static_cast<int>(kVectors));
+        }
+    }
+    
+    std::filesystem::remove_all(directory);
+    
+    if (failures > 0) {
+        std::cerr << failures << " check(s) failed" << std::endl;
+        return 1;
+    }
+    std::cout << "All update checks passed" << std::endl;
+    return 0;
+}
@@ -0,0 +1,494 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <unordered_set>
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <cstdlib>
+#include <memory>
+
+#include <faiss/IndexFlat.h>
+
+#include "../include/pyramid.h"
+#include "../include/dataset.h"
+#include "../include/similarity.h"
+#include "../include/query_engine.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+// Parameter sweep benchmark for PyramidGraph.
+//
+// Every combination of --clusters, --m and --efc is built once; every
+// combination of --efs, --nprobe, --k and --threads is then searched on it.
+// One row per search configuration is written as CSV or JSON with build time,
+// index memory, recall@1/10/100, QPS and per-query latency percentiles.
+
+namespace {
+
+using Clock = std::chrono::high_resolution_clock;
+
+struct BenchOptions {
+    std::string base_path;
+    std::string query_path;
+    std::string groundtruth_path;       // Empty: exact neighbors are computed with IndexFlat
+    std::string output_path;            // Empty: write to stdout
+    std::string format = "csv";         // csv or json
+    std::vector<int> clusters = {10};
+    std::vector<int> m = {32};
+    std::vector<int> ef_construction = {40};
+    std::vector<int> ef_search = {16};
+    std::vector<int> nprobe = {2};
+    std::vector<int> k = {100};
+    std::vector<int> threads = {0};     // 0: all OpenMP threads
+    std::vector<int> routing_levels;    // Empty: route through the meta-HNSW
+    pyramid::Metric metric = pyramid::Metric::L2;
+    pyramid::VectorTransform transform = pyramid::VectorTransform::NONE;
+    int transform_dim = 0;              // 0: dim / 4
+    bool adaptive = false;
+    bool engine = false;                // Serve queries through a QueryEngine instead of OpenMP
+    bool balanced = false;
+    bool stream = false;                // Build with build_from_file() from the base file
+    bool locality = false;              // Reorder the sub-HNSW nodes breadth-first
+};
+
+struct BenchResult {
+    int clusters;
+    int m;
+    int ef_construction;
+    int ef_search;
+    int nprobe;
+    int k;
+    int threads;
+    double build_ms;
+    size_t index_bytes;
+    double recall_1;                    // Negative when k or the ground truth is too small
+    double recall_10;
+    double recall_100;
+    double qps;
+    double p50_us;
+    double p95_us;
+    double p99_us;
+    double p999_us;
+};
+
+void print_usage(const char* program) {
+    std::cerr << "Usage: " << program << " --base FILE --query FILE [options]\n"
+              << "  --groundtruth FILE  ivecs ground truth (default: exact search)\n"
+              << "  --clusters LIST     Number of partitions (default: 10)\n"
+              << "  --m LIST            HNSW degree (default: 32)\n"
+              << "  --efc LIST          efConstruction (default: 40)\n"
+              << "  --efs LIST          Sub-HNSW efSearch (default: 16)\n"
+              << "  --nprobe LIST       Partitions probed per query (default: 2)\n"
+              << "  --k LIST            Neighbors per query (default: 100)\n"
+              << "  --threads LIST      Search threads, 0 for all (default: 0)\n"
+              << "  --adaptive          Enable adaptive probing\n"
+              << "  --engine            Submit queries to a partition-affine QueryEngine\n"
+              << "  --balanced          Enable balanced partitioning\n"
+              << "  --stream            Build out of core from the base file with build_from_file()\n"
+              << "  --locality          Reorder sub-HNSW nodes breadth-first for memory locality\n"
+              << "  --levels LIST       Routing tree level sizes, coarsest first (default: none)\n"
+              << "  --metric l2|ip|cosine  Index metric (default: l2)\n"
+              << "  --transform pca|opq Route and search reduced vectors, re-ranked with the base vectors\n"
+              << "  --transform-dim N   Reduced dimension (default: dim / 4)\n"
+              << "  --format csv|json   Output format (default: csv)\n"
+              << "  --output FILE       Output file (default: stdout)\n"
+              << "LIST is a comma separated list of integers, e.g. 8,16,32" << std::endl;
+}
+
+bool parse_list(const std::string& text, std::vector<int>& values, int min_value = 1) {
+    values.clear();
+    std::stringstream stream(text);
+    std::string item;
+    while (std::getline(stream, item, ',')) {
+        char* end = nullptr;
+        const long value = std::strtol(item.c_str(), &end, 10);
+        if (item.empty() || *end != '\0' || value < min_value) {
+            std::cerr << "Error: invalid list value '" << item << "'" << std::endl;
+            return false;
+        }
+        values.push_back(static_cast<int>(value));
+    }
+    return !values.empty();
+}
+
+bool parse_options(int argc, char** argv, BenchOptions& options) {
+    for (int i = 1; i < argc; i++) {
+        const std::string arg = argv[i];
+        if (arg == "--adaptive") {
+            options.adaptive = true;
+            continue;
+        }
+        if (arg == "--engine") {
+            options.engine = true;
+            continue;
+        }
+        if (arg == "--balanced") {
+            options.balanced = true;
+            continue;
+        }
+        if (arg == "--stream") {
+            options.stream = true;
+            continue;
+        }
+        if (arg == "--locality") {
+            options.locality = true;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            std::cerr << "Error: missing value for " << arg << std::endl;
+            return false;
+        }
+        
+        const std::string value = argv[++i];
+        bool ok = true;
+        if (arg == "--base") {
+            options.base_path = value;
+        } else if (arg == "--query") {
+            options.query_path = value;
+        } else if (arg == "--groundtruth") {
+            options.groundtruth_path = value;
+        } else if (arg == "--output") {
+            options.output_path = value;
+        } else if (arg == "--metric") {
+            if (value == "l2") {
+                options.metric = pyramid::Metric::L2;
+            } else if (value == "ip") {
+                options.metric = pyramid::Metric::INNER_PRODUCT;
+            } else if (value == "cosine") {
+                options.metric = pyramid::Metric::COSINE;
+            } else {
+                ok = false;
+            }
+        } else if (arg == "--transform") {
+            if (value == "pca") {
+                options.transform = pyramid::VectorTransform::PCA;
+            } else if (value == "opq") {
+                options.transform = pyramid::VectorTransform::OPQ;
+            } else {
+                ok = false;
+            }
+        } else if (arg == "--transform-dim") {
+            std::vector<int> values;
+            ok = parse_list(value, values) && values.size() == 1;
+            options.transform_dim = ok ? values[0] : 0;
+        } else if (arg == "--format") {
+            options.format = value;
+            ok = value == "csv" || value == "json";
+        } else if (arg == "--clusters") {
+            ok = parse_list(value, options.clusters);
+        } else if (arg == "--m") {
+            ok = parse_list(value, options.m);
+        } else if (arg == "--efc") {
+            ok = parse_list(value, options.ef_construction);
+        } else if (arg == "--efs") {
+            ok = parse_list(value, options.ef_search);
+        } else if (arg == "--nprobe") {
+            ok = parse_list(value, options.nprobe);
+        } else if (arg == "--k") {
+            ok = parse_list(value, options.k);
+        } else if (arg == "--threads") {
+            ok = parse_list(value, options.threads, 0);
+        } else if (arg == "--levels") {
+            ok = parse_list(value, options.routing_levels);
+        } else {
+            std::cerr << "Error: unknown option " << arg << std::endl;
+            return false;
+        }
+        if (!ok) {
+            std::cerr << "Error: invalid value for " << arg << std::endl;
+            return false;
+        }
+    }
+    return !options.base_path.empty() && !options.query_path.empty();
+}
+
+bool load_vectors(const std::string& filename, std::vector<float>& data, size_t& num_vectors, int& dim) {
+    pyramid::VecsFile file;
+    if (!file.open(filename) || !file.validate()) {
+        return false;
+    }
+    
+    num_vectors = file.num_vectors();
+    dim = file.dim();
+    data.resize(num_vectors * dim);
+    file.read_rows(0, num_vectors, data.data());
+    return true;
+}
+
+// Fraction of the true r nearest neighbors found among the first r results,
+// or -1 when fewer than r results or ground truth neighbors are available
+double recall_at(const std::vector<int>& results, int k, const std::vector<int>& groundtruth,
+                 int gt_k, size_t nq, int r) {
+    if (r > k || r > gt_k) {
+        return -1.0;
+    }
+    
+    size_t correct = 0;
+    for (size_t q = 0; q < nq; q++) {
+        const int* truth = groundtruth.data() + q * gt_k;
+        std::unordered_set<int> true_neighbors(truth, truth + r);
+        for (int j = 0; j < r; j++) {
+            if (true_neighbors.count(results[q * k + j])) {
+                correct++;
+            }
+        }
+    }
+    return static_cast<double>(correct) / (nq * r);
+}
+
+double percentile(const std::vector<double>& sorted, double p) {
+    if (sorted.empty()) {
+        return 0.0;
+    }
+    const size_t rank = static_cast<size_t>(p * (sorted.size() - 1) + 0.5);
+    return sorted[std::min(rank, sorted.size() - 1)];
+}
+
+// Fill in QPS and latency percentiles from per-query latencies
+void summarize_latencies(std::vector<double>& latencies, double wall_ms, BenchResult& result) {
+    std::sort(latencies.begin(), latencies.end());
+    result.qps = wall_ms > 0 ? latencies.size() / (wall_ms / 1000.0) : 0.0;
+    result.p50_us = percentile(latencies, 0.50);
+    result.p95_us = percentile(latencies, 0.95);
+    result.p99_us = percentile(latencies, 0.99);
+    result.p999_us = percentile(latencies, 0.999);
+}
+
+// Run every query through PyramidGraph::search() on the given number of threads
+// (or through a QueryEngine with that many workers), recording per-query
+// latency; the neighbors are returned in indices (nq * k)
+void run_queries(const pyramid::PyramidGraph& index, const std::vector<float>& queries, size_t nq, int dim,
+                 int k, int threads, bool engine, const pyramid::SearchParams& params,
+                 std::vector<int>& indices, BenchResult& result) {
+    indices.assign(nq * k, -1);
+    std::vector<float> distances(nq * k);
+    std::vector<double> latencies(nq);
+    
+    // Engine mode: every query is submitted at once, so latency includes queueing
+    if (engine) {
+        pyramid::QueryEngineParams engine_params;
+        engine_params.num_threads = threads;
+        const auto start = Clock::now();
+        {
+            pyramid::QueryEngine query_engine(index, engine_params);
+            for (size_t q = 0; q < nq; q++) {
+                const auto submitted = Clock::now();
+                query_engine.submit(queries.data() + q * dim, k, [&, q, submitted](pyramid::QueryResult&& r) {
+                    std::copy(r.indices.begin(), r.indices.end(), indices.begin() + q * k);
+                    latencies[q] = std::chrono::duration<double, std::micro>(Clock::now() - submitted).count();
+                }, &params);
+            }
+        }
+        const double wall_ms = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+        
+        summarize_latencies(latencies, wall_ms, result);
+        return;
+    }
+
+#ifdef _OPENMP
+    const int saved_threads = omp_get_max_threads();
+    if (threads > 0) {
+        omp_set_num_threads(threads);
+    }
+#else
+    static_cast<void>(threads);
+#endif
+    
+    const auto start = Clock::now();
+#pragma omp parallel for schedule(dynamic, 16)
+    for (size_t q = 0; q < nq; q++) {
+        const auto query_start = Clock::now();
+        index.search(queries.data() + q * dim, k, indices.data() + q * k, distances.data() + q * k, &params);
+        latencies[q] = std::chrono::duration<double, std::micro>(Clock::now() - query_start).count();
+    }
+    const double wall_ms = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+
+#ifdef _OPENMP
+    omp_set_num_threads(saved_threads);
+#endif
+    
+    summarize_latencies(latencies, wall_ms, result);
+}
+
+void write_csv(std::ostream& out, const std::vector<BenchResult>& results) {
+    out << "clusters,m,ef_construction,ef_search,nprobe,k,threads,build_ms,index_bytes,"
+        << "recall_1,recall_10,recall_100,qps,p50_us,p95_us,p99_us,p999_us\n";
+    out << std::fixed;
+    for (const BenchResult& r : results) {
+        out << r.clusters << ',' << r.m << ',' << r.ef_construction << ',' << r.ef_search << ','
+            << r.nprobe << ',' << r.k << ',' << r.threads << ','
+            << std::setprecision(1) << r.build_ms << ',' << r.index_bytes << ','
+            << std::setprecision(4) << r.recall_1 << ',' << r.recall_10 << ',' << r.recall_100 << ','
+            << std::setprecision(1) << r.qps << ',' << r.p50_us << ',' << r.p95_us << ','
+            << r.p99_us << ',' << r.p999_us << '\n';
+    }
+}
+
+void write_json(std::ostream& out, const std::vector<BenchResult>& results) {
+    out << "[\n" << std::fixed;
+    for (size_t i = 0; i < results.size(); i++) {
+        const BenchResult& r = results[i];
+        out << "  {\"clusters\": " << r.clusters << ", \"m\": " << r.m
+            << ", \"ef_construction\": " << r.ef_construction << ", \"ef_search\": " << r.ef_search
+            << ", \"nprobe\": " << r.nprobe << ", \"k\": " << r.k << ", \"threads\": " << r.threads
+            << std::setprecision(1) << ", \"build_ms\": " << r.build_ms
+            << ", \"index_bytes\": " << r.index_bytes
+            << std::setprecision(4) << ", \"recall_1\": " << r.recall_1
+            << ", \"recall_10\": " << r.recall_10 << ", \"recall_100\": " << r.recall_100
+            << std::setprecision(1) << ", \"qps\": " << r.qps
+            << ", \"p50_us\": " << r.p50_us << ", \"p95_us\": " << r.p95_us
+            << ", \"p99_us\": " << r.p99_us << ", \"p999_us\": " << r.p999_us << "}"
+            << (i + 1 < results.size() ? ",\n" : "\n");
+    }
+    out << "]\n";
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    BenchOptions options;
+    if (!parse_options(argc, argv, options)) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    
+    size_t num_base = 0, num_queries = 0;
+    int dim = 0, query_dim = 0;
+    std::vector<float> base_vectors, query_vectors;
+    if (!load_vectors(options.base_path, base_vectors, num_base, dim) ||
+        !load_vectors(options.query_path, query_vectors, num_queries, query_dim)) {
+        return 1;
+    }
+    if (query_dim != dim) {
+        std::cerr << "Error: query dimension " << query_dim << " does not match base dimension " << dim << std::endl;
+        return 1;
+    }
+    std::cerr << "Loaded " << num_base << " base and " << num_queries << " query vectors of dimension "
+              << dim << std::endl;
+    
+    // Ground truth: the given ivecs file, or exact search up to the largest recall depth
+    const int max_k = *std::max_element(options.k.begin(), options.k.end());
+    int gt_k = std::min<int>(std::max(100, max_k), static_cast<int>(num_base));
+    std::vector<int> groundtruth;
+    if (!options.groundtruth_path.empty()) {
+        pyramid::VecsFile gt_file;
+        if (!gt_file.open(options.groundtruth_path) || !gt_file.validate()) {
+            return 1;
+        }
+        if (gt_file.num_vectors() < num_queries) {
+            std::cerr << "Error: ground truth covers " << gt_file.num_vectors() << " of "
+                      << num_queries << " queries" << std::endl;
+            return 1;
+        }
+        const pyramid::VecsView<int32_t> gt = gt_file.ivecs();
+        gt_k = static_cast<int>(gt.dim);
+        groundtruth.resize(num_queries * gt_k);
+        for (size_t q = 0; q < num_queries; q++) {
+            std::copy(gt.row(q), gt.row(q) + gt_k, groundtruth.data() + q * gt_k);
+        }
+    } else {
+        std::cerr << "Computing exact neighbors (k = " << gt_k << ")..." << std::endl;
+        const faiss::MetricType exact_metric = options.metric == pyramid::Metric::L2 ?
+                                               faiss::METRIC_L2 : faiss::METRIC_INNER_PRODUCT;
+        faiss::IndexFlat exact(dim, exact_metric);
+        std::vector<float> gt_distances(num_queries * gt_k);
+        std::vector<faiss::idx_t> gt_ids(num_queries * gt_k);
+        if (options.metric == pyramid::Metric::COSINE) {
+            // Exact cosine neighbors: inner product of normalized copies
+            std::vector<float> base_copy(base_vectors), query_copy(query_vectors);
+            pyramid::normalize_dataset(base_copy.data(), num_base, dim);
+            pyramid::normalize_dataset(query_copy.data(), num_queries, dim);
+            exact.add(num_base, base_copy.data());
+            exact.search(num_queries, query_copy.data(), gt_k, gt_distances.data(), gt_ids.data());
+        } else {
+            exact.add(num_base, base_vectors.data());
+            exact.search(num_queries, query_vectors.data(), gt_k, gt_distances.data(), gt_ids.data());
+        }
+        groundtruth.assign(gt_ids.begin(), gt_ids.end());
+    }
+    
+    std::vector<BenchResult> results;
+    std::vector<int> indices;
+    for (int clusters : options.clusters) {
+        for (int m : options.m) {
+            for (int efc : options.ef_construction) {
+                std::cerr << "Building clusters=" << clusters << " m=" << m << " efc=" << efc << "..." << std::endl;
+                
+                const auto build_start = Clock::now();
+                auto index = std::make_unique<pyramid::PyramidGraph>(dim, clusters, m, efc, 16, options.metric);
+                pyramid::BuildParams build_params;
+                build_params.balanced = options.balanced;
+                build_params.routing_levels = options.routing_levels;
+                build_params.transform = options.transform;
+                build_params.transform_dim = options.transform_dim;
+                build_params.locality_order = options.locality;
+                index->set_build_params(build_params);
+                if (options.stream) {
+                    if (!index->build_from_file(options.base_path)) {
+                        return 1;
+                    }
+                } else {
+                    index->build(base_vectors.data(), num_base);
+                }
+                if (options.transform != pyramid::VectorTransform::NONE) {
+                    index->set_rerank_vectors(base_vectors.data(), num_base);
+                }
+                const double build_ms = std::chrono::duration<double, std::milli>(Clock::now() - build_start).count();
+                const size_t index_bytes = index->memory_bytes();
+                
+                for (int efs : options.ef_search) {
+                    for (int nprobe : options.nprobe) {
+                        for (int k : options.k) {
+                            for (int threads : options.threads) {
+                                BenchResult result = {};
+                                result.clusters = clusters;
+                                result.m = m;
+                                result.ef_construction = efc;
+                                result.ef_search = efs;
+                                result.nprobe = nprobe;
+                                result.k = k;
+                                result.threads = threads;
+                                result.build_ms = build_ms;
+                                result.index_bytes = index_bytes;
+                                
+                                pyramid::SearchParams params;
+                                params.nprobe = nprobe;
+                                params.ef_search = efs;
+                                params.adaptive = options.adaptive;
+                                run_queries(*index, query_vectors, num_queries, dim, k, threads, options.engine, params,
+                                            indices, result);
+                                
+                                result.recall_1 = recall_at(indices, k, groundtruth, gt_k, num_queries, 1);
+                                result.recall_10 = recall_at(indices, k, groundtruth, gt_k, num_queries, 10);
+                                result.recall_100 = recall_at(indices, k, groundtruth, gt_k, num_queries, 100);
+                                results.push_back(result);
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+    
+    std::ofstream file;
+    if (!options.output_path.empty()) {
+        file.open(options.output_path);
+        if (!file) {
+            std::cerr << "Error: cannot open " << options.output_path << std::endl;
+            return 1;
+        }
+    }
+    std::ostream& out = options.output_path.empty() ? std::cout : file;
+    if (options.format == "json") {
+        write_json(out, results);
+    } else {
+        write_csv(out, results);
+    }
+    
+    return 0;
+}
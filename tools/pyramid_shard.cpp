@@ -0,0 +1,266 @@
+#include <iostream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <unordered_set>
+#include <chrono>
+#include <csignal>
+#include <cstdlib>
+#include <memory>
+#include <algorithm>
+
+#include "../include/pyramid.h"
+#include "../include/dataset.h"
+#include "../include/shard.h"
+
+// Partition-sharded serving over Unix-domain sockets.
+//
+// "serve" runs a shard worker that loads only the listed partitions of a
+// saved index and answers router requests. "query" loads only the meta-HNSW,
+// routes a query file across the workers and reports QPS, shard failures and
+// recall against an optional ground truth.
+
+namespace {
+
+using Clock = std::chrono::high_resolution_clock;
+
+pyramid::ShardServer* active_server = nullptr;  // Stopped by SIGINT/SIGTERM
+
+void stop_server(int) {
+    if (active_server) {
+        active_server->stop();
+    }
+}
+
+void print_usage(const char* program) {
+    std::cerr << "Usage: " << program << " serve --index FILE --socket PATH --partitions LIST [--no-mmap]\n"
+              << "             [--lazy] [--budget MB]\n"
+              << "       " << program << " query --index FILE --query FILE --shard PATH=LIST [--shard ...]\n"
+              << "             [--groundtruth FILE] [--k N] [--nprobe N] [--efs N] [--timeout MS] [--strict]\n"
+              << "LIST is a comma separated list of partitions or ranges, e.g. 0-4,9" << std::endl;
+}
+
+// Parse "0-4,9" into partition ids
+bool parse_partitions(const std::string& text, std::vector<int>& partitions) {
+    partitions.clear();
+    std::stringstream stream(text);
+    std::string item;
+    while (std::getline(stream, item, ',')) {
+        const size_t dash = item.find('-', 1);
+        char* end = nullptr;
+        const long first = std::strtol(item.c_str(), &end, 10);
+        long last = first;
+        if (dash != std::string::npos) {
+            last = std::strtol(item.c_str() + dash + 1, &end, 10);
+        }
+        if (item.empty() || *end != '\0' || first < 0 || last < first) {
+            std::cerr << "Error: invalid partition list '" << text << "'" << std::endl;
+            return false;
+        }
+        for (long c = first; c <= last; c++) {
+            partitions.push_back(static_cast<int>(c));
+        }
+    }
+    return !partitions.empty();
+}
+
+// Read a whole .fvecs file into memory
+bool read_fvecs(const std::string& path, std::vector<float>& data, size_t& n, int& dim) {
+    pyramid::VecsFile file;
+    if (!file.open(path)) {
+        return false;
+    }
+    n = file.num_vectors();
+    dim = file.dim();
+    data.resize(n * dim);
+    file.read_rows(0, n, data.data());
+    return true;
+}
+
+int run_serve(const std::string& index_path, const std::string& socket_path,
+              const pyramid::LoadOptions& load_options) {
+    auto index = pyramid::PyramidGraph::load(index_path, load_options);
+    if (!index) {
+        return 1;
+    }
+    
+    pyramid::ShardServer server(*index);
+    if (!server.listen(socket_path)) {
+        return 1;
+    }
+    active_server = &server;
+    std::signal(SIGINT, stop_server);
+    std::signal(SIGTERM, stop_server);
+    
+    std::cout << "Serving " << load_options.partitions->size() << " of " << index->num_partitions()
+              << " partitions on " << socket_path << std::endl;
+    server.serve();
+    active_server = nullptr;
+    
+    if (index->is_lazy()) {
+        const pyramid::ResidencyStats residency = index->residency_stats();
+        std::cout << "Sub-graph loads: " << residency.loads << " (" << residency.load_ms << " ms), failed: "
+                  << residency.load_failures << ", hits: " << residency.hits
+                  << ", evictions: " << residency.evictions << std::endl;
+    }
+    return 0;
+}
+
+int run_query(const std::string& index_path, const std::string& query_path, const std::string& groundtruth_path,
+              std::vector<pyramid::ShardEndpoint> shards, const pyramid::RouterOptions& router_options,
+              const pyramid::SearchParams& params, int k) {
+    // The router only needs the meta-HNSW graph
+    const std::vector<int> no_partitions;
+    auto index = pyramid::PyramidGraph::load(index_path, true, &no_partitions);
+    if (!index) {
+        return 1;
+    }
+    
+    std::vector<float> queries;
+    size_t num_queries = 0;
+    int dim = 0;
+    if (!read_fvecs(query_path, queries, num_queries, dim)) {
+        return 1;
+    }
+    if (dim != index->dim()) {
+        std::cerr << "Error: query dimension " << dim << " does not match the index (" << index->dim() << ")" << std::endl;
+        return 1;
+    }
+    
+    pyramid::ShardRouter router(std::move(index), std::move(shards), router_options);
+    std::vector<int> indices(num_queries * k);
+    std::vector<float> distances(num_queries * k);
+    size_t failed_queries = 0;
+    size_t partial_queries = 0;
+    
+    const auto start = Clock::now();
+#pragma omp parallel for schedule(dynamic, 16) reduction(+ : failed_queries, partial_queries)
+    for (size_t q = 0; q < num_queries; q++) {
+        pyramid::ShardSearchStatus status;
+        if (!router.search(queries.data() + q * dim, k, indices.data() + q * k, distances.data() + q * k,
+                           &params, &status)) {
+            failed_queries++;
+        } else if (status.partitions_missed > 0) {
+            partial_queries++;
+        }
+    }
+    const double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    
+    std::cout << "Queries: " << num_queries << ", QPS: " << num_queries / seconds
+              << ", failed: " << failed_queries << ", partial: " << partial_queries << std::endl;
+    
+    if (!groundtruth_path.empty()) {
+        pyramid::VecsFile groundtruth;
+        if (!groundtruth.open(groundtruth_path) || groundtruth.num_vectors() < num_queries) {
+            std::cerr << "Error: ground truth does not cover the queries" << std::endl;
+            return 1;
+        }
+        const int depth = std::min(k, groundtruth.dim());
+        size_t found = 0;
+        for (size_t q = 0; q < num_queries; q++) {
+            const int32_t* truth = groundtruth.ivecs().row(q);
+            std::unordered_set<int> expected(truth, truth + depth);
+            for (int j = 0; j < depth; j++) {
+                found += expected.count(indices[q * k + j]);
+            }
+        }
+        std::cout << "Recall@" << depth << ": " << static_cast<double>(found) / (num_queries * depth) << std::endl;
+    }
+    return 0;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    const std::string mode = argv[1];
+    
+    std::string index_path;
+    std::string socket_path;
+    std::string query_path;
+    std::string groundtruth_path;
+    std::vector<int> partitions;
+    std::vector<pyramid::ShardEndpoint> shards;
+    pyramid::RouterOptions router_options;
+    pyramid::SearchParams params;
+    int k = 10;
+    pyramid::LoadOptions load_options;
+    
+    for (int i = 2; i < argc; i++) {
+        const std::string arg = argv[i];
+        if (arg == "--no-mmap") {
+            load_options.use_mmap = false;
+            continue;
+        }
+        if (arg == "--lazy") {
+            load_options.lazy = true;
+            continue;
+        }
+        if (arg == "--strict") {
+            router_options.partial_results = pyramid::PartialResults::FAIL;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            std::cerr << "Error: missing value for " << arg << std::endl;
+            return 1;
+        }
+        
+        const std::string value = argv[++i];
+        bool ok = true;
+        if (arg == "--index") {
+            index_path = value;
+        } else if (arg == "--socket") {
+            socket_path = value;
+        } else if (arg == "--partitions") {
+            ok = parse_partitions(value, partitions);
+        } else if (arg == "--query") {
+            query_path = value;
+        } else if (arg == "--groundtruth") {
+            groundtruth_path = value;
+        } else if (arg == "--shard") {
+            const size_t separator = value.find('=');
+            pyramid::ShardEndpoint shard;
+            shard.socket_path = value.substr(0, separator);
+            ok = separator != std::string::npos &&
+                 parse_partitions(value.substr(separator + 1), shard.partitions);
+            shards.push_back(shard);
+        } else if (arg == "--k") {
+            k = std::atoi(value.c_str());
+            ok = k > 0;
+        } else if (arg == "--nprobe") {
+            params.nprobe = std::atoi(value.c_str());
+            ok = params.nprobe > 0;
+        } else if (arg == "--efs") {
+            params.ef_search = std::atoi(value.c_str());
+            ok = params.ef_search > 0;
+        } else if (arg == "--budget") {
+            const double budget_mb = std::atof(value.c_str());
+            ok = budget_mb > 0.0;
+            load_options.lazy = true;
+            load_options.residency_budget = static_cast<size_t>(budget_mb * (1 << 20));
+        } else if (arg == "--timeout") {
+            router_options.timeout_ms = std::atoi(value.c_str());
+            ok = router_options.timeout_ms > 0;
+        } else {
+            std::cerr << "Error: unknown option " << arg << std::endl;
+            ok = false;
+        }
+        if (!ok) {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    
+    if (mode == "serve" && !index_path.empty() && !socket_path.empty() && !partitions.empty()) {
+        load_options.partitions = &partitions;
+        return run_serve(index_path, socket_path, load_options);
+    }
+    if (mode == "query" && !index_path.empty() && !query_path.empty() && !shards.empty()) {
+        return run_query(index_path, query_path, groundtruth_path, std::move(shards), router_options, params, k);
+    }
+    print_usage(argv[0]);
+    return 1;
+}
@@ -0,0 +1,137 @@
+#include <iostream>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <iomanip>
+#include <string>
+#include <cstdlib>
+#include <cmath>
+#include <functional>
+
+#include "../include/similarity.h"
+
+// Microbenchmark for the distance kernels in similarity.cpp.
+//
+// Every kernel is timed at each SIMD level the CPU supports, starting with the
+// scalar loops, and reported as nanoseconds per call and speedup over scalar.
+// Usage: similarity_bench [dim] [n]
+
+namespace {
+
+using Clock = std::chrono::high_resolution_clock;
+
+volatile float sink = 0.0f;  // Keeps results alive so the loops are not optimized away
+
+// Time fn over several repetitions and return the best nanoseconds per call
+template <typename Fn>
+double time_ns(size_t calls, Fn fn) {
+    double best = 0.0;
+    for (int rep = 0; rep < 5; rep++) {
+        const auto start = Clock::now();
+        fn();
+        const double ns = std::chrono::duration<double, std::nano>(Clock::now() - start).count() / calls;
+        if (rep == 0 || ns < best) {
+            best = ns;
+        }
+    }
+    return best;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    const int dim = argc > 1 ? std::atoi(argv[1]) : 128;
+    const size_t n = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 100000;
+    if (dim <= 0 || n == 0) {
+        std::cerr << "Usage: " << argv[0] << " [dim] [n]" << std::endl;
+        return 1;
+    }
+
+    std::mt19937 rng(1234);
+    std::uniform_real_distribution<float> uniform(-1.0f, 1.0f);
+    std::vector<float> data(n * dim);
+    for (float& v : data) {
+        v = uniform(rng);
+    }
+    std::vector<float> query(data.begin(), data.begin() + dim);
+    std::vector<int64_t> ids(n);
+    for (size_t i = 0; i < n; i++) {
+        ids[i] = static_cast<int64_t>(rng() % n);
+    }
+    std::vector<float> distances(n);
+    const size_t nq = 64;
+    const size_t matrix_n = std::min<size_t>(n, 4096);
+    std::vector<float> matrix(nq * matrix_n);
+
+    const pyramid::SimdLevel best = pyramid::detect_simd_level();
+    std::cout << "dim=" << dim << " n=" << n << " detected=" << pyramid::simd_level_name(best) << "\n";
+    std::cout << std::left << std::setw(22) << "kernel" << std::setw(10) << "level"
+              << std::right << std::setw(14) << "ns/call" << std::setw(10) << "speedup" << "\n";
+
+    struct Kernel {
+        std::string name;
+        size_t calls;
+        std::function<void()> run;
+    };
+    const std::vector<Kernel> kernels = {
+        {"euclidean_distance", n, [&] {
+            float acc = 0.0f;
+            for (size_t i = 0; i < n; i++) {
+                acc += pyramid::euclidean_distance(query.data(), data.data() + i * dim, dim);
+            }
+            sink = acc;
+        }},
+        {"angular_distance", n, [&] {
+            float acc = 0.0f;
+            for (size_t i = 0; i < n; i++) {
+                acc += pyramid::angular_distance(query.data(), data.data() + i * dim, dim);
+            }
+            sink = acc;
+        }},
+        {"euclidean_batch", n, [&] {
+            pyramid::euclidean_distance_batch(query.data(), data.data(), n, dim, distances.data());
+            sink = distances[n - 1];
+        }},
+        {"euclidean_by_ids", n, [&] {
+            pyramid::euclidean_distance_by_ids(query.data(), data.data(), dim, dim, ids.data(), n, distances.data());
+            sink = distances[n - 1];
+        }},
+        {"euclidean_matrix", nq * matrix_n, [&] {
+            pyramid::euclidean_distance_matrix(data.data(), nq, data.data(), matrix_n, dim, matrix.data());
+            sink = matrix.back();
+        }},
+    };
+
+    std::vector<pyramid::SimdLevel> levels = {pyramid::SimdLevel::SCALAR};
+    for (pyramid::SimdLevel level : {pyramid::SimdLevel::SSE, pyramid::SimdLevel::AVX2, pyramid::SimdLevel::AVX512}) {
+        if (level <= best) {
+            levels.push_back(level);
+        }
+    }
+
+    std::cout << std::fixed << std::setprecision(2);
+    for (const Kernel& kernel : kernels) {
+        double scalar_ns = 0.0;
+        for (pyramid::SimdLevel level : levels) {
+            pyramid::set_simd_level(level);
+            const double ns = time_ns(kernel.calls, kernel.run);
+            if (level == pyramid::SimdLevel::SCALAR) {
+                scalar_ns = ns;
+            }
+            std::cout << std::left << std::setw(22) << kernel.name << std::setw(10) << pyramid::simd_level_name(level)
+                      << std::right << std::setw(14) << ns << std::setw(9) << scalar_ns / ns << "x\n";
+        }
+    }
+
+    // normalize_dataset: parallel rows at the best level, on a fresh copy each time
+    pyramid::set_simd_level(best);
+    std::vector<float> copy;
+    const double normalize_ns = time_ns(n, [&] {
+        copy = data;
+        pyramid::normalize_dataset(copy.data(), n, dim);
+    });
+    std::cout << std::left << std::setw(22) << "normalize_dataset" << std::setw(10) << pyramid::simd_level_name(best)
+              << std::right << std::setw(14) << normalize_ns << "   (includes copy)\n";
+
+    return 0;
+}